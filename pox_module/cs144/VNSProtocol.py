@@ -381,6 +381,126 @@ class VNSAuthStatus(LTMessage):
         return 'AUTH_STATUS: ' + ' auth_ok=%s msg=%s' % (str(self.auth_ok), self.msg)
 VNS_MESSAGES.append(VNSAuthStatus)
 
+class VNSBatchHello(LTMessage):
+    """Offers (server) or accepts (client) VNSPacketBatch.  Neither side
+    sends batches before it has received the other side's hello."""
+    @staticmethod
+    def get_type():
+        return 1024
+
+    def __init__(self):
+        LTMessage.__init__(self)
+
+    def length(self):
+        return 0
+
+    def pack(self):
+        return ''
+
+    @staticmethod
+    def unpack(body):
+        return VNSBatchHello()
+
+    def __str__(self):
+        return 'BATCH_HELLO'
+VNS_MESSAGES.append(VNSBatchHello)
+
+class VNSPacketBatch(LTMessage):
+    """Several VNSPacket messages in one.  The body is each packet packed as
+    a complete VNSPacket message, length and type included."""
+    @staticmethod
+    def get_type():
+        return 2048
+
+    def __init__(self, packets):
+        LTMessage.__init__(self)
+        self.packets = packets
+
+    ENTRY_FORMAT = '> II'
+    ENTRY_SIZE = struct.calcsize(ENTRY_FORMAT)
+
+    def length(self):
+        return sum(VNSPacketBatch.ENTRY_SIZE + p.length() for p in self.packets)
+
+    def pack(self):
+        return ''.join(struct.pack(VNSPacketBatch.ENTRY_FORMAT,
+                                   VNSPacketBatch.ENTRY_SIZE + p.length(),
+                                   VNSPacket.get_type()) + p.pack()
+                       for p in self.packets)
+
+    @staticmethod
+    def unpack(body):
+        packets = []
+        offset = 0
+        while offset + VNSPacketBatch.ENTRY_SIZE <= len(body):
+            msg_len, msg_type = struct.unpack(VNSPacketBatch.ENTRY_FORMAT,
+                                              body[offset:offset + VNSPacketBatch.ENTRY_SIZE])
+            if msg_len < VNSPacketBatch.ENTRY_SIZE or offset + msg_len > len(body):
+                raise VNSProtocolException('malformed packet batch')
+            if msg_type == VNSPacket.get_type():
+                packets.append(VNSPacket.unpack(body[offset + VNSPacketBatch.ENTRY_SIZE:offset + msg_len]))
+            offset += msg_len
+        return VNSPacketBatch(packets)
+
+    def __str__(self):
+        return 'PACKET_BATCH: %u packets' % len(self.packets)
+VNS_MESSAGES.append(VNSPacketBatch)
+
+class VNSShmOffer(LTMessage):
+    """Offers the shared memory transport (see VNSShm.py).  A client that
+    wants it passes its rings over the Unix socket at path, along with
+    cookie."""
+    @staticmethod
+    def get_type():
+        return 4096
+
+    def __init__(self, cookie, path):
+        LTMessage.__init__(self)
+        self.cookie = cookie
+        self.path = str(path)
+
+    def length(self):
+        return VNSShmOffer.SIZE
+
+    FORMAT = '> I108s'
+    SIZE = struct.calcsize(FORMAT)
+
+    def pack(self):
+        return struct.pack(VNSShmOffer.FORMAT, self.cookie, self.path)
+
+    @staticmethod
+    def unpack(body):
+        t = struct.unpack(VNSShmOffer.FORMAT, body)
+        return VNSShmOffer(t[0], strip_null_chars(t[1]))
+
+    def __str__(self):
+        return 'SHM_OFFER: %s' % self.path
+VNS_MESSAGES.append(VNSShmOffer)
+
+class VNSShmReady(LTMessage):
+    """The server mapped the client's rings; packets go through them from
+    now on."""
+    @staticmethod
+    def get_type():
+        return 8192
+
+    def __init__(self):
+        LTMessage.__init__(self)
+
+    def length(self):
+        return 0
+
+    def pack(self):
+        return ''
+
+    @staticmethod
+    def unpack(body):
+        return VNSShmReady()
+
+    def __str__(self):
+        return 'SHM_READY'
+VNS_MESSAGES.append(VNSShmReady)
+
 VNS_PROTOCOL = LTProtocol(VNS_MESSAGES, 'I', 'I')
 
 def create_vns_server(port, recv_callback, new_conn_callback, lost_conn_callback, verbose=True):
@@ -0,0 +1,133 @@
+"""Shared memory packet transport for a router on the same host.
+
+The router creates a memfd holding two single-producer/single-consumer
+rings plus two eventfds and passes them over a Unix socket (see
+router/sr_shm.h for the C side; the layout here must match it).  All
+integers in the shared region are in host byte order.  Each side writes
+the other side's eventfd after adding packets to a ring.
+"""
+
+import mmap
+import os
+import struct
+
+SHM_MAGIC = 0x53525348   # "SRSH"
+SHM_VERSION = 1
+CACHELINE = 64
+
+REGION_HEADER_FORMAT = '=IIII'
+RING_HEADER_SIZE = 2 * CACHELINE      # head, then tail, each on its own line
+SLOT_HEADER_FORMAT = '=I16s'
+SLOT_HEADER_SIZE = struct.calcsize(SLOT_HEADER_FORMAT)
+
+ATTACH_FORMAT = '>III'                # magic, cookie, size
+ATTACH_SIZE = struct.calcsize(ATTACH_FORMAT)
+
+class ShmException(Exception):
+    pass
+
+class ShmRing:
+    """One direction of the transport.  head is written by the producer,
+    tail by the consumer."""
+    def __init__(self, mm, offset, slots, slot_size):
+        self.mm = mm
+        self.offset = offset
+        self.slots = slots
+        self.slot_size = slot_size
+
+    def size(self):
+        return RING_HEADER_SIZE + self.slots * self.slot_size
+
+    def _get(self, pos):
+        return struct.unpack_from('=I', self.mm, self.offset + pos)[0]
+
+    def _set(self, pos, value):
+        struct.pack_into('=I', self.mm, self.offset + pos, value & 0xffffffff)
+
+    def _slot(self, index):
+        return self.offset + RING_HEADER_SIZE + (index % self.slots) * self.slot_size
+
+    def push(self, intf_name, frame):
+        """Adds a frame.  Returns False if the ring is full or the frame is
+        too big for a slot."""
+        head = self._get(0)
+        tail = self._get(CACHELINE)
+        if (head - tail) & 0xffffffff >= self.slots:
+            return False
+        if len(frame) > self.slot_size - SLOT_HEADER_SIZE:
+            return False
+        slot = self._slot(head)
+        struct.pack_into(SLOT_HEADER_FORMAT, self.mm, slot, len(frame), intf_name)
+        self.mm[slot + SLOT_HEADER_SIZE:slot + SLOT_HEADER_SIZE + len(frame)] = frame
+        # the slot is complete before head moves (stores are not reordered
+        # on the x86 hosts this runs on)
+        self._set(0, head + 1)
+        return True
+
+    def pop_all(self):
+        """Removes and returns every waiting frame as (intf_name, frame)."""
+        packets = []
+        head = self._get(0)
+        tail = self._get(CACHELINE)
+        while tail != head:
+            slot = self._slot(tail)
+            length, intf_name = struct.unpack_from(SLOT_HEADER_FORMAT, self.mm, slot)
+            length = min(length, self.slot_size - SLOT_HEADER_SIZE)
+            frame = self.mm[slot + SLOT_HEADER_SIZE:slot + SLOT_HEADER_SIZE + length]
+            packets.append((intf_name.split(b'\x00', 1)[0], frame))
+            tail = (tail + 1) & 0xffffffff
+        self._set(CACHELINE, tail)
+        return packets
+
+class ShmChannel:
+    """Server end of a router's rings.  fileno() is the eventfd the router
+    writes, so the channel can be handed to reactor.addReader()."""
+    def __init__(self, mem_fd, to_router_fd, from_router_fd, size, recv_callback):
+        self.mem_fd = mem_fd
+        self.to_router_fd = to_router_fd
+        self.from_router_fd = from_router_fd
+        self.recv_callback = recv_callback
+        self.mm = mmap.mmap(mem_fd, size)
+
+        magic, version, slots, slot_size = struct.unpack_from(REGION_HEADER_FORMAT, self.mm, 0)
+        if magic != SHM_MAGIC or version != SHM_VERSION:
+            self.close()
+            raise ShmException('bad shared memory header')
+        self.to_router = ShmRing(self.mm, CACHELINE, slots, slot_size)
+        self.from_router = ShmRing(self.mm, CACHELINE + self.to_router.size(), slots, slot_size)
+        if CACHELINE + 2 * self.to_router.size() > size:
+            self.close()
+            raise ShmException('shared memory region too small')
+
+    def send(self, intf_name, frame):
+        """Adds a frame for the router and wakes it.  Returns False if the
+        frame was dropped."""
+        if not self.to_router.push(intf_name, frame):
+            return False
+        os.write(self.to_router_fd, struct.pack('=Q', 1))
+        return True
+
+    def fileno(self):
+        return self.from_router_fd
+
+    def doRead(self):
+        try:
+            os.read(self.from_router_fd, 8)
+        except OSError:
+            pass
+        for intf_name, frame in self.from_router.pop_all():
+            self.recv_callback(intf_name, frame)
+
+    def connectionLost(self, reason):
+        pass
+
+    def logPrefix(self):
+        return 'ShmChannel'
+
+    def close(self):
+        self.mm.close()
+        for fd in (self.mem_fd, self.to_router_fd, self.from_router_fd):
+            try:
+                os.close(fd)
+            except OSError:
+                pass
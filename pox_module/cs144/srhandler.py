@@ -23,6 +23,27 @@ from twisted.internet import reactor
 from VNSProtocol import VNS_DEFAULT_PORT, create_vns_server
 from VNSProtocol import VNSOpen, VNSClose, VNSPacket, VNSOpenTemplate, VNSBanner
 from VNSProtocol import VNSRtable, VNSAuthRequest, VNSAuthReply, VNSAuthStatus, VNSInterface, VNSHardwareInfo
+from VNSProtocol import VNSBatchHello, VNSPacketBatch, VNSShmOffer, VNSShmReady
+from VNSShm import ShmChannel, ShmException, ATTACH_FORMAT, ATTACH_SIZE, SHM_MAGIC
+import random
+import struct
+
+# The shared memory transport needs a Twisted that can receive file
+# descriptors over Unix sockets. Without one it is never offered.
+try:
+  from zope.interface import implementer
+  from twisted.internet.interfaces import IFileDescriptorReceiver
+  from twisted.internet.protocol import Protocol, Factory
+  SHM_SUPPORTED = True
+except ImportError:
+  SHM_SUPPORTED = False
+
+SHM_SOCKET_PATH = '/tmp/sr_shm_%d.sock'
+
+# Packets for a client that accepted batching are held until the reactor
+# gets to them, or until this many are waiting
+BATCH_MAX_PACKETS = 32
+BATCH_MAX_BYTES = 16384
 
 log = core.getLogger()
 
@@ -49,17 +70,68 @@ class SRServerListener(EventMixin):
     self.listen_port = port
     self.intfname_to_port = {}
     self.port_to_intfname = {}
+    self.batch_lock = threading.Lock()
+    self.batch_clients = set()     # clients that accepted VNSPacketBatch
+    self.batch_pending = {}        # client -> [VNSPacket, ...] not sent yet
+    self.shm_path = None
+    self.shm_cookies = {}          # offer cookie -> client
+    self.shm_channels = {}         # client -> (ShmChannel, attach protocol)
     self.server = create_vns_server(port,
                                     self._handle_recv_msg,
                                     self._handle_new_client,
                                     self._handle_client_disconnected)
     log.info('created server')
+    if SHM_SUPPORTED:
+      self._listen_shm(SHM_SOCKET_PATH % port)
     return
 
+  def _listen_shm(self, path):
+    try:
+      if os.path.exists(path):
+        os.unlink(path)
+      reactor.listenUNIX(path, SRShmAttachFactory(self))
+      self.shm_path = path
+      log.info('offering shared memory transport at %s' % path)
+    except Exception as e:
+      log.info('shared memory transport not available: %s' % e)
+
   def broadcast(self, message):
     log.debug('Broadcasting message: %s', message)
     for client in self.srclients:
-      client.send(message)
+      shm = self.shm_channels.get(client)
+      if shm is not None and message.get_type() == VNSPacket.get_type():
+        try:
+          if not shm[0].send(message.intf_name, message.ethernet_frame):
+            log.debug('shared memory ring full, dropping packet')
+        except (ValueError, OSError):
+          pass   # detached meanwhile
+      elif client in self.batch_clients and message.get_type() == VNSPacket.get_type():
+        self._queue_packet(client, message)
+      else:
+        client.send(message)
+
+  def _queue_packet(self, client, packet):
+    # called from the POX thread; the reactor thread sends the batch
+    with self.batch_lock:
+      pending = self.batch_pending.setdefault(client, [])
+      pending.append(packet)
+      size = sum(p.length() for p in pending)
+      if len(pending) == 1:
+        reactor.callFromThread(self._flush_packets, client)
+      elif len(pending) >= BATCH_MAX_PACKETS or size >= BATCH_MAX_BYTES:
+        del self.batch_pending[client]
+        reactor.callFromThread(self._send_packets, client, pending)
+
+  def _flush_packets(self, client):
+    with self.batch_lock:
+      pending = self.batch_pending.pop(client, [])
+    self._send_packets(client, pending)
+
+  def _send_packets(self, client, packets):
+    if len(packets) == 1:
+      client.send(packets[0])
+    elif packets:
+      client.send(VNSPacketBatch(packets))
 
   def _handle_SRPacketIn(self, event):
     log.debug("SRServerListener catch SRPacketIn event, port=%d, pkt=%r" % (event.port, event.pkt))
@@ -102,6 +174,12 @@ class SRServerListener(EventMixin):
       self._handle_close_msg(conn)
     elif vns_msg.get_type() == VNSPacket.get_type():
       self._handle_packet_msg(conn, vns_msg)
+    elif vns_msg.get_type() == VNSPacketBatch.get_type():
+      for packet in vns_msg.packets:
+        self._handle_packet_msg(conn, packet)
+    elif vns_msg.get_type() == VNSBatchHello.get_type():
+      log.debug('client %s accepted packet batches' % conn)
+      self.batch_clients.add(conn)
     elif vns_msg.get_type() == VNSOpenTemplate.get_type():
       # TODO: see if this is needed...
       self._handle_open_template_msg(conn, vns_msg)
@@ -121,8 +199,39 @@ class SRServerListener(EventMixin):
     conn.send(VNSAuthRequest(salt))
     return
 
+  def _attach_shm(self, proto, magic, cookie, size, fds):
+    conn = self.shm_cookies.pop(cookie, None)
+    if magic != SHM_MAGIC or conn is None or len(fds) != 3:
+      log.info('rejected shared memory attach')
+      return None
+    def recv(intf_name, frame):
+      self._handle_packet_msg(conn, VNSPacket(intf_name, frame))
+    try:
+      channel = ShmChannel(fds[0], fds[1], fds[2], size, recv)
+    except (ShmException, EnvironmentError) as e:
+      log.info('could not map shared memory: %s' % e)
+      return None
+    reactor.addReader(channel)
+    self.shm_channels[conn] = (channel, proto)
+    conn.send(VNSShmReady())
+    log.info('client %s switched to shared memory' % conn)
+    return channel
+
+  def _detach_shm(self, proto):
+    for conn, (channel, attach) in self.shm_channels.items():
+      if attach is proto:
+        del self.shm_channels[conn]
+        reactor.removeReader(channel)
+        channel.close()
+
   def _handle_client_disconnected(self, conn):
     log.info("disconnected")
+    self.batch_clients.discard(conn)
+    shm = self.shm_channels.get(conn)
+    if shm is not None:
+      shm[1].transport.loseConnection()
+    with self.batch_lock:
+      self.batch_pending.pop(conn, None)
     conn.transport.loseConnection()
     return
 
@@ -133,6 +242,13 @@ class SRServerListener(EventMixin):
       conn.send(VNSHardwareInfo(self.interfaces))
     except:
       log.debug('interfaces not populated yet')  
+    # offer batching; clients that do not know it ignore the message
+    conn.send(VNSBatchHello())
+    # same for shared memory, which only a client on this host can take
+    if self.shm_path is not None:
+      cookie = random.getrandbits(32)
+      self.shm_cookies[cookie] = conn
+      conn.send(VNSShmOffer(cookie, self.shm_path))
     return
 
   def _handle_close_msg(self, conn):
@@ -153,6 +269,39 @@ class SRServerListener(EventMixin):
     log.debug('SRServerHandler raise packet out event')
     core.cs144_srhandler.raiseEvent(SRPacketOut(pkt, out_port))
 
+if SHM_SUPPORTED:
+  @implementer(IFileDescriptorReceiver)
+  class SRShmAttachProtocol(Protocol):
+    ''' Receives a router's shared memory rings over the Unix socket '''
+    def __init__(self, listener):
+      self.listener = listener
+      self.fds = []
+      self.buf = ''
+      self.attached = False
+
+    def fileDescriptorReceived(self, fd):
+      self.fds.append(fd)
+
+    def dataReceived(self, data):
+      self.buf += data
+      if not self.attached and len(self.buf) >= ATTACH_SIZE:
+        magic, cookie, size = struct.unpack(ATTACH_FORMAT, self.buf[:ATTACH_SIZE])
+        self.attached = True
+        if self.listener._attach_shm(self, magic, cookie, size, self.fds) is None:
+          for fd in self.fds:
+            os.close(fd)
+          self.transport.loseConnection()
+
+    def connectionLost(self, reason):
+      self.listener._detach_shm(self)
+
+  class SRShmAttachFactory(Factory):
+    def __init__(self, listener):
+      self.listener = listener
+
+    def buildProtocol(self, addr):
+      return SRShmAttachProtocol(self.listener)
+
 class SRPacketOut(Event):
   '''Event to raise upon receicing a packet back from SR'''
 
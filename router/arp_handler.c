@@ -17,11 +17,11 @@
 #include "icmp_handler.h"
 #include "sr_protocol.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 
-void arp_send_reply(struct sr_instance *sr , uint8_t *packet, unsigned int len, char *interface) {
+void arp_send_reply(struct sr_instance *sr , uint8_t *packet, unsigned int len, struct sr_if *sourceIf) {
 
     int i;
-    struct sr_if *sourceIf = sr_get_interface(sr, interface);
     struct sr_ethernet_hdr *ethHeader = (struct sr_ethernet_hdr *) packet;
 	struct sr_arp_hdr *arpHeader = (struct sr_arp_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 
@@ -50,15 +50,14 @@ void arp_send_reply(struct sr_instance *sr , uint8_t *packet, unsigned int len,
         replyArp->ar_tha[i] = arpHeader->ar_sha[i];
     }
 
-    sr_send_packet(sr, reply, sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr), interface);	
+    sr_send_packet(sr, reply, sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr), sourceIf);	
     free(reply);
 
 }
 
-void send_packet_to_dest(struct sr_instance *sr , uint8_t *packet, unsigned int len, char *interface, unsigned char *dest_mac, uint32_t dest_ip) {
+void send_packet_to_dest(struct sr_instance *sr , uint8_t *packet, unsigned int len, struct sr_if *sourceIf, unsigned char *dest_mac, uint32_t dest_ip) {
 
     int i;
-	struct sr_if *sourceIf = sr_get_interface(sr, interface);
     struct sr_ethernet_hdr *ethHeader = (struct sr_ethernet_hdr *) packet;
     struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(sr_ethernet_hdr_t));
 
@@ -67,19 +66,20 @@ void send_packet_to_dest(struct sr_instance *sr , uint8_t *packet, unsigned int
 		ethHeader->ether_shost[i] = sourceIf->addr[i];
         ethHeader->ether_dhost[i] = dest_mac[i];
     }
-    ipHeader->ip_dst = dest_ip;
-	ipHeader->ip_sum = 0;
-	ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+    if (ipHeader->ip_dst != dest_ip) {
+		ipHeader->ip_sum = cksum_update32(ipHeader->ip_sum, ipHeader->ip_dst, dest_ip);
+		ipHeader->ip_dst = dest_ip;
+	}
 
-    sr_send_packet(sr, packet, len, interface);	
+    sr_send_packet(sr, packet, len, sourceIf);	
 
 }
 
 void arp_send_request(struct sr_instance *sr , struct sr_arpreq *arp) {
 
 	int i;
-	struct sr_rt *rt = findLongestMatchPrefix(sr->routing_table, htonl(arp->ip));
-	struct sr_if *sourceIf = sr_get_interface(sr, rt->interface);
+	struct sr_rt *rt = sr_fib_lookup(sr, htonl(arp->ip));
+	struct sr_if *sourceIf = sr_rt_interface(sr, rt);
 
 	/* Initialize request packet */
 	uint8_t *req = malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t));
@@ -105,7 +105,7 @@ void arp_send_request(struct sr_instance *sr , struct sr_arpreq *arp) {
 		reqArp->ar_tha[i] = 0x00;
 		reqArp->ar_sha[i] = sourceIf->addr[i];
 	}
-	sr_send_packet(sr, req, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t), sourceIf->name);
+	sr_send_packet(sr, req, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t), sourceIf);
 	free(req);
 
 }
@@ -116,7 +116,7 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
 		/* Max number of ARP requests send. Host is unreachable */
 		struct sr_packet *pkt = req->packets;
 		while (pkt != NULL) {
-			icmp_send_host_unreachable(sr, pkt->buf, pkt->len, pkt->iface);
+			icmp_send_host_unreachable(sr, pkt->buf, pkt->len, sr_get_interface_by_index(sr, pkt->ifindex));
 			pkt = pkt->next;
 		}
 		sr_arpreq_destroy(&(sr->cache), req);
@@ -126,5 +126,20 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
 		arp_send_request(sr, req);
 		req->times_sent++;
 		req->sent = time(NULL);
+		sr_timer_set(&(sr->cache.timers), &(req->timer), SR_ARPREQ_INTERVAL);
 	}
 }
+
+void arp_queue_packet(struct sr_instance *sr, uint32_t ip, uint8_t *packet, unsigned int len, struct sr_if *iface) {
+
+	/* Hold the cache lock so its timer cannot destroy the request in between */
+	pthread_mutex_lock(&(sr->cache.lock));
+
+	struct sr_arpreq *req = sr_arpcache_queuereq(&(sr->cache), ip, packet, len, iface->index);
+	if (req->times_sent == 0) {
+		/* First miss for this IP. Ask now instead of waiting for the timer */
+		handle_arpreq(sr, req);
+	}
+
+	pthread_mutex_unlock(&(sr->cache.lock));
+}
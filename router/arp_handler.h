@@ -5,8 +5,9 @@
 #include "sr_protocol.h"
 #include "sr_router.h"
 
-void arp_send_reply(struct sr_instance * , uint8_t *, unsigned int , char *);
+void arp_send_reply(struct sr_instance * , uint8_t *, unsigned int , struct sr_if *);
 void arp_send_request(struct sr_instance * , struct sr_arpreq *);
 void handle_arpreq(struct sr_instance *, struct sr_arpreq *);
+void arp_queue_packet(struct sr_instance *, uint32_t, uint8_t *, unsigned int, struct sr_if *);
 
-void send_packet_to_dest(struct sr_instance * , uint8_t *, unsigned int , char *, unsigned char *, uint32_t);
+void send_packet_to_dest(struct sr_instance * , uint8_t *, unsigned int , struct sr_if *, unsigned char *, uint32_t);
@@ -0,0 +1,113 @@
+/**********************************************************************
+ * file: cksum_bench.c
+ *
+ * Description:
+ *
+ * Microbenchmark for the cksum_sum() kernels (make bench). Each kernel
+ * the CPU supports is checked against a plain 16-bit word loop on random
+ * data and lengths, then timed on common packet sizes.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sr_cksum.h"
+
+#define BENCH_BUF 70000
+#define BENCH_BYTES 200000000L		/* bytes summed per kernel and size */
+#define BENCH_CHECKS 100000
+
+static const char *kernels[] = { "scalar", "sse2", "avx2" };
+static const int sizes[] = { 20, 64, 128, 576, 1500, 9000 };
+
+/* What the kernels must match: big-endian words, end-around carry */
+static uint16_t cksum_reference(const uint8_t *data, int len) {
+	uint32_t sum = 0;
+
+	for (; len >= 2; data += 2, len -= 2) {
+		sum += data[0] << 8 | data[1];
+	}
+	if (len > 0) {
+		sum += data[0] << 8;
+	}
+	while (sum > 0xffff) {
+		sum = (sum >> 16) + (sum & 0xffff);
+	}
+	return sum;
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Random offsets and lengths up to 64KB, with runs of all-ones and zeros
+   to catch carry handling. Returns the number of mismatches */
+static int bench_check(uint8_t *buf) {
+	int i, bad = 0;
+
+	srand(1);
+	for (i = 0; i < BENCH_CHECKS; i++) {
+		int off = rand() % 16;
+		int len = rand() % (i % 100 == 0 ? 65000 : 1600);
+		if (i % 50 == 0) {
+			memset(buf + off, 0xff, len);
+		} else if (i % 77 == 0) {
+			memset(buf + off, 0, len);
+		}
+
+		if (cksum_sum(buf + off, len) != cksum_reference(buf + off, len)) {
+			bad++;
+		}
+
+		if (i % 50 == 0 || i % 77 == 0) {
+			int k;
+			for (k = 0; k < BENCH_BUF; k++) {
+				buf[k] = rand();
+			}
+		}
+	}
+	return bad;
+}
+
+int main(void) {
+	static uint8_t buf[BENCH_BUF];
+	unsigned int k, s;
+	int i;
+
+	for (i = 0; i < BENCH_BUF; i++) {
+		buf[i] = rand();
+	}
+
+	printf("Picked for this CPU: %s\n", cksum_impl_name());
+	printf("%-8s %8s", "kernel", "errors");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		printf(" %7dB", sizes[s]);
+	}
+	printf("   (ns per call)\n");
+
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (cksum_use(kernels[k]) != 0) {
+			printf("%-8s not supported\n", kernels[k]);
+			continue;
+		}
+		printf("%-8s %8d", kernels[k], bench_check(buf));
+
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			long iters = BENCH_BYTES / sizes[s], n;
+			volatile uint32_t sink = 0;
+
+			/* Vary the alignment like packets in a receive ring */
+			double start = bench_now();
+			for (n = 0; n < iters; n++) {
+				sink += cksum_sum(buf + (n & 7), sizes[s]);
+			}
+			printf(" %8.1f", (bench_now() - start) / iters * 1e9);
+		}
+		printf("\n");
+	}
+	return 0;
+}
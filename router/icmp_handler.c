@@ -17,12 +17,12 @@
 void icmp_send_echo_reply(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        struct sr_if* iface/* lent */)
 {
 	/* Modify and resend packet at echo reply */
 	/* Ethernet header */
 	int i;
-	unsigned char *sourceEth = sr_get_interface(sr, interface)->addr;
+	unsigned char *sourceEth = iface->addr;
 	struct sr_ethernet_hdr *ethHeader = (struct sr_ethernet_hdr *) packet;
 	for (i = 0; i < ETHER_ADDR_LEN; i++) {
 		ethHeader->ether_dhost[i] = ethHeader->ether_shost[i];
@@ -30,7 +30,7 @@ void icmp_send_echo_reply(struct sr_instance* sr,
 	}
 
 	/* IP header */
-	uint32_t sourceIP = sr_get_interface(sr, interface)->ip;
+	uint32_t sourceIP = iface->ip;
 	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(sr_ethernet_hdr_t));
 	ipHeader->ip_dst = ipHeader->ip_src;
 	ipHeader->ip_src = sourceIP;
@@ -46,54 +46,54 @@ void icmp_send_echo_reply(struct sr_instance* sr,
 	icmpHeader->icmp_sum = cksum(icmpHeader, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
 
 	/* Record this IP into arp cache if not found */
-	struct sr_arpentry *arpEntry = sr_arpcache_lookup(&(sr->cache), ntohl(ipHeader->ip_dst));
-	if (arpEntry == NULL) {
-		sr_arpcache_queuereq(&(sr->cache), ntohl(ipHeader->ip_dst), packet, len, interface);
+	unsigned char destMac[ETHER_ADDR_LEN];
+	if (!sr_arpcache_lookup_r(&(sr->cache), ntohl(ipHeader->ip_dst), destMac)) {
+		arp_queue_packet(sr, ntohl(ipHeader->ip_dst), packet, len, iface);
 	} else {
-		sr_send_packet(sr, packet, len, interface);	
+		sr_send_packet(sr, packet, len, iface);	
 	}	
 }
 
 void icmp_send_net_unreachable(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        struct sr_if* iface/* lent */)
 {
-	icmp_send_type3(sr, packet, len, interface, icmp_unreachable_type, icmp_net_unreachable);
+	icmp_send_type3(sr, packet, len, iface, icmp_unreachable_type, icmp_net_unreachable);
 }
 
 void icmp_send_host_unreachable(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        struct sr_if* iface/* lent */)
 {
-	icmp_send_type3(sr, packet, len, interface, icmp_unreachable_type, icmp_host_unreachable);
+	icmp_send_type3(sr, packet, len, iface, icmp_unreachable_type, icmp_host_unreachable);
 }
 
 void icmp_send_port_unreachable(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        struct sr_if* iface/* lent */)
 {
-	icmp_send_type3(sr, packet, len, interface, icmp_unreachable_type, icmp_port_unreachable);
+	icmp_send_type3(sr, packet, len, iface, icmp_unreachable_type, icmp_port_unreachable);
 }
 
 void icmp_send_time_exceeded(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        struct sr_if* iface/* lent */)
 {
 	/* Re-increment TTL */
 	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(sr_ethernet_hdr_t));
 	ipHeader->ip_ttl = 1;
 
-    icmp_send_type3(sr, packet, len, interface, icmp_time_exceeded_type, 0);
+    icmp_send_type3(sr, packet, len, iface, icmp_time_exceeded_type, 0);
 }
 
 void icmp_send_type3(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */,
+        struct sr_if* iface/* lent */,
         uint8_t type,
 	    uint8_t code) 
 {
@@ -102,7 +102,7 @@ void icmp_send_type3(struct sr_instance* sr,
 
 	/* Ethernet header */
 	int i;
-	unsigned char *sourceEth = sr_get_interface(sr, interface)->addr;
+	unsigned char *sourceEth = iface->addr;
 	struct sr_ethernet_hdr *ethHeader = (struct sr_ethernet_hdr *) response;
 	struct sr_ethernet_hdr *packetEth = (struct sr_ethernet_hdr *) packet;
 	for (i = 0; i < ETHER_ADDR_LEN; i++) {
@@ -112,7 +112,7 @@ void icmp_send_type3(struct sr_instance* sr,
 	ethHeader->ether_type = htons(ethertype_ip);
 
 	/* IP header */
-	uint32_t sourceIP = sr_get_interface(sr, interface)->ip;
+	uint32_t sourceIP = iface->ip;
 	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (response + sizeof(sr_ethernet_hdr_t));
 	struct sr_ip_hdr *packetIp = (struct sr_ip_hdr *) (packet + sizeof(sr_ethernet_hdr_t));	
 	ipHeader->ip_hl = 5;
@@ -143,6 +143,6 @@ void icmp_send_type3(struct sr_instance* sr,
 	icmpResponse->icmp_sum = 0;
 	icmpResponse->icmp_sum = cksum(icmpResponse, sizeof(sr_icmp_t3_hdr_t));
 
-	sr_send_packet(sr, response, newLen, interface);
+	sr_send_packet(sr, response, newLen, iface);
 	free(response);
 }
@@ -13,17 +13,130 @@
 #include "arp_handler.h"
 #include "icmp_handler.h"
 
-/* 
-  This function gets called every second. For each request sent out, we keep
-  checking whether we should resend an request or destroy the arp request.
-  See the comments in the header file for an idea of what it should look like.
-*/
-void sr_arpcache_sweepreqs(struct sr_instance *sr) { 
-	struct sr_arpreq *req = (sr->cache).requests;
-	while (req != NULL) {
-		handle_arpreq(sr, req);
-		req = req->next;
-	}
+static unsigned int sr_arpcache_hash(struct sr_arpcache *cache, uint32_t ip) {
+    return (ip * 2654435761u) >> (32 - cache->hashBits);
+}
+
+static struct sr_arpentry *sr_arpcache_find(struct sr_arpcache *cache, uint32_t ip) {
+    struct sr_arpentry *entry = cache->buckets[sr_arpcache_hash(cache, ip)];
+    while (entry != NULL && entry->ip != ip) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+static void sr_arpcache_lru_unlink(struct sr_arpcache *cache, struct sr_arpentry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lruHead = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lruTail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void sr_arpcache_lru_push(struct sr_arpcache *cache, struct sr_arpentry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lruHead;
+    if (cache->lruHead) {
+        cache->lruHead->lru_prev = entry;
+    } else {
+        cache->lruTail = entry;
+    }
+    cache->lruHead = entry;
+}
+
+/* Writers hold the cache lock and bracket every change to the hash chains or
+   entry contents with these, so lock-free readers can detect it */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int sr_arpcache_adj_hash(uint32_t ip) {
+    return (ip * 2654435761u) >> (32 - SR_ADJ_HASH_BITS);
+}
+
+/* Points every adjacency for entry's IP at entry, or unresolves them if
+   entry is no longer valid. Callers are inside a write_begin/end pair */
+static void sr_arpcache_update_adjs(struct sr_arpcache *cache, struct sr_arpentry *entry) {
+    struct sr_adj *adj;
+    for (adj = cache->adjBuckets[sr_arpcache_adj_hash(entry->ip)]; adj != NULL; adj = adj->hash_next) {
+        if (adj->ip != entry->ip) {
+            continue;
+        }
+        if (entry->valid) {
+            memcpy(adj->ethHdr, entry->mac, ETHER_ADDR_LEN);
+            adj->entry = entry;
+        } else {
+            adj->entry = NULL;
+        }
+    }
+}
+
+/* Removes a valid entry from its bucket and the LRU list. The entry is left
+   for the caller to reuse or put on the free list */
+static void sr_arpcache_unlink(struct sr_arpcache *cache, struct sr_arpentry *entry) {
+    struct sr_arpentry **walker = &(cache->buckets[sr_arpcache_hash(cache, entry->ip)]);
+    while (*walker != NULL) {
+        if (*walker == entry) {
+            *walker = entry->hash_next;
+            break;
+        }
+        walker = &((*walker)->hash_next);
+    }
+    entry->hash_next = NULL;
+
+    sr_arpcache_lru_unlink(cache, entry);
+    entry->valid = 0;
+    sr_arpcache_update_adjs(cache, entry);
+}
+
+/* Ages an entry. It first runs a second before the refresh window, so
+   hot only counts use from then on, and then once a second until the
+   entry times out. Entries used in the last second inside the window are
+   re-ARPed so busy next hops are refreshed before they expire */
+static void sr_arpcache_entry_timer(void *ctx, void *arg) {
+    struct sr_instance *sr = (struct sr_instance *) ctx;
+    struct sr_arpcache *cache = &(sr->cache);
+    struct sr_arpentry *entry = (struct sr_arpentry *) arg;
+    uint64_t now = sr_timer_ticks();
+    
+    if (now >= entry->expires) {
+        /* Only block readers while this entry is being unlinked */
+        sr_arpcache_write_begin(cache);
+        sr_arpcache_unlink(cache, entry);
+        entry->hash_next = cache->freeList;
+        cache->freeList = entry;
+        sr_arpcache_write_end(cache);
+        return;
+    }
+    
+    if (entry->hot && entry->expires - now <= (uint64_t) (SR_ARPCACHE_REFRESH * 1000) / SR_TIMER_TICK_MS) {
+        /* Request without packets. The reply refreshes the entry
+           through sr_arpcache_insert like any other */
+        struct sr_arpreq *req = sr_arpcache_queuereq(cache, entry->ip, NULL, 0, 0);
+        if (req->times_sent == 0) {
+            handle_arpreq(sr, req);
+        }
+    }
+    entry->hot = 0;
+    
+    uint64_t left = (entry->expires - now) * SR_TIMER_TICK_MS;
+    sr_timer_set(&(cache->timers), &(entry->timer), left < 1000 ? left : 1000);
+}
+
+/* Retries or gives up on a request, handle_arpreq armed this */
+static void sr_arpcache_req_timer(void *ctx, void *arg) {
+    handle_arpreq((struct sr_instance *) ctx, (struct sr_arpreq *) arg);
 }
 
 /* You should not need to touch the rest of this code. */
@@ -33,13 +146,12 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpentry *entry = NULL, *copy = NULL;
+    struct sr_arpentry *copy = NULL;
+    struct sr_arpentry *entry = sr_arpcache_find(cache, ip);
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
-        }
+    if (entry) {
+        entry->used = 1;
+        entry->hot = 1;
     }
     
     /* Must return a copy b/c another thread could jump in and modify
@@ -54,9 +166,110 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
     return copy;
 }
 
+int sr_arpcache_lookup_r(struct sr_arpcache *cache, uint32_t ip, unsigned char *mac) {
+    unsigned int start, steps;
+    struct sr_arpentry *entry;
+    
+    do {
+        /* Odd means a writer is in the middle of a change */
+        while ((start = __atomic_load_n(&(cache->seq), __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        
+        /* Entries are never freed while the cache exists, so a chain changed
+           under us can only be wrong, not dangling. Bound the walk in case it
+           was relinked into a loop */
+        entry = cache->buckets[sr_arpcache_hash(cache, ip)];
+        steps = 0;
+        while (entry != NULL && steps++ < cache->size) {
+            if (entry->valid && entry->ip == ip) {
+                memcpy(mac, entry->mac, ETHER_ADDR_LEN);
+                break;
+            }
+            entry = entry->hash_next;
+        }
+        
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(cache->seq), __ATOMIC_RELAXED) != start);
+    
+    if (entry == NULL || steps > cache->size) {
+        return 0;
+    }
+    
+    /* Racy on purpose, only hints for replacement and refresh */
+    entry->used = 1;
+    entry->hot = 1;
+    return 1;
+}
+
+struct sr_adj *sr_arpcache_get_adj(struct sr_arpcache *cache, uint32_t ip,
+                                   unsigned int ifindex, const unsigned char *ifaceMac)
+{
+    pthread_mutex_lock(&(cache->lock));
+    
+    unsigned int bucket = sr_arpcache_adj_hash(ip);
+    struct sr_adj *adj;
+    for (adj = cache->adjBuckets[bucket]; adj != NULL; adj = adj->hash_next) {
+        if (adj->ip == ip && adj->ifindex == ifindex) {
+            break;
+        }
+    }
+    
+    if (!adj) {
+        adj = (struct sr_adj *) calloc(1, sizeof(struct sr_adj));
+        adj->ip = ip;
+        adj->ifindex = ifindex;
+        memcpy(adj->ethHdr + ETHER_ADDR_LEN, ifaceMac, ETHER_ADDR_LEN);
+        adj->ethHdr[12] = ethertype_ip >> 8;
+        adj->ethHdr[13] = ethertype_ip & 0xff;
+        
+        /* Resolve it now if the next hop is already cached */
+        sr_arpcache_write_begin(cache);
+        adj->hash_next = cache->adjBuckets[bucket];
+        cache->adjBuckets[bucket] = adj;
+        struct sr_arpentry *entry = sr_arpcache_find(cache, ip);
+        if (entry) {
+            sr_arpcache_update_adjs(cache, entry);
+        }
+        sr_arpcache_write_end(cache);
+    }
+    
+    pthread_mutex_unlock(&(cache->lock));
+    
+    return adj;
+}
+
+int sr_arpcache_read_adj(struct sr_arpcache *cache, struct sr_adj *adj, uint8_t *ethHdr) {
+    unsigned int start;
+    struct sr_arpentry *entry;
+    
+    do {
+        while ((start = __atomic_load_n(&(cache->seq), __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        
+        entry = adj->entry;
+        if (entry) {
+            memcpy(ethHdr, adj->ethHdr, sizeof(adj->ethHdr));
+        }
+        
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(cache->seq), __ATOMIC_RELAXED) != start);
+    
+    if (!entry) {
+        return 0;
+    }
+    
+    /* Forwarding through the adjacency counts as using the entry */
+    entry->used = 1;
+    entry->hot = 1;
+    return 1;
+}
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. You should free the passed *packet.
+   that corresponds to this ARP request. The packet is copied into the pool,
+   the caller keeps *packet.
    
    A pointer to the ARP request is returned; it should not be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
@@ -64,7 +277,7 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       unsigned int ifindex)
 {
     pthread_mutex_lock(&(cache->lock));
     
@@ -75,25 +288,40 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
         }
     }
     
-    /* If the IP wasn't found, add it */
+    /* If the IP wasn't found, add it. The caller sends the first request,
+       handle_arpreq arms the timer for the next */
     if (!req) {
         req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
         req->ip = ip;
+        sr_timer_init(&(req->timer), sr_arpcache_req_timer, req);
         req->next = cache->requests;
         cache->requests = req;
     }
     
-    /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
-        
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+    /* Add the packet to the end of the list of packets for this request */
+    if (packet && packet_len) {
+        if (packet_len > SR_ARPCACHE_PKT_MAX) {
+            cache->oversizeDrops++;
+        } else if (req->numPackets >= SR_ARPREQ_MAX_PKTS) {
+            cache->reqDrops++;
+        } else if (cache->freePackets == NULL) {
+            cache->poolDrops++;
+        } else {
+            struct sr_packet *new_pkt = cache->freePackets;
+            cache->freePackets = new_pkt->next;
+            
+            memcpy(new_pkt->buf, packet, packet_len);
+            new_pkt->len = packet_len;
+            new_pkt->ifindex = ifindex;
+            new_pkt->next = NULL;
+            
+            struct sr_packet **tail = &(req->packets);
+            while (*tail != NULL) {
+                tail = &((*tail)->next);
+            }
+            *tail = new_pkt;
+            req->numPackets++;
+        }
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -123,24 +351,56 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                 cache->requests = next;
             }
             
+            /* Answered, the caller sends its packets and destroys it */
+            sr_timer_cancel(&(cache->timers), &(req->timer));
             break;
         }
         prev = req;
     }
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
-            break;
-    }
+    sr_arpcache_write_begin(cache);
     
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
-        cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
-        cache->entries[i].valid = 1;
+    struct sr_arpentry *entry = sr_arpcache_find(cache, ip);
+    if (entry) {
+        /* Already cached, refresh it in place */
+        sr_arpcache_lru_unlink(cache, entry);
+    } else {
+        entry = cache->freeList;
+        if (entry) {
+            cache->freeList = entry->hash_next;
+        } else {
+            /* Full. Lookups only mark entries as used, so give entries used
+               since they were last at the tail a second chance */
+            unsigned int spins = 0;
+            while (cache->lruTail->used && spins++ < cache->size) {
+                struct sr_arpentry *tail = cache->lruTail;
+                tail->used = 0;
+                sr_arpcache_lru_unlink(cache, tail);
+                sr_arpcache_lru_push(cache, tail);
+            }
+            entry = cache->lruTail;
+            sr_arpcache_unlink(cache, entry);
+            cache->evictions++;
+        }
+        
+        entry->ip = ip;
+        unsigned int bucket = sr_arpcache_hash(cache, ip);
+        entry->hash_next = cache->buckets[bucket];
+        cache->buckets[bucket] = entry;
     }
     
+    memcpy(entry->mac, mac, 6);
+    entry->added = time(NULL);
+    entry->expires = sr_timer_ticks() + (uint64_t) (SR_ARPCACHE_TO * 1000) / SR_TIMER_TICK_MS;
+    entry->valid = 1;
+    entry->used = 0;
+    entry->hot = 0;
+    sr_timer_set(&(cache->timers), &(entry->timer), (uint64_t) ((SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH - 1) * 1000));
+    sr_arpcache_lru_push(cache, entry);
+    sr_arpcache_update_adjs(cache, entry);
+    
+    sr_arpcache_write_end(cache);
+    
     pthread_mutex_unlock(&(cache->lock));
     
     return req;
@@ -169,15 +429,14 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
             prev = req;
         }
         
+        sr_timer_cancel(&(cache->timers), &(entry->timer));
+        
         struct sr_packet *pkt, *nxt;
         
         for (pkt = entry->packets; pkt; pkt = nxt) {
             nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+            pkt->next = cache->freePackets;
+            cache->freePackets = pkt;
         }
         
         free(entry);
@@ -191,23 +450,62 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+    unsigned int i;
+    for (i = 0; i < cache->size; i++) {
         struct sr_arpentry *cur = &(cache->entries[i]);
         unsigned char *mac = cur->mac;
         fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
     }
     
-    fprintf(stderr, "\n");
+    fprintf(stderr, "%lu entries evicted\n", cache->evictions);
+    fprintf(stderr, "Queued packets dropped: %lu request full, %lu pool empty, %lu oversize\n\n",
+            cache->reqDrops, cache->poolDrops, cache->oversizeDrops);
 }
 
 /* Initialize table + table lock. Returns 0 on success. */
-int sr_arpcache_init(struct sr_arpcache *cache) {  
-    /* Seed RNG to kick out a random entry if all entries full. */
-    srand(time(NULL));
+int sr_arpcache_init(struct sr_arpcache *cache, unsigned int size) {  
+    if (size == 0) {
+        size = SR_ARPCACHE_SZ;
+    }
+    
+    /* At least two buckets per entry keeps chains short */
+    cache->hashBits = 1;
+    while (cache->hashBits < 31 && (1u << cache->hashBits) < 2 * size) {
+        cache->hashBits++;
+    }
     
     /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
+    cache->size = size;
+    cache->entries = (struct sr_arpentry *) calloc(size, sizeof(struct sr_arpentry));
+    cache->buckets = (struct sr_arpentry **) calloc(1u << cache->hashBits, sizeof(struct sr_arpentry *));
+    cache->packetPool = (struct sr_packet *) calloc(SR_ARPCACHE_PKT_POOL, sizeof(struct sr_packet));
+    cache->packetBufs = (uint8_t *) malloc(SR_ARPCACHE_PKT_POOL * SR_ARPCACHE_PKT_MAX);
+    if (cache->entries == NULL || cache->buckets == NULL || cache->packetPool == NULL || cache->packetBufs == NULL) {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache->packetPool);
+        free(cache->packetBufs);
+        return -1;
+    }
+    
+    unsigned int i;
+    cache->freeList = NULL;
+    for (i = size; i > 0; i--) {
+        sr_timer_init(&(cache->entries[i - 1].timer), sr_arpcache_entry_timer, &(cache->entries[i - 1]));
+        cache->entries[i - 1].hash_next = cache->freeList;
+        cache->freeList = &(cache->entries[i - 1]);
+    }
+    cache->freePackets = NULL;
+    for (i = SR_ARPCACHE_PKT_POOL; i > 0; i--) {
+        cache->packetPool[i - 1].buf = cache->packetBufs + (i - 1) * SR_ARPCACHE_PKT_MAX;
+        cache->packetPool[i - 1].next = cache->freePackets;
+        cache->freePackets = &(cache->packetPool[i - 1]);
+    }
+    cache->reqDrops = cache->poolDrops = cache->oversizeDrops = 0;
+    memset(cache->adjBuckets, 0, sizeof(cache->adjBuckets));
+    cache->lruHead = cache->lruTail = NULL;
+    cache->evictions = 0;
+    cache->seq = 0;
     cache->requests = NULL;
     
     /* Acquire mutex lock */
@@ -215,39 +513,33 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
     int success = pthread_mutex_init(&(cache->lock), &(cache->attr));
     
+    /* Callbacks need the instance, sr_arpcache_start_timers sets it */
+    sr_timer_wheel_init(&(cache->timers), &(cache->lock), NULL);
+    
     return success;
 }
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
-    return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
-}
-
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
-void *sr_arpcache_timeout(void *sr_ptr) {
-    struct sr_instance *sr = sr_ptr;
-    struct sr_arpcache *cache = &(sr->cache);
-    
-    while (1) {
-        sleep(1.0);
-        
-        pthread_mutex_lock(&(cache->lock));
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->packetPool);
+    free(cache->packetBufs);
     
-        time_t curtime = time(NULL);
-        
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
+    unsigned int i;
+    for (i = 0; i < SR_ADJ_HASH_SZ; i++) {
+        struct sr_adj *adj, *next;
+        for (adj = cache->adjBuckets[i]; adj != NULL; adj = next) {
+            next = adj->hash_next;
+            free(adj);
         }
-        
-        sr_arpcache_sweepreqs(sr);
-
-        pthread_mutex_unlock(&(cache->lock));
     }
-    
-    return NULL;
+    return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
+/* Has the timer thread run the cache's timers. Entries cached before
+   this still time out, their timers are already on the wheel */
+void sr_arpcache_start_timers(struct sr_instance *sr) {
+    sr->cache.timers.ctx = sr;
+    sr_timer_add_wheel(sr, &(sr->cache.timers));
+}
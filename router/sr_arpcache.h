@@ -50,17 +50,17 @@
 
    To meet the guidelines in the assignment (ARP requests are sent every second
    until we send 5 ARP requests, then we send ICMP host unreachable back to
-   all packets waiting on this ARP request), you must fill out the following
-   function that is called every second and is defined in sr_arpcache.c:
+   all packets waiting on this ARP request), each request has a timer on the
+   cache's timing wheel (sr_timer.h). handle_arpreq arms it for
+   SR_ARPREQ_INTERVAL after sending, and when it runs out it calls
+   handle_arpreq again:
 
-   void sr_arpcache_sweepreqs(struct sr_instance *sr) {
-       for each request on sr->cache.requests:
-           handle_arpreq(request)
+   void sr_arpcache_req_timer(req) {
+       handle_arpreq(req)
    }
 
-   Since handle_arpreq as defined in the comments above could destroy your
-   current request, make sure to save the next pointer before calling
-   handle_arpreq when traversing through the ARP requests linked list.
+   Cache entries have a timer too, which times them out and re-ARPs the
+   ones still in use just before they would.
  */
 
 #ifndef SR_ARPCACHE_H
@@ -70,14 +70,23 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_timer.h"
 
-#define SR_ARPCACHE_SZ    100  
+#define SR_ARPCACHE_SZ    100   /* Default number of entries, see -a */
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPCACHE_REFRESH 3.0 /* Re-ARP entries in use this long before they expire */
+#define SR_ARPREQ_INTERVAL 1000 /* ms between ARP requests for the same IP */
+#define SR_ARPCACHE_PKT_POOL 512  /* Packets waiting on ARP, across all requests */
+#define SR_ARPREQ_MAX_PKTS   32   /* Packets waiting on a single request */
+#define SR_ARPCACHE_PKT_MAX  1514 /* Largest frame that can be queued */
+#define SR_ADJ_HASH_BITS     8
+#define SR_ADJ_HASH_SZ       (1 << SR_ADJ_HASH_BITS)
 
 struct sr_packet {
-    uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
+    uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty.
+                                   Points into the cache's packet pool */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    unsigned int ifindex;       /* The interface the frame arrived on (sr_if->index) */
     struct sr_packet *next;
 };
 
@@ -85,7 +94,26 @@ struct sr_arpentry {
     unsigned char mac[6]; 
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;         
+    uint64_t expires;               /* sr_timer_ticks() at which it times out */
     int valid;
+    int used;                       /* Looked up since it last reached the LRU tail */
+    int hot;                        /* Looked up since its timer last ran */
+    struct sr_timer timer;          /* Refresh checks, then the timeout */
+    struct sr_arpentry *hash_next;  /* Next entry in the same bucket, or on the free list */
+    struct sr_arpentry *lru_prev;   /* Valid entries, most recently used first */
+    struct sr_arpentry *lru_next;
+};
+
+/* Adjacency: a next hop out of a given interface, with the Ethernet header
+   for it built once. Routes point at their adjacency (sr_rt->adj) so
+   forwarding needs no ARP lookup. The cache keeps adjacencies in step with
+   their ARP entry as it is resolved, replaced or expires. */
+struct sr_adj {
+    uint32_t ip;                    /* Next hop, same byte order as sr_arpentry->ip */
+    unsigned int ifindex;           /* Egress interface (sr_if->index) */
+    uint8_t ethHdr[14];             /* Next hop MAC, interface MAC, IPv4 ethertype */
+    struct sr_arpentry *entry;      /* ARP entry ethHdr was built from, NULL if unresolved */
+    struct sr_adj *hash_next;
 };
 
 struct sr_arpreq {
@@ -95,38 +123,74 @@ struct sr_arpreq {
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    struct sr_timer timer;      /* Runs handle_arpreq again, armed by it */
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first */
+    unsigned int numPackets;
     struct sr_arpreq *next;
 };
 
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
+    struct sr_arpentry *entries;    /* size entries */
+    unsigned int size;
+    struct sr_arpentry **buckets;   /* Valid entries hashed on ip */
+    unsigned int hashBits;
+    struct sr_arpentry *freeList;   /* Invalid entries */
+    struct sr_arpentry *lruHead;    /* Most recently used */
+    struct sr_arpentry *lruTail;    /* Evicted first when the cache is full */
+    unsigned long evictions;
+    unsigned int seq;               /* Odd while entries are being changed, see sr_arpcache_lookup_r */
+    struct sr_packet *packetPool;   /* SR_ARPCACHE_PKT_POOL packets and their buffers */
+    uint8_t *packetBufs;
+    struct sr_packet *freePackets;
+    unsigned long reqDrops;         /* Packets dropped, request already had SR_ARPREQ_MAX_PKTS */
+    unsigned long poolDrops;        /* Packets dropped, pool empty */
+    unsigned long oversizeDrops;    /* Packets dropped, larger than SR_ARPCACHE_PKT_MAX */
+    struct sr_adj *adjBuckets[SR_ADJ_HASH_SZ]; /* Adjacencies hashed on ip */
     struct sr_arpreq *requests;
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
+    struct sr_timer_wheel timers;   /* Entry and request timers, under lock */
 };
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
+/* Same as sr_arpcache_lookup, but copies the MAC into mac (ETHER_ADDR_LEN
+   bytes) instead of allocating. Does not take the cache lock: the read is
+   retried if a writer changed the entries meanwhile. Returns 1 if found. */
+int sr_arpcache_lookup_r(struct sr_arpcache *cache, uint32_t ip, unsigned char *mac);
+
+/* Returns the adjacency for next hop ip (host byte order, like the rest of
+   the cache) out of interface ifindex, creating it if needed. ifaceMac is
+   the interface's MAC. Adjacencies live as long as the cache. */
+struct sr_adj *sr_arpcache_get_adj(struct sr_arpcache *cache, uint32_t ip,
+                                   unsigned int ifindex, const unsigned char *ifaceMac);
+
+/* Copies the adjacency's Ethernet header into ethHdr (14 bytes) if its next
+   hop is resolved. Lock-free like sr_arpcache_lookup_r. Returns 1 if copied. */
+int sr_arpcache_read_adj(struct sr_arpcache *cache, struct sr_adj *adj, uint8_t *ethHdr);
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+   that corresponds to this ARP request. The packet is copied into the packet
+   pool; it is dropped and counted instead if the request or the pool is full.
+   packet may be NULL to only add the request.
 
-   A pointer to the ARP request is returned; it should be freed. The caller
+   A pointer to the ARP request is returned; it should not be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
                          unsigned int packet_len,
-                         char *iface);
+                         unsigned int ifindex);
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping in the cache, and marks it valid. If the
+      cache is full the least recently used entry is replaced. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
                                      uint32_t ip);
@@ -140,11 +204,12 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and start_timers hands the cache's timers to the timer
+   thread, which times out cache entries after SR_ARPCACHE_TO seconds.
+   size is the number of entries, 0 for SR_ARPCACHE_SZ. */
 
-int   sr_arpcache_init(struct sr_arpcache *cache);
+int   sr_arpcache_init(struct sr_arpcache *cache, unsigned int size);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
-void *sr_arpcache_timeout(void *cache_ptr);
+void  sr_arpcache_start_timers(struct sr_instance *sr);
 
 #endif
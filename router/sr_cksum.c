@@ -0,0 +1,188 @@
+/**********************************************************************
+ * file: sr_cksum.c
+ *
+ * Description:
+ *
+ * This file contains the one's complement sum kernels behind cksum().
+ * Words are summed in native byte order into wide accumulators and the
+ * result is folded and converted to host order once at the end. The
+ * one's complement sum does not depend on byte order, so this matches
+ * summing big-endian words one at a time.
+ *
+ **********************************************************************/
+#include <string.h>
+#include <netinet/in.h>
+
+#include "sr_cksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SR_CKSUM_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+/* Below this many bytes the vector kernels are not worth it (IP headers) */
+#define CKSUM_VECTOR_MIN 64
+
+/* Vector blocks summed into 32-bit lanes before flushing them to the
+   64-bit accumulator. Each lane gains at most 0x1fffe per block */
+#define CKSUM_FLUSH_BLOCKS 4096
+
+typedef uint64_t (*cksum_kernel)(const uint8_t *, int, uint64_t);
+
+static cksum_kernel kernel = NULL;
+static const char *kernelName = "scalar";
+
+/* 32-bit words into a 64-bit accumulator. Also handles the tail for the
+   vector kernels */
+static uint64_t cksum_scalar(const uint8_t *data, int len, uint64_t acc) {
+	uint32_t word;
+	uint16_t half;
+
+	while (len >= 4) {
+		memcpy(&word, data, 4);
+		acc += word;
+		data += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&half, data, 2);
+		acc += half;
+		data += 2;
+		len -= 2;
+	}
+	if (len > 0) {
+		/* Odd trailing byte is padded with zero */
+		half = 0;
+		memcpy(&half, data, 1);
+		acc += half;
+	}
+	return acc;
+}
+
+#ifdef SR_CKSUM_X86
+
+static uint64_t cksum_sse2(const uint8_t *data, int len, uint64_t acc) {
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t lanes[4];
+
+	while (len >= 16) {
+		__m128i sum = _mm_setzero_si128();
+		int blocks = len / 16;
+		if (blocks > CKSUM_FLUSH_BLOCKS) {
+			blocks = CKSUM_FLUSH_BLOCKS;
+		}
+		len -= blocks * 16;
+
+		/* Widen 16-bit words to 32-bit lanes so carries are kept */
+		while (blocks-- > 0) {
+			__m128i v = _mm_loadu_si128((const __m128i *) data);
+			sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(v, zero));
+			sum = _mm_add_epi32(sum, _mm_unpackhi_epi16(v, zero));
+			data += 16;
+		}
+
+		_mm_storeu_si128((__m128i *) lanes, sum);
+		acc += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	return cksum_scalar(data, len, acc);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(const uint8_t *data, int len, uint64_t acc) {
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t lanes[8];
+
+	while (len >= 32) {
+		__m256i sum = _mm256_setzero_si256();
+		int blocks = len / 32;
+		if (blocks > CKSUM_FLUSH_BLOCKS) {
+			blocks = CKSUM_FLUSH_BLOCKS;
+		}
+		len -= blocks * 32;
+
+		while (blocks-- > 0) {
+			__m256i v = _mm256_loadu_si256((const __m256i *) data);
+			sum = _mm256_add_epi32(sum, _mm256_unpacklo_epi16(v, zero));
+			sum = _mm256_add_epi32(sum, _mm256_unpackhi_epi16(v, zero));
+			data += 32;
+		}
+
+		_mm256_storeu_si256((__m256i *) lanes, sum);
+		acc += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3]
+			+ lanes[4] + lanes[5] + lanes[6] + lanes[7];
+	}
+	return cksum_scalar(data, len, acc);
+}
+
+#endif /* SR_CKSUM_X86 */
+
+/* Pick the best kernel for this CPU. Racing threads all pick the same one */
+static cksum_kernel cksum_select(void) {
+	cksum_kernel selected = cksum_scalar;
+	kernelName = "scalar";
+
+#ifdef SR_CKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		selected = cksum_avx2;
+		kernelName = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		selected = cksum_sse2;
+		kernelName = "sse2";
+	}
+#endif
+
+	kernel = selected;
+	return selected;
+}
+
+uint16_t cksum_sum(const void *data, int len) {
+	uint64_t acc;
+
+	if (len < CKSUM_VECTOR_MIN) {
+		acc = cksum_scalar((const uint8_t *) data, len, 0);
+	} else {
+		cksum_kernel selected = kernel ? kernel : cksum_select();
+		acc = selected((const uint8_t *) data, len, 0);
+	}
+
+	/* Fold 64 bits down to 16 with end-around carry */
+	while (acc > 0xffff) {
+		acc = (acc >> 16) + (acc & 0xffff);
+	}
+
+	/* Summed in native order, convert back to host order of big-endian words */
+	return ntohs((uint16_t) acc);
+}
+
+const char *cksum_impl_name(void) {
+	if (kernel == NULL) {
+		cksum_select();
+	}
+	return kernelName;
+}
+
+int cksum_use(const char *name) {
+	if (strcmp(name, "scalar") == 0) {
+		kernel = cksum_scalar;
+		kernelName = "scalar";
+		return 0;
+	}
+
+#ifdef SR_CKSUM_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+		kernel = cksum_sse2;
+		kernelName = "sse2";
+		return 0;
+	}
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		kernel = cksum_avx2;
+		kernelName = "avx2";
+		return 0;
+	}
+#endif
+
+	return -1;
+}
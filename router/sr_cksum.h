@@ -0,0 +1,29 @@
+/**********************************************************************
+ * file: sr_cksum.h
+ *
+ * Description:
+ *
+ * One's complement sum used by cksum(). The fastest kernel the CPU
+ * supports (AVX2, SSE2 or 64-bit scalar) is picked on first use. All
+ * kernels give bit-identical results.
+ *
+ **********************************************************************/
+
+#ifndef SR_CKSUM_H
+#define SR_CKSUM_H
+
+#include <inttypes.h>
+
+/* One's complement sum of len bytes taken as big-endian 16-bit words, with
+   an odd trailing byte padded with zero. Folded to 16 bits and returned in
+   host order. Only returns 0 if all data is zero. */
+uint16_t cksum_sum(const void *data, int len);
+
+/* Name of the kernel cksum_sum() is using ("avx2", "sse2" or "scalar") */
+const char *cksum_impl_name(void);
+
+/* Makes cksum_sum() use the named kernel instead of the one picked for
+   the CPU. For cksum_bench. Returns -1 if the CPU does not support it */
+int cksum_use(const char *name);
+
+#endif
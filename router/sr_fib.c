@@ -0,0 +1,360 @@
+/**********************************************************************
+ * file: sr_fib.c
+ *
+ * Description:
+ *
+ * This file contains the compiled forwarding table used for longest
+ * prefix match. The table is rebuilt from sr->routing_table every time
+ * the routing table is loaded, in the layout chosen by sr->fibMode.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "sr_fib.h"
+#include "sr_utils.h"
+#include "sr_flow.h"
+
+/* Returns the prefix length of the given mask (network byte order),
+   or -1 if the mask is not contiguous */
+static int mask_to_plen(uint32_t mask) {
+	uint32_t hostMask = ntohl(mask);
+	int plen = 0;
+
+	while (plen < 32 && (hostMask & (0x80000000 >> plen))) {
+		plen++;
+	}
+
+	/* Any bit set after the first zero means the mask is not contiguous */
+	if (plen < 32 && (hostMask << plen) != 0) {
+		return -1;
+	}
+	return plen;
+}
+
+static void sr_fib_free_node(struct sr_fib_node *node) {
+	int i;
+	for (i = 0; i < SR_FIB_FANOUT; i++) {
+		if (node->slots[i].child != NULL) {
+			sr_fib_free_node(node->slots[i].child);
+		}
+	}
+	free(node);
+}
+
+static struct sr_fib_node *sr_fib_new_node(struct sr_fib *fib) {
+	struct sr_fib_node *node = (struct sr_fib_node *) calloc(1, sizeof(struct sr_fib_node));
+	if (node != NULL) {
+		fib->nodes++;
+	}
+	return node;
+}
+
+/* Insert a route into the trie, expanding its prefix over every slot
+   it covers at the last level it reaches. Returns 0 on success */
+static int sr_fib_insert(struct sr_fib *fib, struct sr_rt *route) {
+	int plen = mask_to_plen(route->mask.s_addr);
+	if (plen < 0) {
+		return -1;
+	}
+
+	uint32_t prefix = ntohl(route->dest.s_addr & route->mask.s_addr);
+	struct sr_fib_node *node = fib->root;
+	int level = 0;
+
+	/* Walk down to the level that holds the last bits of the prefix */
+	while (plen > SR_FIB_STRIDE * (level + 1)) {
+		int shift = 32 - SR_FIB_STRIDE * (level + 1);
+		struct sr_fib_slot *slot = &(node->slots[(prefix >> shift) & (SR_FIB_FANOUT - 1)]);
+
+		if (slot->child == NULL) {
+			slot->child = sr_fib_new_node(fib);
+			if (slot->child == NULL) {
+				return -1;
+			}
+		}
+		node = slot->child;
+		level++;
+	}
+
+	/* Expand over every slot this prefix covers at this level */
+	int shift = 32 - SR_FIB_STRIDE * (level + 1);
+	int remaining = plen - SR_FIB_STRIDE * level;
+	int first = (prefix >> shift) & (SR_FIB_FANOUT - 1) & ~((1 << (SR_FIB_STRIDE - remaining)) - 1);
+	int count = 1 << (SR_FIB_STRIDE - remaining);
+
+	int i;
+	for (i = first; i < first + count; i++) {
+		struct sr_fib_slot *slot = &(node->slots[i]);
+
+		/* Longer prefixes win. On a tie the earlier route is kept, same as
+		   the linear scan in findLongestMatchPrefix */
+		if (slot->route == NULL || slot->plen < plen) {
+			slot->route = route;
+			slot->plen = plen;
+		}
+	}
+
+	fib->routes++;
+	return 0;
+}
+
+struct sr_fib_dir24_route {
+	struct sr_rt *route;
+	uint16_t index;
+	int plen;
+};
+
+/* Orders dir24 routes by prefix length. Equal lengths are ordered so the
+   earlier route in the list is written last and wins the tie */
+static int sr_fib_dir24_cmp(const void *a, const void *b) {
+	const struct sr_fib_dir24_route *ra = (const struct sr_fib_dir24_route *) a;
+	const struct sr_fib_dir24_route *rb = (const struct sr_fib_dir24_route *) b;
+
+	if (ra->plen != rb->plen) {
+		return ra->plen - rb->plen;
+	}
+	return rb->index - ra->index;
+}
+
+/* Returns the overflow block for the given tbl24 slot, creating it from the
+   slot's current route if needed. Returns NULL if out of blocks */
+static uint16_t *sr_fib_dir24_block(struct sr_fib *fib, uint32_t slot) {
+	uint16_t entry = fib->tbl24[slot];
+	if (entry & SR_FIB_DIR24_LONG) {
+		return fib->tblLong + ((entry & SR_FIB_DIR24_MAX) << 8);
+	}
+
+	if (fib->longBlocks >= SR_FIB_DIR24_MAX) {
+		return NULL;
+	}
+
+	uint16_t *tblLong = (uint16_t *) realloc(fib->tblLong, (fib->longBlocks + 1) * 256 * sizeof(uint16_t));
+	if (tblLong == NULL) {
+		return NULL;
+	}
+	fib->tblLong = tblLong;
+
+	/* New block inherits the shorter route that covered the whole /24 */
+	uint16_t *block = tblLong + (fib->longBlocks << 8);
+	int i;
+	for (i = 0; i < 256; i++) {
+		block[i] = entry;
+	}
+
+	fib->tbl24[slot] = SR_FIB_DIR24_LONG | fib->longBlocks;
+	fib->longBlocks++;
+	return block;
+}
+
+static int sr_fib_build_dir24(struct sr_fib *fib, struct sr_rt *routingTable) {
+	unsigned int count = 0;
+	struct sr_rt *rt;
+	for (rt = routingTable; rt != NULL; rt = rt->next) {
+		count++;
+	}
+
+	if (count >= SR_FIB_DIR24_MAX) {
+		return -1;
+	}
+
+	fib->routeIndex = (struct sr_rt **) calloc(count + 1, sizeof(struct sr_rt *));
+	fib->tbl24 = (uint16_t *) calloc(SR_FIB_DIR24_SZ, sizeof(uint16_t));
+	struct sr_fib_dir24_route *sorted = (struct sr_fib_dir24_route *) calloc(count + 1, sizeof(struct sr_fib_dir24_route));
+	if (fib->routeIndex == NULL || fib->tbl24 == NULL || sorted == NULL) {
+		free(sorted);
+		return -1;
+	}
+
+	/* Route indices follow list order, starting at 1 */
+	unsigned int i = 0;
+	for (rt = routingTable; rt != NULL; rt = rt->next) {
+		sorted[i].route = rt;
+		sorted[i].index = i + 1;
+		sorted[i].plen = mask_to_plen(rt->mask.s_addr);
+		if (sorted[i].plen < 0) {
+			free(sorted);
+			return -1;
+		}
+		fib->routeIndex[i + 1] = rt;
+		i++;
+	}
+
+	/* Shorter prefixes first so longer ones overwrite them */
+	qsort(sorted, count, sizeof(struct sr_fib_dir24_route), sr_fib_dir24_cmp);
+
+	for (i = 0; i < count; i++) {
+		uint32_t prefix = ntohl(sorted[i].route->dest.s_addr & sorted[i].route->mask.s_addr);
+		int plen = sorted[i].plen;
+		uint32_t j;
+
+		if (plen <= 24) {
+			uint32_t first = prefix >> 8;
+			for (j = first; j < first + (1 << (24 - plen)); j++) {
+				fib->tbl24[j] = sorted[i].index;
+			}
+
+		} else {
+			/* All shorter prefixes are already in tbl24, so the block starts out correct */
+			uint16_t *block = sr_fib_dir24_block(fib, prefix >> 8);
+			if (block == NULL) {
+				free(sorted);
+				return -1;
+			}
+
+			uint32_t first = prefix & 0xff;
+			for (j = first; j < first + (1 << (32 - plen)); j++) {
+				block[j] = sorted[i].index;
+			}
+		}
+		fib->routes++;
+	}
+
+	free(sorted);
+	fib->footprint = sizeof(struct sr_fib) + SR_FIB_DIR24_SZ * sizeof(uint16_t)
+		+ fib->longBlocks * 256 * sizeof(uint16_t) + (count + 1) * sizeof(struct sr_rt *);
+	return 0;
+}
+
+static int sr_fib_build_trie(struct sr_fib *fib, struct sr_rt *routingTable) {
+	fib->root = sr_fib_new_node(fib);
+	if (fib->root == NULL) {
+		return -1;
+	}
+
+	struct sr_rt *rt = routingTable;
+	while (rt != NULL) {
+		if (sr_fib_insert(fib, rt) != 0) {
+			return -1;
+		}
+		rt = rt->next;
+	}
+
+	fib->footprint = sizeof(struct sr_fib) + fib->nodes * sizeof(struct sr_fib_node);
+	return 0;
+}
+
+void sr_fib_destroy(struct sr_fib *fib) {
+	if (fib == NULL) {
+		return;
+	}
+	if (fib->root != NULL) {
+		sr_fib_free_node(fib->root);
+	}
+	free(fib->tbl24);
+	free(fib->tblLong);
+	free(fib->routeIndex);
+	free(fib);
+}
+
+/* Allocates and compiles a FIB in the given mode. Returns NULL on failure */
+static struct sr_fib *sr_fib_compile(struct sr_rt *routingTable, sr_fib_mode mode) {
+	struct sr_fib *fib = (struct sr_fib *) calloc(1, sizeof(struct sr_fib));
+	if (fib == NULL) {
+		return NULL;
+	}
+	fib->mode = mode;
+
+	int failed = 0;
+	switch (mode) {
+		case fib_mode_trie: {
+			failed = sr_fib_build_trie(fib, routingTable);
+			break;
+		} case fib_mode_dir24: {
+			failed = sr_fib_build_dir24(fib, routingTable);
+			break;
+		} default: {
+			failed = 1;
+			break;
+		}
+	}
+
+	if (failed) {
+		sr_fib_destroy(fib);
+		return NULL;
+	}
+	return fib;
+}
+
+void sr_fib_build(struct sr_instance *sr) {
+	sr_fib_destroy(sr->fib);
+	sr->fib = NULL;
+	sr_flow_invalidate(sr);
+
+	if (sr->fibMode == fib_mode_list) {
+		printf("FIB: disabled, using routing table list\n");
+		return;
+	}
+
+	struct sr_fib *fib = sr_fib_compile(sr->routing_table, sr->fibMode);
+	if (fib == NULL && sr->fibMode == fib_mode_dir24) {
+		fprintf(stderr, "Could not compile dir24 FIB, falling back to trie\n");
+		fib = sr_fib_compile(sr->routing_table, fib_mode_trie);
+	}
+
+	if (fib == NULL) {
+		fprintf(stderr, "Could not compile FIB, using routing table list\n");
+		return;
+	}
+
+	if (fib->mode == fib_mode_dir24) {
+		printf("FIB: %u routes compiled into dir24 with %u overflow blocks (%lu bytes)\n",
+			fib->routes, fib->longBlocks, fib->footprint);
+	} else {
+		printf("FIB: %u routes compiled into %u trie nodes (%lu bytes)\n",
+			fib->routes, fib->nodes, fib->footprint);
+	}
+	sr->fib = fib;
+}
+
+static struct sr_rt *sr_fib_trie_lookup(struct sr_fib *fib, uint32_t hostIp) {
+	struct sr_rt *closestMatch = NULL;
+	struct sr_fib_node *node = fib->root;
+	int level = 0;
+
+	/* Deeper levels only ever hold longer prefixes, so the last route seen is the longest match */
+	while (node != NULL) {
+		int shift = 32 - SR_FIB_STRIDE * (level + 1);
+		struct sr_fib_slot *slot = &(node->slots[(hostIp >> shift) & (SR_FIB_FANOUT - 1)]);
+
+		if (slot->route != NULL) {
+			closestMatch = slot->route;
+		}
+		node = slot->child;
+		level++;
+	}
+	return closestMatch;
+}
+
+static struct sr_rt *sr_fib_dir24_lookup(struct sr_fib *fib, uint32_t hostIp) {
+	uint16_t entry = fib->tbl24[hostIp >> 8];
+	if (entry & SR_FIB_DIR24_LONG) {
+		entry = fib->tblLong[((entry & SR_FIB_DIR24_MAX) << 8) | (hostIp & 0xff)];
+	}
+	return fib->routeIndex[entry];
+}
+
+struct sr_rt *sr_fib_lookup(struct sr_instance *sr, uint32_t ip) {
+	struct sr_fib *fib = sr->fib;
+	if (fib == NULL) {
+		return findLongestMatchPrefix(sr->routing_table, ip);
+	}
+
+	if (fib->mode == fib_mode_dir24) {
+		return sr_fib_dir24_lookup(fib, ntohl(ip));
+	}
+	return sr_fib_trie_lookup(fib, ntohl(ip));
+}
+
+int sr_fib_parse_mode(const char *name) {
+	if (strcmp(name, "list") == 0) {
+		return fib_mode_list;
+	} else if (strcmp(name, "trie") == 0) {
+		return fib_mode_trie;
+	} else if (strcmp(name, "dir24") == 0) {
+		return fib_mode_dir24;
+	}
+	return -1;
+}
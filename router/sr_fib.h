@@ -0,0 +1,83 @@
+/**********************************************************************
+ * file: sr_fib.h
+ *
+ * Description:
+ *
+ * Compiled forwarding table (FIB) built from sr->routing_table.
+ * Two layouts are available:
+ * - trie:  fixed-stride multibit trie, a lookup touches at most
+ *          SR_FIB_LEVELS nodes regardless of how many routes are loaded
+ * - dir24: DIR-24-8 flat array indexed by the top 24 bits of the address,
+ *          plus 256-entry overflow blocks for prefixes longer than /24.
+ *          One or two memory reads per lookup at the cost of ~32MB.
+ *
+ **********************************************************************/
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#include <inttypes.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+
+#define SR_FIB_STRIDE 8
+#define SR_FIB_FANOUT (1 << SR_FIB_STRIDE)
+#define SR_FIB_LEVELS (32 / SR_FIB_STRIDE)
+
+#define SR_FIB_DIR24_SZ   (1 << 24)
+#define SR_FIB_DIR24_LONG 0x8000	/* tbl24 entry points to an overflow block */
+#define SR_FIB_DIR24_MAX  0x7fff	/* max route indices and overflow blocks */
+
+typedef enum {
+	fib_mode_list,		/* linear scan of sr->routing_table */
+	fib_mode_trie,
+	fib_mode_dir24
+} sr_fib_mode;
+
+struct sr_fib_node;
+
+struct sr_fib_slot {
+	struct sr_rt *route;		/* Longest route covering this slot at this level */
+	uint8_t plen;				/* Prefix length of route */
+	struct sr_fib_node *child;	/* Next level for prefixes longer than this level */
+};
+
+struct sr_fib_node {
+	struct sr_fib_slot slots[SR_FIB_FANOUT];
+};
+
+struct sr_fib {
+	sr_fib_mode mode;
+	unsigned int routes;
+	unsigned long footprint;	/* bytes used by the compiled table */
+
+	/* trie */
+	struct sr_fib_node *root;
+	unsigned int nodes;
+
+	/* dir24 */
+	uint16_t *tbl24;			/* route index, or overflow block if SR_FIB_DIR24_LONG set */
+	uint16_t *tblLong;			/* 256-entry overflow blocks */
+	unsigned int longBlocks;
+	struct sr_rt **routeIndex;	/* index 0 is no route */
+};
+
+/* Compile sr->routing_table into sr->fib using sr->fibMode, replacing any
+   previous FIB. A dir24 table that does not fit falls back to the trie.
+   If the table cannot be compiled at all (e.g. non-contiguous masks) or the
+   mode is fib_mode_list, sr->fib is left NULL and lookups fall back to the
+   routing table list. */
+void sr_fib_build(struct sr_instance *sr);
+
+/* Frees the FIB and all of its tables */
+void sr_fib_destroy(struct sr_fib *fib);
+
+/* Longest prefix match for ip (network byte order). Returns the same entry
+   findLongestMatchPrefix would return on sr->routing_table. */
+struct sr_rt *sr_fib_lookup(struct sr_instance *sr, uint32_t ip);
+
+/* Parses a -f argument ("list", "trie" or "dir24"). Returns -1 if unknown */
+int sr_fib_parse_mode(const char *name);
+
+#endif
@@ -0,0 +1,215 @@
+/**********************************************************************
+ * file: sr_flow.c
+ *
+ * Description:
+ *
+ * This file contains the exact-match flow cache that lets packets after
+ * the first in a flow skip NAT, the route lookup and ARP.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "sr_flow.h"
+#include "sr_if.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_worker.h"
+
+static unsigned int sr_flow_hash(struct sr_flow_key *key) {
+	uint32_t h = key->ip_src * 2654435761u;
+	h ^= key->ip_dst * 2246822519u;
+	h ^= ((uint32_t) key->port_src << 16 | key->port_dst) * 3266489917u;
+	h ^= ((uint32_t) key->ip_p << 8 | key->ifindex) * 668265263u;
+	return (h * 2654435761u) >> (32 - SR_FLOW_CACHE_BITS);
+}
+
+static int sr_flow_key_equal(struct sr_flow_key *a, struct sr_flow_key *b) {
+	return a->ip_src == b->ip_src && a->ip_dst == b->ip_dst
+		&& a->port_src == b->port_src && a->port_dst == b->port_dst
+		&& a->ip_p == b->ip_p && a->ifindex == b->ifindex;
+}
+
+/* Fills key from the packet. Returns 0 if the packet must always take the
+   normal path: IP options, truncated headers, or TCP flags that change NAT
+   connection state */
+static int sr_flow_key_from_packet(struct sr_instance *sr, uint8_t *packet, unsigned int len,
+	struct sr_if *iface, struct sr_flow_key *key, uint16_t *l4Sum) {
+
+	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
+	unsigned int l4Len = len - sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr);
+	uint8_t *l4 = packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr);
+
+	if (ipHeader->ip_hl != 5) {
+		return 0;
+	}
+
+	memset(key, 0, sizeof(struct sr_flow_key));
+	key->ip_src = ipHeader->ip_src;
+	key->ip_dst = ipHeader->ip_dst;
+	key->ip_p = ipHeader->ip_p;
+	key->ifindex = iface->index;
+	*l4Sum = 0;
+
+	switch (ipHeader->ip_p) {
+		case ip_protocol_tcp: {
+			sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) l4;
+			if (l4Len < sizeof(sr_tcp_hdr_t)) {
+				return 0;
+			}
+			if (sr->natEnable && (tcpHeader->flags & (TCP_SYN | TCP_FIN | TCP_RST))) {
+				return 0;
+			}
+			key->port_src = tcpHeader->src_port;
+			key->port_dst = tcpHeader->dest_port;
+			*l4Sum = tcpHeader->sum;
+			break;
+
+		} case ip_protocol_icmp: {
+			sr_icmp_hdr_t *icmpHeader = (sr_icmp_hdr_t *) l4;
+			if (l4Len < sizeof(sr_icmp_hdr_t)) {
+				return 0;
+			}
+			key->port_src = icmpHeader->icmp_identifier;
+			key->port_dst = icmpHeader->icmp_type << 8 | icmpHeader->icmp_code;
+			*l4Sum = icmpHeader->icmp_sum;
+			break;
+		}
+	}
+	return 1;
+}
+
+/* The calling worker's cache, the first one off the workers */
+static struct sr_flow_cache *sr_flow_cache_self(struct sr_instance *sr) {
+	int index;
+
+	if (sr->flows == NULL) {
+		return NULL;
+	}
+	index = sr_worker_current(sr);
+	return &(sr->flows[index < 0 ? 0 : index]);
+}
+
+int sr_flow_init(struct sr_instance *sr) {
+	unsigned int count = sr->numWorkers ? sr->numWorkers : 1;
+	sr->flows = (struct sr_flow_cache *) calloc(count, sizeof(struct sr_flow_cache));
+	return sr->flows == NULL ? -1 : 0;
+}
+
+void sr_flow_destroy(struct sr_instance *sr) {
+	free(sr->flows);
+	sr->flows = NULL;
+}
+
+void sr_flow_invalidate(struct sr_instance *sr) {
+	__atomic_add_fetch(&(sr->flowGen), 1, __ATOMIC_RELEASE);
+}
+
+int sr_flow_forward(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_if *iface) {
+	struct sr_flow_cache *cache = sr_flow_cache_self(sr);
+	struct sr_flow_key key;
+	uint16_t l4Sum;
+
+	if (cache == NULL) {
+		return 0;
+	}
+	cache->pendingValid = 0;
+
+	if (!sr_flow_key_from_packet(sr, packet, len, iface, &key, &l4Sum)) {
+		return 0;
+	}
+
+	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
+	struct sr_flow *flow = &(cache->flows[sr_flow_hash(&key)]);
+	unsigned int gen = __atomic_load_n(&(sr->flowGen), __ATOMIC_ACQUIRE);
+
+	/* NAT flows take the normal path once a second so their mapping and
+	   connection timestamps stay fresh. TTL expiry is left to processForward */
+	if (!flow->valid || flow->gen != gen || !sr_flow_key_equal(&(flow->key), &key)
+		|| (sr->natEnable && flow->learned != time(NULL))
+		|| ipHeader->ip_ttl <= 1
+		|| !sr_arpcache_read_adj(&(sr->cache), flow->adj, packet)) {
+
+		cache->pending = key;
+		cache->pendingIpSum = ipHeader->ip_sum;
+		cache->pendingL4Sum = l4Sum;
+		cache->pendingGen = gen;
+		cache->pendingValid = 1;
+		cache->misses++;
+		return 0;
+	}
+
+	/* Ethernet header is in place, now the IP and transport headers */
+	ipHeader->ip_src = flow->out.ip_src;
+	ipHeader->ip_dst = flow->out.ip_dst;
+	ipHeader->ip_ttl--;
+	ipHeader->ip_sum = cksum_adjust(ipHeader->ip_sum, flow->ipDelta);
+
+	uint8_t *l4 = packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr);
+	if (key.ip_p == ip_protocol_tcp) {
+		sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) l4;
+		tcpHeader->src_port = flow->out.port_src;
+		tcpHeader->dest_port = flow->out.port_dst;
+		tcpHeader->sum = cksum_adjust(tcpHeader->sum, flow->l4Delta);
+
+	} else if (key.ip_p == ip_protocol_icmp) {
+		sr_icmp_hdr_t *icmpHeader = (sr_icmp_hdr_t *) l4;
+		icmpHeader->icmp_identifier = flow->out.port_src;
+		icmpHeader->icmp_sum = cksum_adjust(icmpHeader->icmp_sum, flow->l4Delta);
+	}
+
+	cache->hits++;
+	sr_send_packet(sr, packet, len, flow->egressIf);
+	return 1;
+}
+
+void sr_flow_learn(struct sr_instance *sr, uint8_t *packet, struct sr_adj *adj, struct sr_if *egressIf) {
+	struct sr_flow_cache *cache = sr_flow_cache_self(sr);
+	if (cache == NULL || !cache->pendingValid) {
+		return;
+	}
+	cache->pendingValid = 0;
+
+	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
+	struct sr_flow *flow = &(cache->flows[sr_flow_hash(&(cache->pending))]);
+
+	flow->key = cache->pending;
+	flow->out = cache->pending;
+	flow->out.ip_src = ipHeader->ip_src;
+	flow->out.ip_dst = ipHeader->ip_dst;
+
+	/* Whatever the normal path changed, the checksums moved by the same
+	   amount: new = ~(~old + delta), so delta = old + ~new. The TTL
+	   decrement is the same change for every TTL */
+	flow->ipDelta = cksum_delta16(~cache->pendingIpSum, ~ipHeader->ip_sum);
+	flow->l4Delta = 0;
+
+	uint8_t *l4 = packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr);
+	if (flow->key.ip_p == ip_protocol_tcp) {
+		sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) l4;
+		flow->out.port_src = tcpHeader->src_port;
+		flow->out.port_dst = tcpHeader->dest_port;
+		flow->l4Delta = cksum_delta16(~cache->pendingL4Sum, ~tcpHeader->sum);
+
+	} else if (flow->key.ip_p == ip_protocol_icmp) {
+		sr_icmp_hdr_t *icmpHeader = (sr_icmp_hdr_t *) l4;
+		flow->out.port_src = icmpHeader->icmp_identifier;
+		flow->l4Delta = cksum_delta16(~cache->pendingL4Sum, ~icmpHeader->icmp_sum);
+	}
+
+	flow->adj = adj;
+	flow->egressIf = egressIf;
+	flow->gen = cache->pendingGen;
+	flow->learned = time(NULL);
+	flow->valid = 1;
+}
+
+void sr_flow_done(struct sr_instance *sr) {
+	struct sr_flow_cache *cache = sr_flow_cache_self(sr);
+	if (cache != NULL) {
+		cache->pendingValid = 0;
+	}
+}
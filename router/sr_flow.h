@@ -0,0 +1,88 @@
+/**********************************************************************
+ * file: sr_flow.h
+ *
+ * Description:
+ *
+ * Exact-match flow cache for forwarded IP packets. The first packet of a
+ * flow goes through NAT and processForward as usual, and what they did to
+ * it (address/port rewrite, checksum changes, next hop adjacency) is
+ * recorded against the flow's 5-tuple and ingress interface. Later
+ * packets of the flow are rewritten and sent with one hash probe.
+ *
+ * Entries are invalidated by bumping sr->flowGen (routes reloaded, NAT
+ * mappings or connections removed, a connection starting to close). ARP changes need no invalidation since the
+ * adjacency is read at send time; an unresolved next hop is a cache miss.
+ *
+ * With worker threads each worker has its own cache in sr->flows[index],
+ * since a flow is only ever handled by one worker (sr_worker.h).
+ *
+ **********************************************************************/
+
+#ifndef SR_FLOW_H
+#define SR_FLOW_H
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "sr_router.h"
+#include "sr_arpcache.h"
+
+#define SR_FLOW_CACHE_BITS 12
+#define SR_FLOW_CACHE_SZ (1 << SR_FLOW_CACHE_BITS)
+
+struct sr_flow_key {
+	uint32_t ip_src;
+	uint32_t ip_dst;
+	uint16_t port_src;		/* TCP source port or ICMP identifier */
+	uint16_t port_dst;		/* TCP destination port or ICMP type and code */
+	uint8_t ip_p;
+	uint8_t ifindex;		/* ingress interface */
+};
+
+struct sr_flow {
+	struct sr_flow_key key;
+	struct sr_flow_key out;		/* addresses and ports after rewriting */
+	uint32_t ipDelta;			/* IP checksum change, TTL decrement included */
+	uint32_t l4Delta;			/* TCP/ICMP checksum change */
+	struct sr_adj *adj;
+	struct sr_if *egressIf;
+	unsigned int gen;			/* sr->flowGen when learned */
+	time_t learned;
+	int valid;
+};
+
+struct sr_flow_cache {
+	struct sr_flow flows[SR_FLOW_CACHE_SZ];
+
+	/* Packet currently on the normal path, learned by processForward */
+	struct sr_flow_key pending;
+	uint16_t pendingIpSum;
+	uint16_t pendingL4Sum;
+	unsigned int pendingGen;
+	int pendingValid;
+
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* Allocates sr->flows, one cache per worker. Returns 0 on success */
+int sr_flow_init(struct sr_instance *sr);
+
+void sr_flow_destroy(struct sr_instance *sr);
+
+/* Forwards a sane IP packet from the cache. Returns 1 if it was sent.
+   Otherwise returns 0 and remembers the packet so sr_flow_learn can
+   record what the normal path does with it. */
+int sr_flow_forward(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_if *iface);
+
+/* Called by processForward once the pending packet has been rewritten and
+   sent through adj. Records the flow. */
+void sr_flow_learn(struct sr_instance *sr, uint8_t *packet, struct sr_adj *adj, struct sr_if *egressIf);
+
+/* Forgets the pending packet, if sr_flow_learn was not called for it */
+void sr_flow_done(struct sr_instance *sr);
+
+/* Drops every cached flow. Safe to call from any thread */
+void sr_flow_invalidate(struct sr_instance *sr);
+
+#endif
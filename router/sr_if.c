@@ -23,6 +23,7 @@
 #include <arpa/inet.h>
 
 #include "sr_if.h"
+#include "sr_rt.h"
 #include "sr_router.h"
 
 /*--------------------------------------------------------------------- 
@@ -54,15 +55,60 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
     return 0;
 } /* -- sr_get_interface -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_interface_by_index
+ * Scope: Global
+ *
+ * Given an interface index (sr_if->index) return the interface record
+ * or 0 if it doesn't exist.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface_by_index(struct sr_instance* sr, unsigned int index)
+{
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    if(index >= sr->if_count)
+    { return 0; }
+
+    return sr->if_table[index];
+} /* -- sr_get_interface_by_index -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_intern_interface
+ * Scope: Local
+ *
+ * Add a new interface to the index table and point any routes already
+ * loaded for it at its index. The table has room, sr_add_interface
+ * checked.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_intern_interface(struct sr_instance* sr, struct sr_if* iface)
+{
+    struct sr_rt* rt_walker = 0;
+
+    iface->index = sr->if_count;
+    sr->if_table[sr->if_count++] = iface;
+
+    for (rt_walker = sr->routing_table; rt_walker; rt_walker = rt_walker->next)
+    {
+        if(!strncmp(rt_walker->interface,iface->name,sr_IFACE_NAMELEN))
+        { rt_walker->ifindex = iface->index; }
+    }
+} /* -- sr_intern_interface -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_add_interface(..)
  * Scope: Global
  *
- * Add and interface to the router's list
+ * Add and interface to the router's list. Returns -1 if the router
+ * already has sr_IFACE_MAX interfaces.
  *
  *---------------------------------------------------------------------*/
 
-void sr_add_interface(struct sr_instance* sr, const char* name)
+int sr_add_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
 
@@ -70,6 +116,13 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(name);
     assert(sr);
 
+    if(sr->if_count >= sr_IFACE_MAX)
+    {
+        fprintf(stderr, "Can't add interface %s, the router has %d already\n",
+                name, sr_IFACE_MAX);
+        return -1;
+    }
+
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
@@ -77,7 +130,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         assert(sr->if_list);
         sr->if_list->next = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
-        return;
+        sr_intern_interface(sr, sr->if_list);
+        return 0;
     }
 
     /* -- find the end of the list -- */
@@ -90,6 +144,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
     if_walker->next = 0;
+    sr_intern_interface(sr, if_walker);
+    return 0;
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
@@ -41,11 +41,15 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  unsigned int index;   /* position in the interface list and sr->if_table */
   struct sr_if* next;
 };
 
+/* Looks an interface up by name. The data plane passes struct sr_if (or its
+   index) around instead, this is for configuration. */
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
-void sr_add_interface(struct sr_instance*, const char*);
+struct sr_if* sr_get_interface_by_index(struct sr_instance* sr, unsigned int index);
+int sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
 void sr_print_if_list(struct sr_instance*);
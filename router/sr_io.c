@@ -0,0 +1,319 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_io.c
+ *
+ * Description:
+ *
+ * Driver independent half of packet I/O: picks the driver, and does the
+ * checks and logging every frame gets on its way in or out.  See sr_io.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "sr_dumper.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_io.h"
+#include "sr_worker.h"
+
+static struct sr_io_driver* sr_io_drivers[] =
+{
+    &sr_vns_driver,
+    &sr_packet_driver,
+    &sr_replay_driver,
+    0
+};
+
+static void sr_log_packet(struct sr_instance* , uint8_t* , int );
+static int  sr_ether_addrs_match_interface(struct sr_instance* sr,
+                                           uint8_t* buf,
+                                           struct sr_if* iface);
+static int  sr_arp_req_not_for_us(struct sr_instance* sr,
+                                  uint8_t * packet /* lent */,
+                                  unsigned int len,
+                                  struct sr_if* iface /* lent */);
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_open(..)
+ * Scope: Global
+ *
+ * Find the driver named in spec ("name" or "name:arg") and open it.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_io_open(struct sr_instance* sr, const char* spec)
+{
+    const char* arg = 0;
+    size_t name_len = 0;
+    int i = 0;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(spec);
+
+    arg = strchr(spec, ':');
+    name_len = arg ? (size_t)(arg - spec) : strlen(spec);
+    if ( arg )
+    { arg++; }
+
+    for ( i = 0; sr_io_drivers[i]; i++ )
+    {
+        if ( strlen(sr_io_drivers[i]->name) == name_len &&
+             strncmp(sr_io_drivers[i]->name, spec, name_len) == 0 )
+        { break; }
+    }
+
+    if ( sr_io_drivers[i] == 0 )
+    {
+        fprintf(stderr, "Unknown packet I/O driver %.*s\n", (int)name_len, spec);
+        return -1;
+    }
+
+    sr->io = sr_io_drivers[i];
+    if ( sr->io->open(sr, arg) != 0 )
+    {
+        sr->io->close(sr);
+        sr->io = 0;
+        return -1;
+    }
+
+    return 0;
+} /* -- sr_io_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_discover(..)
+ * Scope: Global
+ *
+ * Wait until the driver knows the router's interfaces.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_io_discover(struct sr_instance* sr)
+{
+    /* REQUIRES */
+    assert(sr);
+    assert(sr->io);
+
+    if ( sr->io->discover(sr) != 0 )
+    { return -1; }
+
+    if ( sr->if_count == 0 )
+    {
+        fprintf(stderr, "No interfaces found\n");
+        return -1;
+    }
+
+    return 0;
+} /* -- sr_io_discover -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_poll(..)
+ * Scope: Global
+ *
+ * Houses the main loop: pass one batch of received frames to the router,
+ * then send what it produced.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_io_poll(struct sr_instance* sr)
+{
+    int ret = 0;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(sr->io);
+
+    ret = sr->io->rx_batch(sr);
+
+    if ( sr->io->tx_batch(sr) != 0 )
+    { return -1; }
+
+    return ret;
+} /* -- sr_io_poll -- */
+
+void sr_io_close(struct sr_instance* sr)
+{
+    /* REQUIRES */
+    assert(sr);
+
+    if ( sr->io == 0 )
+    { return; }
+
+    sr->io->close(sr);
+    sr->io = 0;
+} /* -- sr_io_close -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_deliver(..)
+ * Scope: Global
+ *
+ * Pass one received Ethernet frame to the router.  iface is the interned
+ * interface it arrived on.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_io_deliver(struct sr_instance* sr, uint8_t* frame, unsigned int len,
+                   struct sr_if* iface)
+{
+    if ( len < sizeof(struct sr_ethernet_hdr) )
+    { return; }
+
+    /* -- check if it is an ARP to another router if so drop   -- */
+    if ( sr_arp_req_not_for_us(sr, frame, len, iface) )
+    { return; }
+
+    /* -- log packet -- */
+    sr_log_packet(sr, frame, len);
+
+    /* -- with worker threads, the one owning the flow handles it -- */
+    if ( sr->workers )
+    {
+        sr_worker_deliver(sr, frame, len, iface);
+        return;
+    }
+
+    /* -- pass to router, student's code should take over here -- */
+    sr_handlepacket(sr, frame, len, iface);
+} /* -- sr_io_deliver -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet(..)
+ * Scope: Global
+ *
+ * Send a packet (ethernet header included!) of length 'len' out of
+ * interface if_out.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         struct sr_if* if_out /* borrowed */)
+{
+    /* REQUIRES */
+    assert(sr);
+    assert(buf);
+    assert(if_out);
+
+    /* don't waste my time ... */
+    if ( len < sizeof(struct sr_ethernet_hdr) ){
+        fprintf(stderr , "** Error: packet is wayy to short \n");
+        return -1;
+    }
+
+    /* -- log packet -- */
+    sr_log_packet(sr,buf,len);
+
+    if ( ! sr_ether_addrs_match_interface( sr, buf, if_out) ){
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        return -1;
+    }
+
+    if ( sr->io == 0 )
+    { return -1; }
+
+    return sr->io->send(sr, buf, len, if_out);
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ether_addrs_match_interface(..)
+ * Scope: Local
+ *
+ * Make sure ethernet addresses are sane so we don't muck uo the system.
+ *
+ *----------------------------------------------------------------------------*/
+
+static int
+sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
+                                uint8_t* buf, /* borrowed */
+                                struct sr_if* iface /* borrowed */ )
+{
+    struct sr_ethernet_hdr* ether_hdr = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(buf);
+    assert(iface);
+
+    ether_hdr = (struct sr_ethernet_hdr*)buf;
+
+    if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
+        fprintf( stderr, "** Error, source address does not match interface\n");
+        return 0;
+    }
+
+    /* TODO */
+    /* Check destination, hardware address.  If it is private (i.e. destined
+     * to a virtual interface) ensure it is going to the correct topology
+     * Note: This check should really be done server side ...
+     */
+
+    return 1;
+
+} /* -- sr_ether_addrs_match_interface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_log_packet()
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
+{
+    struct pcap_pkthdr h;
+    int size;
+
+    /* REQUIRES */
+    assert(sr);
+
+    if(!sr->logfile)
+    {return; }
+
+    size = min(PACKET_DUMP_SIZE, len);
+
+    gettimeofday(&h.ts, 0);
+    h.caplen = size;
+    h.len = len;
+
+    /* -- workers log what they send, keep each record in one piece -- */
+    flockfile(sr->logfile);
+    sr_dump(sr->logfile, &h, buf);
+    fflush(sr->logfile);
+    funlockfile(sr->logfile);
+} /* -- sr_log_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_arp_req_not_for_us()
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static int  sr_arp_req_not_for_us(struct sr_instance* sr,
+                           uint8_t * packet /* lent */,
+                           unsigned int len,
+                           struct sr_if* iface /* lent */)
+{
+    struct sr_ethernet_hdr* e_hdr = 0;
+    struct sr_arp_hdr*       a_hdr = 0;
+
+    if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr) )
+    { return 0; }
+
+    assert(iface);
+
+    e_hdr = (struct sr_ethernet_hdr*)packet;
+    a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
+
+    if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
+            (a_hdr->ar_op      == htons(arp_op_request))   &&
+            (a_hdr->ar_tip     != iface->ip ) )
+    { return 1; }
+
+    return 0;
+} /* -- sr_arp_req_not_for_us -- */
@@ -0,0 +1,81 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_io.h
+ *
+ * Description:
+ *
+ * Packet I/O drivers.  A driver gets the router's interfaces and moves
+ * Ethernet frames between them and the router.  The router only ever calls
+ * sr_send_packet(..), and drivers hand received frames to sr_io_deliver(..).
+ *
+ * vns    : a VNS/POX server over TCP (sr_vns_comm.c), the default
+ * packet : Linux interfaces such as veth pairs, through AF_PACKET
+ *          TPACKET_V3 rings (sr_packet.c)
+ * replay : frames from a pcap file, as fast as the router takes them, with
+ *          a throughput and latency report (sr_replay.c)
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_IO_H
+#define sr_IO_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _SOLARIS_
+#include </usr/include/sys/int_types.h>
+#endif /* SOLARIS */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif
+
+struct sr_instance;
+struct sr_if;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_io_driver
+ *
+ * All functions return 0 on success and -1 on error unless noted.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_io_driver
+{
+    const char* name;
+
+    /* -- connect or attach, arg is what followed "name:" on the command
+          line (may be 0) -- */
+    int (*open)(struct sr_instance* , const char* arg);
+
+    /* -- add the router's interfaces with sr_add_interface(..) and friends,
+          blocking until they are known -- */
+    int (*discover)(struct sr_instance* );
+
+    /* -- wait for frames and pass one batch of them to sr_io_deliver(..).
+          1 to keep going, 0 when the other side closed, -1 on error -- */
+    int (*rx_batch)(struct sr_instance* );
+
+    /* -- send or queue one frame, checks have been done -- */
+    int (*send)(struct sr_instance* , uint8_t* buf, unsigned int len,
+                struct sr_if* iface);
+
+    /* -- send everything send(..) queued -- */
+    int (*tx_batch)(struct sr_instance* );
+
+    void (*close)(struct sr_instance* );
+};
+
+extern struct sr_io_driver sr_vns_driver;
+extern struct sr_io_driver sr_packet_driver;
+extern struct sr_io_driver sr_replay_driver;
+
+/* spec is "name" or "name:arg" */
+int  sr_io_open(struct sr_instance* , const char* spec);
+int  sr_io_discover(struct sr_instance* );
+int  sr_io_poll(struct sr_instance* );
+void sr_io_close(struct sr_instance* );
+void sr_io_deliver(struct sr_instance* , uint8_t* frame, unsigned int len,
+                   struct sr_if* iface);
+
+#endif /* -- sr_IO_H -- */
@@ -33,6 +33,12 @@
 #include "sr_router.h"
 #include "sr_rt.h"
 #include "sr_nat.h"
+#include "sr_fib.h"
+#include "sr_flow.h"
+#include "sr_shm.h"
+#include "sr_io.h"
+#include "sr_worker.h"
+#include "sr_timer.h"
 
 extern char* optarg;
 
@@ -45,6 +51,8 @@ extern char* optarg;
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_RTABLE "rtable"
 #define DEFAULT_TOPO 0
+#define DEFAULT_TX_BATCH 32
+#define DEFAULT_DRIVER "vns"
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
@@ -71,12 +79,20 @@ int main(int argc, char **argv)
     int queryTimeout = 60;
     int tcpEstTimeout = 7440;
     int tcpTransTimeout = 300;
+    int fibMode = fib_mode_trie;
+    int arpCacheSize = 0;
+    int txBatch = DEFAULT_TX_BATCH;
+    int shmEnable = 0;
+    int numWorkers = 0;
+    unsigned int i;
+    char *driver = DEFAULT_DRIVER;
+    char vnsSpec[300];
 
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hns:v:p:u:t:r:l:T:I:E:R:")) != EOF)
+    while ((c = getopt(argc, argv, "hnSs:v:p:u:t:r:l:T:I:E:R:f:a:b:d:w:")) != EOF)
     {
         switch (c)
         {
@@ -111,6 +127,9 @@ int main(int argc, char **argv)
             case 'n':
                 natEnable = 1;
                 break;
+            case 'S':
+                shmEnable = 1;
+                break;
             case 'I':
                 queryTimeout = atoi(optarg);
                 break;
@@ -120,11 +139,57 @@ int main(int argc, char **argv)
             case 'R':
                 tcpTransTimeout = atoi(optarg);
                 break;
+            case 'f':
+                fibMode = sr_fib_parse_mode(optarg);
+                if (fibMode < 0) {
+                    fprintf(stderr, "Unknown FIB mode %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                arpCacheSize = atoi(optarg);
+                if (arpCacheSize <= 0) {
+                    fprintf(stderr, "ARP cache size must be positive\n");
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                driver = optarg;
+                break;
+            case 'w':
+                numWorkers = atoi(optarg);
+                if (numWorkers < 0 || numWorkers > SR_WORKER_MAX) {
+                    fprintf(stderr, "Workers must be 0 to %d\n", SR_WORKER_MAX);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                txBatch = atoi(optarg);
+                if (txBatch <= 0) {
+                    fprintf(stderr, "Transmit batch must be positive\n");
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
         } /* switch */
     } /* -- while -- */
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.fibMode = fibMode;
+    sr.arpCacheSize = arpCacheSize;
+    sr.shmEnable = shmEnable;
+    sr.numWorkers = numWorkers;
+
+    /* -- this thread reads from the server, so it owns the transmit queue -- */
+    if(sr_tx_init(&sr, txBatch) != 0)
+    {
+        fprintf(stderr,"Error allocating transmit queue\n");
+        exit(1);
+    }
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -154,14 +219,21 @@ int main(int argc, char **argv)
         }
     }
 
-    Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
-    if(template)
-        Debug("Requesting topology template %s\n", template);
-    else
-        Debug("Requesting topology %d\n", topo);
+    /* -- the vns driver gets the server from -s and -p -- */
+    if(strcmp(driver, "vns") == 0)
+    {
+        Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
+        if(template)
+            Debug("Requesting topology template %s\n", template);
+        else
+            Debug("Requesting topology %d\n", topo);
+
+        snprintf(vnsSpec, sizeof(vnsSpec), "vns:%s:%u", server, port);
+        driver = vnsSpec;
+    }
 
     /* connect to server and negotiate session */
-    if(sr_connect_to_server(&sr,port,server) == -1)
+    if(sr_io_open(&sr, driver) == -1)
     {
         return 1;
     }
@@ -175,31 +247,62 @@ int main(int argc, char **argv)
       sr_load_rt_wrap(&sr, rtable);
     }
 
+    /* -- wait for the interfaces, NAT needs them -- */
+    if(sr_io_discover(&sr) != 0)
+    {
+        return 1;
+    }
+
+    /* -- one thread runs the ARP cache and NAT timeouts -- */
+    if(sr_timer_start(&sr) != 0)
+    {
+        return 1;
+    }
 
-    /* nat intialization */
+    /* nat intialization, one shard per worker */
     sr.nat = NULL;
 	sr.natEnable = natEnable;
+    sr.natShards = numWorkers ? numWorkers : 1;
     if (natEnable) {
-        sr.nat = (struct sr_nat *) malloc(sizeof(struct sr_nat));
+        sr.nat = (struct sr_nat *) malloc(sr.natShards * sizeof(struct sr_nat));
         assert(sr.nat);
 
-        sr_nat_init(sr.nat);
-
-        sr.nat->icmpTimeout = queryTimeout;
-        sr.nat->tcpEstTimeout = tcpEstTimeout;
-        sr.nat->tcpTransTimeout = tcpTransTimeout;
-	sr.nat->sr = &sr;
+        for (i = 0; i < sr.natShards; i++) {
+            if (sr_nat_init(&(sr.nat[i])) != 0 || sr_nat_set_shard(&(sr.nat[i]), i, sr.natShards) != 0) {
+                fprintf(stderr, "NAT: could not allocate shard %u\n", i);
+                exit(1);
+            }
+
+            sr.nat[i].icmpTimeout = queryTimeout;
+            sr.nat[i].tcpEstTimeout = tcpEstTimeout;
+            sr.nat[i].tcpTransTimeout = tcpTransTimeout;
+            sr.nat[i].sr = &sr;
+            if (sr_nat_set_interfaces(&(sr.nat[i])) != 0) {
+                exit(1);
+            }
+            sr_nat_start_timers(&(sr.nat[i]));
+        }
     }
 
 
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr);
 
+    if(sr_worker_start(&sr) != 0)
+    {
+        return 1;
+    }
+
     /* -- whizbang main loop ;-) */
-    while( sr_read_from_server(&sr) == 1);
+    while( sr_io_poll(&sr) == 1);
+
+    sr_timer_stop(&sr);
+    sr_worker_stop(&sr);
 
 	if (natEnable) {
-		sr_nat_destroy(sr.nat);
+		for (i = 0; i < sr.natShards; i++) {
+			sr_nat_destroy(&(sr.nat[i]));
+		}
 	}
 	
     sr_destroy_instance(&sr);
@@ -218,7 +321,12 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-f list|trie|dir24] \n");
+    printf("           [-a arp cache entries] [-b transmit batch] \n");
+    printf("           [-S (shared memory with a local server)] \n");
+    printf("           [-d vns|packet:if[=ip],if[=ip]...] \n");
+    printf("           [-d replay:capture.pcap,conf=file[,out=file][,loops=N]] \n");
+    printf("           [-w worker threads] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -265,6 +373,11 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_fib_destroy(sr->fib);
+    sr_flow_destroy(sr);
+    sr_io_close(sr);
+    sr_tx_destroy(sr);
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -282,12 +395,29 @@ static void sr_init_instance(struct sr_instance* sr)
     /* REQUIRES */
     assert(sr);
 
+    sr->io = 0;
     sr->sockfd = -1;
+    sr->rx = 0;
+    sr->tx = 0;
+    sr->shm = 0;
+    sr->shmEnable = 0;
+    sr->packet = 0;
+    sr->replay = 0;
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
+    sr->if_count = 0;
     sr->routing_table = 0;
+    sr->fib = 0;
+    sr->fibMode = fib_mode_trie;
+    sr->arpCacheSize = 0;
+    sr->flows = 0;
+    sr->flowGen = 0;
+    sr->numWorkers = 0;
+    sr->workers = 0;
+    sr->timers = 0;
+    sr->natShards = 1;
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
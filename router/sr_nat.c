@@ -1,7 +1,5 @@
 
-#include <signal.h>
 #include <assert.h>
-#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,241 +9,446 @@
 #include "sr_utils.h"
 #include "sr_if.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_flow.h"
 #include "icmp_handler.h"
 
+static unsigned int sr_nat_ext_hash(struct sr_nat *nat, uint16_t aux_ext, sr_nat_mapping_type type) {
+	uint32_t key = ((uint32_t) type << 16) | aux_ext;
+	return (key * 2654435761u) >> (32 - nat->hashBits);
+}
 
-int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
+static unsigned int sr_nat_int_hash(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+	uint32_t key = ip_int ^ ((((uint32_t) type << 16) | aux_int) * 2246822519u);
+	return (key * 2654435761u) >> (32 - nat->hashBits);
+}
 
-  assert(nat);
+/* Sizes the indexes for numPorts ports of every mapping type. Only while
+   there are no mappings. Returns -1 if out of memory */
+static int sr_nat_alloc_indexes(struct sr_nat *nat, unsigned int numPorts) {
+	unsigned int bits = SR_NAT_HASH_MIN_BITS;
+	while ((1u << bits) < numPorts * SR_NAT_MAPPING_TYPES) {
+		bits++;
+	}
 
-  /* Acquire mutex lock */
-  pthread_mutexattr_init(&(nat->attr));
-  pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+	free(nat->extIndex);
+	free(nat->intIndex);
+	free(nat->connIndex);
+	nat->hashBits = bits;
+	nat->extIndex = (struct sr_nat_mapping **) calloc(1u << bits, sizeof(struct sr_nat_mapping *));
+	nat->intIndex = (struct sr_nat_mapping **) calloc(1u << bits, sizeof(struct sr_nat_mapping *));
+	nat->connIndex = (struct sr_nat_connection **) calloc(1u << bits, sizeof(struct sr_nat_connection *));
+	return nat->extIndex && nat->intIndex && nat->connIndex ? 0 : -1;
+}
 
-  /* Initialize timeout thread */
+/* A shard only hands out the ports equal to its index mod the shard count */
+static void sr_nat_port_pool_init(struct sr_nat_port_pool *pool, unsigned int shard, unsigned int numShards) {
+	unsigned int port;
+	pool->numFree = 0;
+	for (port = SR_NAT_PORT_MIN; port < SR_NAT_PORT_MAX; port++) {
+		if (port % numShards == shard) {
+			pool->freePorts[pool->numFree++] = port;
+		}
+	}
+	pool->head = 0;
+	pool->exhausted = 0;
+}
 
-  pthread_attr_init(&(nat->thread_attr));
-  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
+/* Take the least recently freed port. Returns 0 if every port is in use */
+static uint16_t sr_nat_port_alloc(struct sr_nat_port_pool *pool) {
+	if (pool->numFree == 0) {
+		pool->exhausted++;
+		return 0;
+	}
 
-  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
+	uint16_t port = pool->freePorts[pool->head];
+	pool->head = (pool->head + 1) % SR_NAT_PORT_COUNT;
+	pool->numFree--;
+	return port;
+}
 
-  /* Initialize any variables here */
-	nat->mappings = NULL;
-	nat->incoming = NULL;
-	nat->nextPort = 1024;
+static void sr_nat_port_free(struct sr_nat_port_pool *pool, uint16_t port) {
+	pool->freePorts[(pool->head + pool->numFree) % SR_NAT_PORT_COUNT] = port;
+	pool->numFree++;
+}
 
-  return success;
+/* TCP connections are keyed on the full 5-tuple. The protocol is always TCP */
+static unsigned int sr_nat_conn_hash(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int, uint32_t ext_ip, uint16_t ext_port) {
+	uint32_t key = ip_int ^ (ext_ip * 2246822519u) ^ ((((uint32_t) aux_int << 16) | ext_port) * 3266489917u);
+	return (key * 2654435761u) >> (32 - nat->hashBits);
 }
 
+/* Find a mapping's connection to (ext_ip, ext_port). Caller must hold the nat lock */
+static struct sr_nat_connection *sr_nat_find_connection(struct sr_nat *nat,
+	struct sr_nat_mapping *mapping, uint32_t ext_ip, uint16_t ext_port) {
 
-int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
+	struct sr_nat_connection *conn = nat->connIndex[sr_nat_conn_hash(nat, mapping->ip_int, mapping->aux_int, ext_ip, ext_port)];
+	while (conn != NULL) {
+		if (conn->mapping == mapping && conn->ext_ip == ext_ip && conn->ext_port == ext_port) {
+			return conn;
+		}
+		conn = conn->hash_next;
+	}
+	return NULL;
+}
 
-	pthread_mutex_lock(&(nat->lock));
+/* Add a connection to the front of its mapping's list and to the connection index */
+static void sr_nat_link_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+	struct sr_nat_connection *conn) {
 
-	/* free nat memory here */
-	struct sr_nat_mapping *curr = nat->mappings;
+	conn->mapping = mapping;
+	conn->prev = NULL;
+	conn->next = mapping->conns;
+	if (mapping->conns != NULL) {
+		mapping->conns->prev = conn;
+	}
+	mapping->conns = conn;
+
+	unsigned int bucket = sr_nat_conn_hash(nat, mapping->ip_int, mapping->aux_int, conn->ext_ip, conn->ext_port);
+	conn->hash_next = nat->connIndex[bucket];
+	nat->connIndex[bucket] = conn;
+}
+
+/* Remove a connection from its mapping and the connection index, then free it */
+static void sr_nat_remove_connection(struct sr_nat *nat, struct sr_nat_connection *conn) {
+	struct sr_nat_mapping *mapping = conn->mapping;
+
+	if (conn->prev == NULL) {
+		mapping->conns = conn->next;
+	} else {
+		conn->prev->next = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+
+	struct sr_nat_connection **walker = &(nat->connIndex[sr_nat_conn_hash(nat, mapping->ip_int, mapping->aux_int, conn->ext_ip, conn->ext_port)]);
+	while (*walker != NULL) {
+		if (*walker == conn) {
+			*walker = conn->hash_next;
+			break;
+		}
+		walker = &((*walker)->hash_next);
+	}
+
+	sr_timer_cancel(&(nat->timers), &(conn->timer));
+	free(conn);
+
+	/* Flows learned for it would skip setting up the next connection */
+	if (nat->sr != NULL) {
+		sr_flow_invalidate(nat->sr);
+	}
+}
+
+/* Find the mapping for an external port. Caller must hold the nat lock */
+static struct sr_nat_mapping *sr_nat_find_external(struct sr_nat *nat,
+	uint16_t aux_ext, sr_nat_mapping_type type) {
+
+	struct sr_nat_mapping *curr = nat->extIndex[sr_nat_ext_hash(nat, aux_ext, type)];
 	while (curr != NULL) {
-		struct sr_nat_mapping *prev = curr;
-		curr = curr->next;
-		free(prev);
+		if (curr->aux_ext == aux_ext && curr->type == type) {
+			return curr;
+		}
+		curr = curr->ext_next;
 	}
+	return NULL;
+}
 
-	struct sr_tcp_syn *incoming = nat->incoming;
-	while (incoming != NULL) {
-		struct sr_tcp_syn *prev = incoming;
-		incoming = incoming->next;
-		free(prev);
+/* Find the mapping for an internal (ip, port) pair. Caller must hold the nat lock */
+static struct sr_nat_mapping *sr_nat_find_internal(struct sr_nat *nat,
+	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+
+	struct sr_nat_mapping *curr = nat->intIndex[sr_nat_int_hash(nat, ip_int, aux_int, type)];
+	while (curr != NULL) {
+		if (curr->ip_int == ip_int && curr->aux_int == aux_int && curr->type == type) {
+			return curr;
+		}
+		curr = curr->int_next;
 	}
+	return NULL;
+}
 
-  pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-    pthread_mutexattr_destroy(&(nat->attr));
+/* Add a mapping to the front of the mapping list and to both indexes */
+static void sr_nat_link_mapping(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+	mapping->prev = NULL;
+	mapping->next = nat->mappings;
+	if (nat->mappings != NULL) {
+		nat->mappings->prev = mapping;
+	}
+	nat->mappings = mapping;
+
+	unsigned int extBucket = sr_nat_ext_hash(nat, mapping->aux_ext, mapping->type);
+	mapping->ext_next = nat->extIndex[extBucket];
+	nat->extIndex[extBucket] = mapping;
+
+	unsigned int intBucket = sr_nat_int_hash(nat, mapping->ip_int, mapping->aux_int, mapping->type);
+	mapping->int_next = nat->intIndex[intBucket];
+	nat->intIndex[intBucket] = mapping;
 }
 
-void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
-	struct sr_nat *nat = (struct sr_nat *)nat_ptr;
-	while (1) {
-		sleep(1.0);
-		pthread_mutex_lock(&(nat->lock));
+/* Remove a mapping from the mapping list and both indexes. Does not free it */
+static void sr_nat_unlink_mapping(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+	if (mapping->prev == NULL) {
+		nat->mappings = mapping->next;
+	} else {
+		mapping->prev->next = mapping->next;
+	}
+	if (mapping->next != NULL) {
+		mapping->next->prev = mapping->prev;
+	}
 
-		time_t curtime = time(NULL);
+	struct sr_nat_mapping **walker = &(nat->extIndex[sr_nat_ext_hash(nat, mapping->aux_ext, mapping->type)]);
+	while (*walker != NULL) {
+		if (*walker == mapping) {
+			*walker = mapping->ext_next;
+			break;
+		}
+		walker = &((*walker)->ext_next);
+	}
 
-		/* Unsolicited incoming SYN timeout */
-		struct sr_tcp_syn *incoming = nat->incoming;
-		struct sr_tcp_syn *prevIncoming = NULL;
-		while (incoming != NULL) {
+	walker = &(nat->intIndex[sr_nat_int_hash(nat, mapping->ip_int, mapping->aux_int, mapping->type)]);
+	while (*walker != NULL) {
+		if (*walker == mapping) {
+			*walker = mapping->int_next;
+			break;
+		}
+		walker = &((*walker)->int_next);
+	}
+}
 
-			if (difftime(curtime, incoming->arrived) >= 6) {
-				/* Timeout exceeded. Send ICMP packet */
-				icmp_send_port_unreachable(nat->sr, incoming->data, incoming->len, incoming->interface);
+/* Unlink a mapping and free it along with its connections */
+static void sr_nat_remove_mapping(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+	while (mapping->conns != NULL) {
+		sr_nat_remove_connection(nat, mapping->conns);
+	}
 
-				/* Remove entry from incoming list*/
-				if (prevIncoming == NULL) {
-					nat->incoming = incoming->next;
-				} else {
-					prevIncoming->next = incoming->next;
-				}
+	sr_nat_unlink_mapping(nat, mapping);
+	sr_timer_cancel(&(nat->timers), &(mapping->timer));
+	sr_nat_port_free(&(nat->ports[mapping->type]), ntohs(mapping->aux_ext));
+	free(mapping);
 
-				/* Free incoming entry */
-				struct sr_tcp_syn *tmp = incoming;
-				incoming = incoming->next;
-				free(tmp->data);
-				free(tmp);			
-			
-			} else {
-				prevIncoming = incoming;
-				incoming = incoming->next;
-			}		
+	if (nat->sr != NULL) {
+		sr_flow_invalidate(nat->sr);
+	}
+}
+
+/* Seconds a TCP connection may sit idle in its current state */
+static int sr_nat_conn_timeout(struct sr_nat *nat, struct sr_nat_connection *conn) {
+	/* Established: Both SYN recevied, no FIN received */
+	int isEstablished = conn->int_syn && conn->ext_syn && !(conn->int_fin) && !(conn->ext_fin);
+	return isEstablished ? nat->tcpEstTimeout : nat->tcpTransTimeout;
+}
+
+/* ICMP mapping timeout. Lookups only refresh last_updated, so a mapping
+   still in use gets its timer re-armed here */
+static void sr_nat_mapping_timer(void *ctx, void *arg) {
+	struct sr_nat *nat = (struct sr_nat *) ctx;
+	struct sr_nat_mapping *mapping = (struct sr_nat_mapping *) arg;
+	int left = nat->icmpTimeout - (int) difftime(time(NULL), mapping->last_updated);
+
+	if (left <= 0) {
+		sr_nat_remove_mapping(nat, mapping);
+	} else {
+		sr_timer_set(&(nat->timers), &(mapping->timer), (uint64_t) left * 1000);
+	}
+}
+
+/* TCP connection timeout, re-armed like the ICMP one. The mapping goes
+   with its last connection */
+static void sr_nat_conn_timer(void *ctx, void *arg) {
+	struct sr_nat *nat = (struct sr_nat *) ctx;
+	struct sr_nat_connection *conn = (struct sr_nat_connection *) arg;
+	int left = sr_nat_conn_timeout(nat, conn) - (int) difftime(time(NULL), conn->update_time);
+
+	if (left > 0) {
+		sr_timer_set(&(nat->timers), &(conn->timer), (uint64_t) left * 1000);
+		return;
+	}
+
+	struct sr_nat_mapping *mapping = conn->mapping;
+	sr_nat_remove_connection(nat, conn);
+	if (mapping->conns == NULL) {
+		sr_nat_remove_mapping(nat, mapping);
+	}
+}
+
+/* Unsolicited incoming SYN nobody inside answered */
+static void sr_nat_syn_timer(void *ctx, void *arg) {
+	struct sr_nat *nat = (struct sr_nat *) ctx;
+	struct sr_tcp_syn *syn = (struct sr_tcp_syn *) arg;
+
+	icmp_send_port_unreachable(nat->sr, syn->data, syn->len, sr_get_interface_by_index(nat->sr, syn->ifindex));
+
+	struct sr_tcp_syn **walker = &(nat->incoming);
+	while (*walker != NULL) {
+		if (*walker == syn) {
+			*walker = syn->next;
+			break;
 		}
+		walker = &((*walker)->next);
+	}
+	free(syn->data);
+	free(syn);
+}
 
-		/* NAT Mapping timeout */
-		struct sr_nat_mapping *mapping = nat->mappings;
-		struct sr_nat_mapping *prevMapping = NULL;
+int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
 
-		while (mapping != NULL) {			
-			int mappingTimeout = 0;
+  assert(nat);
 
-			switch (mapping->type) {
-				case nat_mapping_icmp: {
-					int diff = difftime(curtime, mapping->last_updated);						
+  /* Acquire mutex lock */
+  pthread_mutexattr_init(&(nat->attr));
+  pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
+  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
 
-					/* ICMP timed out. Remove entry */				
-					mappingTimeout = diff >= (nat->icmpTimeout);	
-					break;
+  /* Timeouts, run by the timer thread once sr_nat_start_timers is called */
+  sr_timer_wheel_init(&(nat->timers), &(nat->lock), nat);
 
-				} case nat_mapping_tcp: {
-					struct sr_nat_connection *conn = mapping->conns;
-					struct sr_nat_connection *prevConn = NULL;
+  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-					while (conn != NULL) {
-						int diff = difftime(curtime, conn->update_time);
+  /* Initialize any variables here */
+	nat->sr = NULL;
+	nat->mappings = NULL;
+	nat->extIndex = nat->intIndex = NULL;
+	nat->connIndex = NULL;
+	success |= sr_nat_alloc_indexes(nat, SR_NAT_PORT_COUNT);
+	nat->incoming = NULL;
+	int type;
+	for (type = 0; type < SR_NAT_MAPPING_TYPES; type++) {
+		sr_nat_port_pool_init(&(nat->ports[type]), 0, 1);
+	}
 
-						/* Established: Both SYN recevied, no FIN received */
-						int isEstablished = conn->int_syn && conn->ext_syn && !(conn->int_fin) && !(conn->ext_fin);
-						int connTimeout = 0;
+  return success;
+}
 
-						if (isEstablished) {
-							connTimeout = diff >= nat->tcpEstTimeout;
-						} else {
-							connTimeout = diff >= nat->tcpTransTimeout;
-						}
+/* Make this NAT shard number shard of numShards. Call before any mapping
+   exists. Returns -1 if the indexes could not be resized */
+int sr_nat_set_shard(struct sr_nat *nat, unsigned int shard, unsigned int numShards) {
+	int type;
+	for (type = 0; type < SR_NAT_MAPPING_TYPES; type++) {
+		sr_nat_port_pool_init(&(nat->ports[type]), shard, numShards);
+	}
+	return sr_nat_alloc_indexes(nat, nat->ports[0].numFree);
+}
 
-						if (connTimeout) {
-							/* Remove the connection from mapping */
-							if (prevConn == NULL) {
-								mapping->conns = conn->next;
-							} else {	
-								prevConn->next = conn->next;
-							}
+void sr_nat_start_timers(struct sr_nat *nat) {
+	sr_timer_add_wheel(nat->sr, &(nat->timers));
+}
 
-							struct sr_nat_connection *tmp = conn;
-							conn = conn->next;
-							free(tmp);
+unsigned int sr_nat_shard_ext(struct sr_instance *sr, uint16_t aux_ext) {
+	return ntohs(aux_ext) % sr->natShards;
+}
 
-							/* No more connections left. Can remove mapping */					
-							mappingTimeout = mapping->conns == NULL;	
+unsigned int sr_nat_shard_int(struct sr_instance *sr, uint32_t ip_int, uint16_t aux_int) {
+	uint32_t key = (ip_int ^ ((uint32_t) aux_int * 2246822519u)) * 2654435761u;
+	key ^= key >> 16;
+	return (key * 0x45d9f3bu >> 16) % sr->natShards;
+}
 
-						} else {
-							/* No timeout. Check next connection */
-							prevConn = conn;
-							conn = conn->next;
-						}
-					}
-					break;
-				}
-			}
+/* Resolve the NAT's interfaces to indices so the packet path never looks
+   them up by name. Returns -1 if either is missing */
+int sr_nat_set_interfaces(struct sr_nat *nat) {
+	struct sr_if *internalIf = sr_get_interface(nat->sr, SR_NAT_INT_IFACE);
+	struct sr_if *externalIf = sr_get_interface(nat->sr, SR_NAT_EXT_IFACE);
+	if (internalIf == NULL || externalIf == NULL) {
+		fprintf(stderr, "NAT: interfaces %s/%s not found\n", SR_NAT_INT_IFACE, SR_NAT_EXT_IFACE);
+		return -1;
+	}
 
-			/* Timeout exceeded on this mapping. Remove it */
-			if (mappingTimeout) {
-				if (prevMapping == NULL) {
-					nat->mappings = mapping->next;
-				} else {
-					prevMapping->next = mapping->next;
-				}
+	nat->intIfindex = internalIf->index;
+	nat->extIfindex = externalIf->index;
+	return 0;
+}
 
-				/* Free memory */
-				struct sr_nat_mapping *tmp = mapping;
-				mapping = mapping->next;
-				free(tmp);
 
-			} else {
-				prevMapping = mapping;
-				mapping = mapping->next;
-			}
+int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
+
+	pthread_mutex_lock(&(nat->lock));
+
+	int type;
+	for (type = 0; type < SR_NAT_MAPPING_TYPES; type++) {
+		if (nat->ports[type].exhausted) {
+			fprintf(stderr, "NAT: %s port pool was exhausted, %lu mappings refused\n",
+				type == nat_mapping_tcp ? "TCP" : "ICMP", nat->ports[type].exhausted);
 		}
+	}
 
-		pthread_mutex_unlock(&(nat->lock));
+	/* free nat memory here */
+	while (nat->mappings != NULL) {
+		sr_nat_remove_mapping(nat, nat->mappings);
 	}
 
-	return NULL;
+	struct sr_tcp_syn *incoming = nat->incoming;
+	while (incoming != NULL) {
+		struct sr_tcp_syn *prev = incoming;
+		incoming = incoming->next;
+		sr_timer_cancel(&(nat->timers), &(prev->timer));
+		free(prev->data);
+		free(prev);
+	}
+	free(nat->extIndex);
+	free(nat->intIndex);
+	free(nat->connIndex);
+
+	pthread_mutex_unlock(&(nat->lock));
+  return pthread_mutex_destroy(&(nat->lock)) &&
+    pthread_mutexattr_destroy(&(nat->attr));
 }
 
 /* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+   Copies it into result and returns 1 if found, 0 otherwise. */
+int sr_nat_lookup_external_r(struct sr_nat *nat,
+    uint16_t aux_ext, sr_nat_mapping_type type, struct sr_nat_mapping *result) {
 
 	pthread_mutex_lock(&(nat->lock));
 
-	/* handle lookup here, malloc and assign to copy */
-	struct sr_nat_mapping *copy = NULL;
-	struct sr_nat_mapping *curr = nat->mappings;
-
-	while (curr != NULL) {
-		if (curr->aux_ext == aux_ext && curr->type == type) {
-			/* Found mapping */
-			curr->last_updated = time(NULL);
-			copy = malloc(sizeof(struct sr_nat_mapping));
-			memcpy(copy, curr, sizeof(struct sr_nat_mapping));
-			break;						
-		}
-		curr = curr->next;
+	struct sr_nat_mapping *curr = sr_nat_find_external(nat, aux_ext, type);
+	if (curr != NULL) {
+		/* Found mapping */
+		curr->last_updated = time(NULL);
+		memcpy(result, curr, sizeof(struct sr_nat_mapping));
 	}
 
 	pthread_mutex_unlock(&(nat->lock));
-	return copy;
+	return curr != NULL;
 }
 
 /* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+   Copies it into result and returns 1 if found, 0 otherwise. */
+int sr_nat_lookup_internal_r(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *result) {
 
   	pthread_mutex_lock(&(nat->lock));
 
-  	/* handle lookup here, malloc and assign to copy */
-  	struct sr_nat_mapping *copy = NULL;
-	struct sr_nat_mapping *curr = nat->mappings;
-
-	while (curr != NULL) {
-		if (curr->ip_int == ip_int && curr->aux_int == aux_int && curr->type == type) {
-			/* Found mapping */
-			curr->last_updated = time(NULL);
-			copy = malloc(sizeof(struct sr_nat_mapping));
-			memcpy(copy, curr, sizeof(struct sr_nat_mapping));
-			break;						
-		}
-		curr = curr->next;
+	struct sr_nat_mapping *curr = sr_nat_find_internal(nat, ip_int, aux_int, type);
+	if (curr != NULL) {
+		/* Found mapping */
+		curr->last_updated = time(NULL);
+		memcpy(result, curr, sizeof(struct sr_nat_mapping));
 	}
 
 	pthread_mutex_unlock(&(nat->lock));
-	return copy;
+	return curr != NULL;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
+/* Insert a new mapping into the nat's mapping table and copy it into result.
+   Returns 0 if no external port is free.
  */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+int sr_nat_insert_mapping_r(struct sr_nat *nat,
+	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *result) {
 
 	pthread_mutex_lock(&(nat->lock));
 
+	/* Generate external port. Never hands out one still held by a mapping */
+	struct sr_nat_port_pool *pool = &(nat->ports[type]);
+	uint16_t port = sr_nat_port_alloc(pool);
+	if (port == 0) {
+		/* Counted in the pool, reported by sr_nat_destroy */
+		pthread_mutex_unlock(&(nat->lock));
+		return 0;
+	}
+
 	/* handle insert here, create a mapping, and then return a copy of it */
-	struct sr_if *externalIf = sr_get_interface(nat->sr, "eth2");
+	struct sr_if *externalIf = sr_get_interface_by_index(nat->sr, nat->extIfindex);
 	struct sr_nat_mapping *mapping = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
 
 	/* Construct mapping from given values*/
@@ -255,31 +458,70 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
 	mapping->aux_int = aux_int;
 	mapping->last_updated = time(NULL);
 	mapping->conns = NULL;
-
-	/* Generate external port */
-	mapping->aux_ext = htons(nat->nextPort); 
-	nat->nextPort = nat->nextPort + 1;
-	if (nat->nextPort >= 65535) {
-		/* Max ports reached. Restart back at first port */
-		nat->nextPort = 1024;
+	mapping->aux_ext = htons(port);
+	sr_timer_init(&(mapping->timer), sr_nat_mapping_timer, mapping);
+	if (type == nat_mapping_icmp) {
+		sr_timer_set(&(nat->timers), &(mapping->timer), (uint64_t) nat->icmpTimeout * 1000);
 	}
 
-	/* Insert mapping into front of list */
-	mapping->next = nat->mappings;
-	nat->mappings = mapping;
+	/* Insert mapping into front of list and into the indexes */
+	sr_nat_link_mapping(nat, mapping);
 
-	/* Create a copy to return*/ 
-	struct sr_nat_mapping *copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-	memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
+	/* Copy for the caller, for thread safety */
+	memcpy(result, mapping, sizeof(struct sr_nat_mapping));
 
 	pthread_mutex_unlock(&(nat->lock));
+	return 1;
+}
+
+/* Get the mapping associated with given external port.
+   You must free the returned structure if it is not NULL. */
+struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
+    uint16_t aux_ext, sr_nat_mapping_type type ) {
+
+	struct sr_nat_mapping result;
+	struct sr_nat_mapping *copy = NULL;
+
+	if (sr_nat_lookup_external_r(nat, aux_ext, type, &result)) {
+		copy = malloc(sizeof(struct sr_nat_mapping));
+		memcpy(copy, &result, sizeof(struct sr_nat_mapping));
+	}
+	return copy;
+}
+
+/* Get the mapping associated with given internal (ip, port) pair.
+   You must free the returned structure if it is not NULL. */
+struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+
+	struct sr_nat_mapping result;
+	struct sr_nat_mapping *copy = NULL;
+
+	if (sr_nat_lookup_internal_r(nat, ip_int, aux_int, type, &result)) {
+		copy = malloc(sizeof(struct sr_nat_mapping));
+		memcpy(copy, &result, sizeof(struct sr_nat_mapping));
+	}
+	return copy;
+}
+
+/* Insert a new mapping into the nat's mapping table.
+   Actually returns a copy to the new mapping, for thread safety.
+ */
+struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+
+	struct sr_nat_mapping *copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
+	if (!sr_nat_insert_mapping_r(nat, ip_int, aux_int, type, copy)) {
+		free(copy);
+		return NULL;
+	}
 	return copy;
 }
 
 /*	Translate the packet's dest/src IP based on whether it is
 		incoming or outcoming	*/
 int sr_nat_translate_packet(struct sr_instance* sr,
-	uint8_t *packet, unsigned int len, char* interface) {
+	uint8_t *packet, unsigned int len, struct sr_if *iface) {
 
 	struct sr_ip_hdr *ipPacket= (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 	pkt_dir direction = getPacketDirection(sr, ipPacket);
@@ -302,12 +544,19 @@ int sr_nat_translate_packet(struct sr_instance* sr,
 
 	/* At this point, packet is valid for mapping-lookup */
 
-	struct sr_nat_mapping *mapping = sr_nat_get_mapping_from_packet(sr, packet, len, interface, direction);
+	struct sr_nat_mapping mappingCopy;
+	struct sr_nat_mapping *mapping = &mappingCopy;
 
-	/* NULL mapping case */
-	if (mapping == NULL) {
+	/* No mapping case */
+	if (!sr_nat_get_mapping_from_packet(sr, packet, len, iface, direction, mapping)) {
 		switch(ip_p) {
 			case ip_protocol_icmp: {
+				/* Outgoing only fails when no ICMP id is free. Drop rather
+				   than leak the internal address */
+				if (direction == dir_outgoing) {
+					return 1;
+				}
+
 				/* Packet meant for router. Do nothing to it*/
 				return 0;
 
@@ -326,56 +575,61 @@ int sr_nat_translate_packet(struct sr_instance* sr,
 		sr_nat_update_tcp_connection(sr, packet, mapping, direction);
 	}
 
-	/* Rewrite the IP, Port, and recompute checksum*/
+	/* Rewrite the IP, Port, and adjust checksums for only the changed fields */
+	uint32_t oldIp = 0, newIp = 0;
+
 	switch(ip_p) {
 		case ip_protocol_icmp: {
 			sr_icmp_hdr_t *icmpPacket = (sr_icmp_hdr_t *) (packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+			uint16_t oldId = icmpPacket->icmp_identifier;
 			
 			if (direction == dir_incoming) {
-				ipPacket->ip_dst = mapping->ip_int;
+				oldIp = ipPacket->ip_dst;
+				ipPacket->ip_dst = newIp = mapping->ip_int;
 				icmpPacket->icmp_identifier = mapping->aux_int;
 
 			} else if (direction == dir_outgoing) {
-				ipPacket->ip_src = mapping->ip_ext;
+				oldIp = ipPacket->ip_src;
+				ipPacket->ip_src = newIp = mapping->ip_ext;
 				icmpPacket->icmp_identifier = mapping->aux_ext;
 			}
 
-			if (icmpPacket->icmp_type == 3) {
-				icmpPacket->icmp_sum = 0;
-				icmpPacket->icmp_sum = cksum(icmpPacket, len - sizeof(struct sr_ip_hdr) - sizeof(struct sr_ethernet_hdr));
-			} else {
-				icmpPacket->icmp_sum = 0;
-				icmpPacket->icmp_sum = cksum(icmpPacket, len - sizeof(struct sr_ip_hdr) - sizeof(struct sr_ethernet_hdr));
-			}
+			/* ICMP checksum has no pseudo header, only the identifier changed */
+			icmpPacket->icmp_sum = cksum_update16(icmpPacket->icmp_sum, oldId, icmpPacket->icmp_identifier);
 			break;
 
 		} case ip_protocol_tcp: {
 			sr_tcp_hdr_t *tcpPacket = (sr_tcp_hdr_t *) (packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+			uint16_t oldPort = 0, newPort = 0;
 		
 			if (direction == dir_incoming) {
-				ipPacket->ip_dst = mapping->ip_int;
-				tcpPacket->dest_port = mapping->aux_int;
+				oldIp = ipPacket->ip_dst;
+				ipPacket->ip_dst = newIp = mapping->ip_int;
+				oldPort = tcpPacket->dest_port;
+				tcpPacket->dest_port = newPort = mapping->aux_int;
 
 			} else if (direction == dir_outgoing) {
-				ipPacket->ip_src = mapping->ip_ext;
-				tcpPacket->src_port = mapping->aux_ext;
+				oldIp = ipPacket->ip_src;
+				ipPacket->ip_src = newIp = mapping->ip_ext;
+				oldPort = tcpPacket->src_port;
+				tcpPacket->src_port = newPort = mapping->aux_ext;
 			}	
 			
-			tcpPacket->sum = tcp_cksum(packet, len);				
+			/* TCP checksum covers the address through the pseudo header */
+			tcpPacket->sum = cksum_update32(tcpPacket->sum, oldIp, newIp);
+			tcpPacket->sum = cksum_update16(tcpPacket->sum, oldPort, newPort);
 			break;
 		 }
 	}
 
-	/* Rewrite the IP checksum */
-	ipPacket->ip_sum = 0;
-	ipPacket->ip_sum = cksum(ipPacket, sizeof(sr_ip_hdr_t));
+	/* Adjust the IP checksum for the rewritten address */
+	ipPacket->ip_sum = cksum_update32(ipPacket->ip_sum, oldIp, newIp);
 	
-	free(mapping);
 	return 0;
 }
 
 void sr_nat_update_tcp_connection(struct sr_instance *sr, uint8_t *packet, struct sr_nat_mapping *mapping, pkt_dir direction) {
-	struct sr_nat *nat = sr->nat;
+	struct sr_nat *nat = &(sr->nat[sr_nat_shard_ext(sr, mapping->aux_ext)]);
 	sr_ip_hdr_t *ipPacket= (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 	sr_tcp_hdr_t *tcpPacket = (sr_tcp_hdr_t *) (packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 
@@ -396,38 +650,24 @@ void sr_nat_update_tcp_connection(struct sr_instance *sr, uint8_t *packet, struc
 			break;
 		} default: {
 			printf("ERROR at sr_nat_update_tcp_connection: Should never be here 1\n");
+			pthread_mutex_unlock(&(nat->lock));
 			return;
 		}
 	} 
 
 	/* Get pointer to actual mapping*/
-	struct sr_nat_mapping *prevMapping = NULL;
-	struct sr_nat_mapping *actual = nat->mappings;
-	while (actual != NULL) {
-		if (actual->ip_int == mapping->ip_int && actual->aux_int ==  mapping->aux_int && actual->type == mapping->type) {
-			mapping = actual;
-			break;						
-		}
-		prevMapping = actual;
-		actual = actual->next;
-	}
+	struct sr_nat_mapping *actual = sr_nat_find_internal(nat, mapping->ip_int, mapping->aux_int, mapping->type);
 	
 	/* Should never print this */
 	if (actual == NULL) {
 		printf("COULD NOT FIND MAPPING\n");
+		pthread_mutex_unlock(&(nat->lock));
 		return;
 	}
+	mapping = actual;
 
 	/* Get matching connection. Create new one if it does not exist*/
-	struct sr_nat_connection *conn = mapping->conns;
-	struct sr_nat_connection *prev = NULL;
-	while (conn != NULL) {	
-		if (conn->ext_ip == ip && conn->ext_port == port) {
-			break;
-		}
-		prev = conn;
-		conn = conn->next;
-	}
+	struct sr_nat_connection *conn = sr_nat_find_connection(nat, mapping, ip, port);
 
 	if (conn == NULL) {
 		conn = (struct sr_nat_connection *) malloc(sizeof(struct sr_nat_connection));
@@ -441,12 +681,13 @@ void sr_nat_update_tcp_connection(struct sr_instance *sr, uint8_t *packet, struc
 		conn->int_fack = 0;	
 		conn->int_fin_seqnum = 0;
 		conn->ext_fin_seqnum = 0;
-		conn->next = mapping->conns;
-		mapping->conns = conn;
+		sr_timer_init(&(conn->timer), sr_nat_conn_timer, conn);
+		sr_nat_link_connection(nat, mapping, conn);
 	}
 
 	/* At this point, connection struct exists. Start TCP syncing flags */
 	conn->update_time = time(NULL);
+	int wasClosing = conn->int_fin || conn->ext_fin;
 
 	switch (direction) {
 		case dir_incoming: {
@@ -471,41 +712,47 @@ void sr_nat_update_tcp_connection(struct sr_instance *sr, uint8_t *packet, struc
 	
 		} default: {
 			printf("ERROR at sr_nat_update_tcp_connection: Should never be here 2\n");
+			pthread_mutex_unlock(&(nat->lock));
 			return;
 		}
 	} 
 
+	/* A FIN moves it to the shorter timeout, otherwise the timer finds
+	   update_time moved on when it runs */
+	sr_timer_set_earlier(&(nat->timers), &(conn->timer), (uint64_t) sr_nat_conn_timeout(nat, conn) * 1000);
+
+	/* Closing connections need every ACK seen here. Keep them out of the
+	   flow cache, and drop what was learned before the first FIN */
+	if (conn->int_fin || conn->ext_fin) {
+		sr_flow_done(sr);
+		if (!wasClosing) {
+			sr_flow_invalidate(sr);
+		}
+	}
+
 	/* Check if connection needs to be closed */
 	if ((tcpPacket->flags & TCP_RST) || (conn->int_fack && conn->ext_fack)) {
 		/* Remove this connection from mapping */
-		if (prev == NULL) {
-			mapping->conns = conn->next;
-		} else {
-			prev->next = conn->next;
-		}
-		free(conn);
+		sr_nat_remove_connection(nat, conn);
 
 		/* Cleanup mapping if no more connections*/	
 		if (mapping->conns == NULL) {
-			if (prevMapping == NULL) {
-				nat->mappings = mapping->next;
-			} else {
-				prevMapping->next = mapping->next;
-			}
-			free(mapping);
+			sr_nat_remove_mapping(nat, mapping);
 		}
 	}	
 
 	pthread_mutex_unlock(&(nat->lock));
 }
 
-struct sr_nat_mapping *sr_nat_get_mapping_from_packet(struct sr_instance* sr, uint8_t *packet, unsigned int len, char* interface, pkt_dir direction) {
+int sr_nat_get_mapping_from_packet(struct sr_instance* sr, uint8_t *packet, unsigned int len, struct sr_if *iface, pkt_dir direction, struct sr_nat_mapping *mapping) {
 	
 	struct sr_ip_hdr *ipPacket= (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 
-	struct sr_nat_mapping *mapping = NULL;
+	int found = 0;
 	uint16_t port = 0;
 	sr_nat_mapping_type mappingType = 0;		
+	struct sr_nat *nat;
+	unsigned int shard;
 
 	/* Get the type and port from the packet */
 	switch(ipPacket->ip_p) {
@@ -530,9 +777,10 @@ struct sr_nat_mapping *sr_nat_get_mapping_from_packet(struct sr_instance* sr, ui
 	/* Get mapping based on direction */
 	switch (direction) {
 		case dir_incoming: {
-			mapping = sr_nat_lookup_external(sr->nat, port, mappingType);
+			nat = &(sr->nat[sr_nat_shard_ext(sr, port)]);
+			found = sr_nat_lookup_external_r(nat, port, mappingType, mapping);
 			
-			if (mapping == NULL) {
+			if (!found) {
 				/* Do nothing for ICMP */
 
 				if (mappingType == nat_mapping_tcp) {
@@ -540,10 +788,10 @@ struct sr_nat_mapping *sr_nat_get_mapping_from_packet(struct sr_instance* sr, ui
 					
 					/* Queue unsolicited incoming SYN TCP packets */
 					if (tcp->flags & TCP_SYN) {
-						pthread_mutex_lock(&(sr->nat->lock));
+						pthread_mutex_lock(&(nat->lock));
 
 						/* Check if this TCP packet is already waiting */	
-						struct sr_tcp_syn *incoming = sr->nat->incoming;					
+						struct sr_tcp_syn *incoming = nat->incoming;					
 						while (incoming != NULL) {
 							if ((incoming->ip_src == ipPacket->ip_src) && (incoming->port_src == tcp->src_port)) {
 								break;
@@ -559,62 +807,72 @@ struct sr_nat_mapping *sr_nat_get_mapping_from_packet(struct sr_instance* sr, ui
 							newTcp->arrived = time(NULL);
 
 							newTcp->len = len;
-							newTcp->interface = interface;
+							newTcp->ifindex = iface->index;
 							newTcp->data = (uint8_t *) malloc(len);
 							memcpy(newTcp->data, packet, len);
+							sr_timer_init(&(newTcp->timer), sr_nat_syn_timer, newTcp);
+							sr_timer_set(&(nat->timers), &(newTcp->timer), 6000);
 
 							/* Put new packet at front of list */
-							newTcp->next = sr->nat->incoming;
-							sr->nat->incoming = newTcp;
+							newTcp->next = nat->incoming;
+							nat->incoming = newTcp;
 						}	
 
-						pthread_mutex_unlock(&(sr->nat->lock));
+						pthread_mutex_unlock(&(nat->lock));
 					}
 				}
 			}
 			break;
 
 		} case dir_outgoing: {
-			mapping = sr_nat_lookup_internal(sr->nat, ipPacket->ip_src, port, mappingType);
+			nat = &(sr->nat[sr_nat_shard_int(sr, ipPacket->ip_src, port)]);
+			found = sr_nat_lookup_internal_r(nat, ipPacket->ip_src, port, mappingType, mapping);
 
-			if (mapping == NULL) {				
+			if (!found) {				
 
 				/* Additional TCP processing */
 				if (mappingType == nat_mapping_tcp) {
 					sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *) (packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 			
 					if (tcp->flags & TCP_SYN) {
-						pthread_mutex_lock(&(sr->nat->lock));
-
-						struct sr_tcp_syn *incoming = sr->nat->incoming;
-						struct sr_tcp_syn *prev = NULL;
-
-						/* Check if this TCP packet is already waiting */						
-						while (incoming != NULL) {
-							if ((incoming->ip_src == ipPacket->ip_dst) && (incoming->port_src == tcp->dest_port)) {
-
-								/* Silently drop matching incoming SYN packet */
-								if (prev != NULL) {
-									prev->next = incoming->next;
-								} else {
-									sr->nat->incoming = incoming->next;
-								}	
-								break;								
+						/* The waiting SYN is queued by the shard of the port it was sent to */
+						for (shard = 0; shard < sr->natShards; shard++) {
+							struct sr_nat *synNat = &(sr->nat[shard]);
+							pthread_mutex_lock(&(synNat->lock));
+
+							struct sr_tcp_syn *incoming = synNat->incoming;
+							struct sr_tcp_syn *prev = NULL;
+
+							/* Check if this TCP packet is already waiting */						
+							while (incoming != NULL) {
+								if ((incoming->ip_src == ipPacket->ip_dst) && (incoming->port_src == tcp->dest_port)) {
+
+									/* Silently drop matching incoming SYN packet */
+									if (prev != NULL) {
+										prev->next = incoming->next;
+									} else {
+										synNat->incoming = incoming->next;
+									}	
+									sr_timer_cancel(&(synNat->timers), &(incoming->timer));
+									free(incoming->data);
+									free(incoming);
+									break;								
+								}
+
+								prev = incoming;
+								incoming = incoming->next;
 							}
 
-							prev = incoming;
-							incoming = incoming->next;
+							pthread_mutex_unlock(&(synNat->lock));
 						}
-
-						pthread_mutex_unlock(&(sr->nat->lock));
 					} else {
 						/* No existing mapping for non-SYN TCP packet. Drop it */
-						return NULL;
+						return 0;
 					}
 				}
 
 				/* Create new mapping for this IP/Port entry */
-				mapping = sr_nat_insert_mapping(sr->nat, ipPacket->ip_src, port, mappingType);
+				found = sr_nat_insert_mapping_r(nat, ipPacket->ip_src, port, mappingType, mapping);
 			}
 			break;
 
@@ -624,15 +882,15 @@ struct sr_nat_mapping *sr_nat_get_mapping_from_packet(struct sr_instance* sr, ui
 		}
 	}
 
-	return mapping;
+	return found;
 }
 
 pkt_dir getPacketDirection(struct sr_instance* sr, struct sr_ip_hdr *ipPacket) {
 	int internalSrc = is_ip_within_nat(sr, ipPacket->ip_src);
 	int internalDest = is_ip_within_nat(sr, ipPacket->ip_dst);
 
-	struct sr_if* if_eth2 = sr_get_interface(sr, "eth2");	
-	int destIsNat = ipPacket->ip_dst == if_eth2->ip;	
+	struct sr_if* externalIf = sr_get_interface_by_index(sr, sr->nat->extIfindex);	
+	int destIsNat = ipPacket->ip_dst == externalIf->ip;	
 
 	/* INCOMING: src is outside NAT. Dest is eth2*/
 	if (!internalSrc && destIsNat) {
@@ -659,14 +917,14 @@ pkt_dir getPacketDirection(struct sr_instance* sr, struct sr_ip_hdr *ipPacket) {
 }
 
 int is_ip_within_nat(struct sr_instance *sr, uint32_t ip) {
-	struct sr_rt *closest = findLongestMatchPrefix(sr->routing_table, ip);
+	struct sr_rt *closest = sr_fib_lookup(sr, ip);
 	if (closest == NULL) {
 		/* Net unreachable. Do nothing to this packet */
 		return -1;
 
 	} else {		
-		/* Check if this IP uses eth1 */
-		if (strncmp(closest->interface, "eth1", 4) == 0) {
+		/* Check if this IP uses the internal interface */
+		if (closest->ifindex == (int) sr->nat->intIfindex) {
 			return 1;
 		}
 	}
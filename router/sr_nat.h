@@ -8,12 +8,22 @@
 
 #include "sr_router.h"
 #include "sr_protocol.h"
+#include "sr_timer.h"
 
 #define TCP_FIN 0x01
 #define TCP_SYN 0x02
 #define TCP_RST 0x04
 #define TCP_ACK 0x10
 
+/* External ports/ICMP ids handed out to mappings: [MIN, MAX) */
+#define SR_NAT_PORT_MIN 1024
+#define SR_NAT_PORT_MAX 65535
+#define SR_NAT_PORT_COUNT (SR_NAT_PORT_MAX - SR_NAT_PORT_MIN)
+
+/* Smallest index size, in bits. Indexes get at least one bucket for every
+   mapping the shard's ports allow, so chains stay short when it is full */
+#define SR_NAT_HASH_MIN_BITS 8
+
 typedef enum {
   	dir_incoming,
 	dir_outgoing,
@@ -27,6 +37,11 @@ typedef enum {
   /* nat_mapping_udp, */
 } sr_nat_mapping_type;
 
+#define SR_NAT_MAPPING_TYPES 2
+
+#define SR_NAT_INT_IFACE "eth1"
+#define SR_NAT_EXT_IFACE "eth2"
+
 struct sr_nat_connection {
 	uint8_t int_syn;	
 	uint8_t ext_syn;
@@ -44,8 +59,12 @@ struct sr_nat_connection {
 	uint16_t ext_port;	
 
 	time_t update_time;
+	struct sr_timer timer;	/* times it out, re-armed if it was updated since */
 	
+	struct sr_nat_mapping *mapping;		/* mapping owning this connection */
 	struct sr_nat_connection *next;
+	struct sr_nat_connection *prev;
+	struct sr_nat_connection *hash_next;	/* chain in the 5-tuple connection index */
 };
 
 struct sr_tcp_syn {
@@ -55,7 +74,8 @@ struct sr_tcp_syn {
 
 	uint8_t *data;
 	unsigned int len;
-	char *interface;
+	unsigned int ifindex;	/* interface it arrived on */
+	struct sr_timer timer;	/* answers it with port unreachable */
 
 	struct sr_tcp_syn *next;
 };
@@ -68,7 +88,20 @@ struct sr_nat_mapping {
   uint16_t aux_ext; /* external port or icmp id */
   time_t last_updated; /* use to timeout mappings */
   struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  struct sr_timer timer; /* ICMP only, a TCP mapping goes with its last connection */
   struct sr_nat_mapping *next;
+  struct sr_nat_mapping *prev;
+  struct sr_nat_mapping *ext_next; /* chain in the (aux_ext, type) index */
+  struct sr_nat_mapping *int_next; /* chain in the (ip_int, aux_int, type) index */
+};
+
+/* Free external ports for one mapping type. Ports are handed out in the order
+   they were freed, so a port is reused as late as possible */
+struct sr_nat_port_pool {
+	uint16_t freePorts[SR_NAT_PORT_COUNT];	/* FIFO ring of free ports */
+	unsigned int head;						/* next port to hand out */
+	unsigned int numFree;
+	unsigned long exhausted;				/* allocations that failed, every port in use */
 };
 
 struct sr_nat {
@@ -76,23 +109,30 @@ struct sr_nat {
 	int icmpTimeout;
 	int tcpEstTimeout;
 	int tcpTransTimeout;
-	int nextPort;
+	struct sr_nat_port_pool ports[SR_NAT_MAPPING_TYPES];	/* one pool per sr_nat_mapping_type */
 
 	struct sr_nat_mapping *mappings;
+	unsigned int hashBits;		/* each index has 1 << hashBits buckets */
+	struct sr_nat_mapping **extIndex;	/* keyed on (aux_ext, type) */
+	struct sr_nat_mapping **intIndex;	/* keyed on (ip_int, aux_int, type) */
+	struct sr_nat_connection **connIndex;	/* keyed on (ip_int, aux_int, ext_ip, ext_port) */
 	struct sr_tcp_syn *incoming;	
 	struct sr_instance *sr;
+	unsigned int intIfindex;	/* SR_NAT_INT_IFACE, set by sr_nat_set_interfaces */
+	unsigned int extIfindex;	/* SR_NAT_EXT_IFACE */
 
   /* threading */
   pthread_mutex_t lock;
   pthread_mutexattr_t attr;
-  pthread_attr_t thread_attr;
-  pthread_t thread;
+  struct sr_timer_wheel timers;	/* mapping, connection and SYN timeouts, under lock */
 };
 
 
 int   sr_nat_init(struct sr_nat *nat);     /* Initializes the nat */
+int   sr_nat_set_interfaces(struct sr_nat *nat);	/* Looks up the internal/external interfaces once nat->sr is set */
+int   sr_nat_set_shard(struct sr_nat *nat, unsigned int shard, unsigned int numShards);	/* Hands out only ports equal to shard mod numShards */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
-void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
+void  sr_nat_start_timers(struct sr_nat *nat);	/* Has the timer thread run the timeouts, once nat->sr is set */
 
 /* Get the mapping associated with given external port.
    You must free the returned structure if it is not NULL. */
@@ -105,19 +145,38 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
 /* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+   You must free the returned structure if it is not NULL.
+   Returns NULL if no external port is free. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
+/* Allocation-free versions of the calls above. The mapping is copied into
+   the caller's result struct, which can live on the stack. The lookups
+   return 1 if a mapping was found, 0 otherwise. Insert returns 1 on success
+   and 0 if no external port is free. */
+int sr_nat_lookup_external_r(struct sr_nat *nat,
+  uint16_t aux_ext, sr_nat_mapping_type type, struct sr_nat_mapping *result);
+int sr_nat_lookup_internal_r(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *result);
+int sr_nat_insert_mapping_r(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *result);
+
+/* sr->nat is an array of sr->natShards NATs, one per worker (sr_worker.h).
+   A mapping lives in the shard its external port belongs to, which is
+   also the shard for its internal (ip, port) pair */
+unsigned int sr_nat_shard_ext(struct sr_instance *sr, uint16_t aux_ext);
+unsigned int sr_nat_shard_int(struct sr_instance *sr, uint32_t ip_int, uint16_t aux_int);
+
 /*	Translate the packet's dest/src IP based on whether it is
 		incoming or outcoming	*/
 int sr_nat_translate_packet(struct sr_instance* sr,
-	uint8_t * packet, unsigned int len, char* interface);
+	uint8_t * packet, unsigned int len, struct sr_if *iface);
 
-/* Given a packet, return the NAT mapping if it exists
+/* Given a packet, copy its NAT mapping into mapping. Returns 1 if it exists
  */
-struct sr_nat_mapping *sr_nat_get_mapping_from_packet(struct sr_instance* sr, 
-	uint8_t *packet, unsigned int len, char* interface, pkt_dir direction);
+int sr_nat_get_mapping_from_packet(struct sr_instance* sr, 
+	uint8_t *packet, unsigned int len, struct sr_if *iface, pkt_dir direction,
+	struct sr_nat_mapping *mapping);
 
 void sr_nat_update_tcp_connection(struct sr_instance *sr, uint8_t *packet, struct sr_nat_mapping *mapping, pkt_dir direction);
 
@@ -0,0 +1,543 @@
+/**********************************************************************
+ * file: sr_packet.c
+ *
+ * Description:
+ *
+ * Packet I/O driver for Linux interfaces (veth pairs in network
+ * namespaces, real NICs), see sr_io.h. Each interface gets an AF_PACKET
+ * socket with a TPACKET_V3 receive ring and transmit ring mmap'd into the
+ * router. The kernel fills the receive ring a block of packets at a time
+ * and frames are handed to the router where they lie. Sent frames are
+ * copied into the transmit ring and the kernel is told once per batch.
+ * Each transmit ring has its own lock, so threads sending out of
+ * different interfaces do not wait on each other.
+ *
+ * The interfaces are given on the command line:
+ *
+ *   -d packet:veth0=10.0.1.1,veth1=10.0.2.1
+ *
+ * An interface given without an address uses the one Linux has on it.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_io.h"
+#include "sr_protocol.h"
+#include "sr_cksum.h"
+#include "sr_worker.h"
+
+#ifdef _LINUX_
+
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#define SR_PACKET_BLOCK_SIZE (1 << 16)	/* power of 2 multiple of the page size */
+#define SR_PACKET_RX_BLOCKS 64
+#define SR_PACKET_RETIRE_MS 1			/* hand over a block that is not full after this */
+#define SR_PACKET_FRAME_SIZE 2048
+#define SR_PACKET_TX_FRAMES 512
+#define SR_PACKET_TX_BATCH 64			/* tell the kernel at least this often */
+#define SR_PACKET_ERR_RETRY_MS 100		/* a port in error is left out of poll() this long */
+#define SR_PACKET_HDR_LEN TPACKET_ALIGN(sizeof(struct tpacket3_hdr))	/* then sockaddr_ll on rx, the frame on tx */
+
+struct sr_packet_port {
+	char name[IFNAMSIZ];
+	unsigned char addr[ETHER_ADDR_LEN];
+	uint32_t ip;
+	struct sr_if *iface;
+	int fd;
+	uint8_t *map;
+	size_t mapLen;
+	uint8_t *rxRing;
+	unsigned int rxBlock;		/* next block the kernel hands back */
+	pthread_mutex_t txLock;		/* the transmit ring and the tx fields */
+	uint8_t *txRing;
+	unsigned int txFrame;		/* next frame to fill */
+	unsigned int txPending;		/* frames filled since the last send() */
+	unsigned long rxTruncated;	/* GSO frames bigger than a block */
+	unsigned long txDrops;
+	int errored;				/* POLLERR reported, not since polled without one */
+};
+
+struct sr_packet_io {
+	pthread_t owner;			/* thread calling rx_batch, it and the workers send at the end of a batch */
+	unsigned int numPorts;
+	unsigned int numErrored;
+	struct sr_packet_port ports[sr_IFACE_MAX];
+	struct sr_packet_port *byIndex[sr_IFACE_MAX];	/* by sr_if->index */
+	struct pollfd fds[sr_IFACE_MAX];
+};
+
+static int sr_packet_open_port(struct sr_packet_port *port) {
+	struct ifreq ifr;
+	struct tpacket_req3 req;
+	struct sockaddr_ll addr;
+	int version = TPACKET_V3;
+	int one = 1;
+
+	port->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (port->fd < 0) {
+		perror("socket(AF_PACKET)");
+		return -1;
+	}
+
+	/* Discover the interface */
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, port->name, IFNAMSIZ - 1);
+	if (ioctl(port->fd, SIOCGIFINDEX, &ifr) != 0) {
+		fprintf(stderr, "packet: no interface %s\n", port->name);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifr.ifr_ifindex;
+
+	if (ioctl(port->fd, SIOCGIFHWADDR, &ifr) != 0 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		fprintf(stderr, "packet: %s is not an Ethernet interface\n", port->name);
+		return -1;
+	}
+	memcpy(port->addr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+
+	if (port->ip == 0) {
+		if (ioctl(port->fd, SIOCGIFADDR, &ifr) != 0) {
+			fprintf(stderr, "packet: %s has no address, give one as %s=a.b.c.d\n",
+				port->name, port->name);
+			return -1;
+		}
+		port->ip = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr.s_addr;
+	}
+
+	/* Rings */
+	if (setsockopt(port->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+		perror("setsockopt(PACKET_VERSION)");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = SR_PACKET_BLOCK_SIZE;
+	req.tp_block_nr = SR_PACKET_RX_BLOCKS;
+	req.tp_frame_size = SR_PACKET_FRAME_SIZE;
+	req.tp_frame_nr = SR_PACKET_RX_BLOCKS * (SR_PACKET_BLOCK_SIZE / SR_PACKET_FRAME_SIZE);
+	req.tp_retire_blk_tov = SR_PACKET_RETIRE_MS;
+	if (setsockopt(port->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+		perror("setsockopt(PACKET_RX_RING)");
+		return -1;
+	}
+
+	/* Transmit rings are frame based even with TPACKET_V3 */
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = SR_PACKET_BLOCK_SIZE;
+	req.tp_block_nr = SR_PACKET_TX_FRAMES / (SR_PACKET_BLOCK_SIZE / SR_PACKET_FRAME_SIZE);
+	req.tp_frame_size = SR_PACKET_FRAME_SIZE;
+	req.tp_frame_nr = SR_PACKET_TX_FRAMES;
+	if (setsockopt(port->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) {
+		perror("setsockopt(PACKET_TX_RING), needs Linux 4.11");
+		return -1;
+	}
+
+	/* Optional: skip the qdisc, and do not see our own frames come back */
+	setsockopt(port->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+#ifdef PACKET_IGNORE_OUTGOING
+	setsockopt(port->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+	/* The receive ring comes first in the mapping, then the transmit ring */
+	port->mapLen = (size_t) SR_PACKET_BLOCK_SIZE * SR_PACKET_RX_BLOCKS +
+		(size_t) SR_PACKET_FRAME_SIZE * SR_PACKET_TX_FRAMES;
+	port->map = (uint8_t *) mmap(NULL, port->mapLen, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_LOCKED, port->fd, 0);
+	if (port->map == MAP_FAILED) {
+		/* MAP_LOCKED needs RLIMIT_MEMLOCK room, it only saves page faults */
+		port->map = (uint8_t *) mmap(NULL, port->mapLen, PROT_READ | PROT_WRITE,
+			MAP_SHARED, port->fd, 0);
+	}
+	if (port->map == MAP_FAILED) {
+		perror("mmap");
+		port->map = NULL;
+		return -1;
+	}
+	port->rxRing = port->map;
+	port->txRing = port->map + (size_t) SR_PACKET_BLOCK_SIZE * SR_PACKET_RX_BLOCKS;
+
+	/* Only now, so nothing lands in the ring before it is set up */
+	if (bind(port->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		perror("bind(AF_PACKET)");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* arg is name[=ip],name[=ip],... */
+static int sr_packet_open(struct sr_instance *sr, const char *arg) {
+	char list[512];
+	char *item, *save, *ip;
+
+	if (arg == NULL || strlen(arg) >= sizeof(list)) {
+		fprintf(stderr, "packet driver needs a list of interfaces, e.g. packet:veth0,veth1\n");
+		return -1;
+	}
+
+	struct sr_packet_io *io = (struct sr_packet_io *) calloc(1, sizeof(struct sr_packet_io));
+	if (io == NULL) {
+		return -1;
+	}
+	io->owner = pthread_self();
+	sr->packet = io;
+
+	strcpy(list, arg);
+	for (item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (io->numPorts == sr_IFACE_MAX) {
+			fprintf(stderr, "packet: at most %d interfaces\n", sr_IFACE_MAX);
+			return -1;
+		}
+
+		struct sr_packet_port *port = &(io->ports[io->numPorts++]);
+		port->fd = -1;
+		pthread_mutex_init(&(port->txLock), NULL);
+		if ((ip = strchr(item, '=')) != NULL) {
+			*ip++ = '\0';
+			if (inet_pton(AF_INET, ip, &(port->ip)) != 1) {
+				fprintf(stderr, "packet: bad address %s\n", ip);
+				return -1;
+			}
+		}
+		if (strlen(item) == 0 || strlen(item) >= IFNAMSIZ) {
+			fprintf(stderr, "packet: bad interface name %s\n", item);
+			return -1;
+		}
+		strcpy(port->name, item);
+
+		if (sr_packet_open_port(port) != 0) {
+			return -1;
+		}
+		io->fds[io->numPorts - 1].fd = port->fd;
+		io->fds[io->numPorts - 1].events = POLLIN;
+	}
+
+	return 0;
+}
+
+static int sr_packet_discover(struct sr_instance *sr) {
+	struct sr_packet_io *io = sr->packet;
+	unsigned int i;
+
+	for (i = 0; i < io->numPorts; i++) {
+		struct sr_packet_port *port = &(io->ports[i]);
+		if (sr_add_interface(sr, port->name) != 0) {
+			return -1;
+		}
+		sr_set_ether_addr(sr, port->addr);
+		sr_set_ether_ip(sr, port->ip);
+		port->iface = sr->if_table[sr->if_count - 1];
+		io->byIndex[port->iface->index] = port;
+	}
+
+	printf("Router interfaces:\n");
+	sr_print_if_list(sr);
+
+	if (sr_verify_routing_table(sr) != 0) {
+		fprintf(stderr, "Routing table not consistent with hardware\n");
+		return -1;
+	}
+	printf(" <-- Ready to process packets --> \n");
+	return 0;
+}
+
+/* A veth peer (or any sender on this host) leaves the TCP/UDP checksum to
+   be filled in by hardware, and we are the hardware */
+static void sr_packet_fill_cksum(uint8_t *frame, unsigned int len) {
+	sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *) frame;
+	sr_ip_hdr_t *ip = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+	unsigned int ipLen, l4Len, field;
+	uint32_t sum;
+
+	if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) || eth->ether_type != htons(ethertype_ip)) {
+		return;
+	}
+	if (ip->ip_p == ip_protocol_tcp) {
+		field = 16;
+	} else if (ip->ip_p == ip_protocol_udp) {
+		field = 6;
+	} else {
+		return;
+	}
+	ipLen = ntohs(ip->ip_len);
+	if (ip->ip_hl < 5 || ipLen > len - sizeof(sr_ethernet_hdr_t) || ipLen < ip->ip_hl * 4 + field + 2) {
+		return;
+	}
+
+	uint8_t *l4 = (uint8_t *) ip + ip->ip_hl * 4;
+	l4Len = ipLen - ip->ip_hl * 4;
+	memset(l4 + field, 0, 2);
+
+	/* Pseudo header, then the segment */
+	sum = (ntohl(ip->ip_src) >> 16) + (ntohl(ip->ip_src) & 0xffff) +
+		(ntohl(ip->ip_dst) >> 16) + (ntohl(ip->ip_dst) & 0xffff) + ip->ip_p + l4Len;
+	sum += cksum_sum(l4, l4Len);
+	while (sum >> 16) {
+		sum = (sum >> 16) + (sum & 0xffff);
+	}
+	sum = ~sum & 0xffff;
+	if (sum == 0 && ip->ip_p == ip_protocol_udp) {
+		sum = 0xffff;
+	}
+	sum = htons(sum);
+	memcpy(l4 + field, &sum, 2);
+}
+
+/* Hands every block the kernel has filled to the router. Returns the
+   number of blocks */
+static int sr_packet_rx_port(struct sr_instance *sr, struct sr_packet_port *port) {
+	int blocks;
+
+	for (blocks = 0; blocks < SR_PACKET_RX_BLOCKS; blocks++) {
+		struct tpacket_block_desc *block = (struct tpacket_block_desc *)
+			(port->rxRing + (size_t) port->rxBlock * SR_PACKET_BLOCK_SIZE);
+
+		/* Acquire pairs with the kernel handing the block over */
+		if (!(__atomic_load_n(&(block->hdr.bh1.block_status), __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			break;
+		}
+
+		struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)
+			((uint8_t *) block + block->hdr.bh1.offset_to_first_pkt);
+		uint32_t i;
+		for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+			struct sockaddr_ll *ll = (struct sockaddr_ll *) ((uint8_t *) hdr + SR_PACKET_HDR_LEN);
+
+			uint8_t *frame = (uint8_t *) hdr + hdr->tp_mac;
+
+			if (ll->sll_pkttype == PACKET_OUTGOING) {
+				/* Older kernels show us our own frames */
+			} else if (hdr->tp_snaplen != hdr->tp_len) {
+				port->rxTruncated++;
+			} else {
+				if (hdr->tp_status & TP_STATUS_CSUMNOTREADY) {
+					sr_packet_fill_cksum(frame, hdr->tp_snaplen);
+				}
+				sr_io_deliver(sr, frame, hdr->tp_snaplen, port->iface);
+			}
+			hdr = (struct tpacket3_hdr *) ((uint8_t *) hdr + hdr->tp_next_offset);
+		}
+
+		/* The router is done with these frames, give the block back */
+		__atomic_store_n(&(block->hdr.bh1.block_status), TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		port->rxBlock = (port->rxBlock + 1) % SR_PACKET_RX_BLOCKS;
+	}
+
+	return blocks;
+}
+
+static int sr_packet_rx_batch(struct sr_instance *sr) {
+	struct sr_packet_io *io = sr->packet;
+	unsigned int i;
+	int blocks = 0;
+	int ready;
+	int err;
+	socklen_t errLen = sizeof(err);
+
+	for (i = 0; i < io->numPorts; i++) {
+		blocks += sr_packet_rx_port(sr, &(io->ports[i]));
+	}
+	if (blocks > 0) {
+		return 1;
+	}
+
+	/* Nothing waiting, sleep until a block is handed over on some interface.
+	   Ports in error are left out (a negative fd), so wake up to retry them */
+	ready = poll(io->fds, io->numPorts, io->numErrored > 0 ? SR_PACKET_ERR_RETRY_MS : -1);
+	if (ready < 0) {
+		if (errno == EINTR) {
+			return 1;
+		}
+		perror("poll");
+		return -1;
+	}
+
+	for (i = 0; i < io->numPorts; i++) {
+		struct sr_packet_port *port = &(io->ports[i]);
+
+		if (io->fds[i].revents & POLLNVAL) {
+			return -1;
+		}
+		if (io->fds[i].revents & POLLERR) {
+			/* e.g. the interface went down. An error that does not clear would
+			   make poll() return straight away, so report it once and back off */
+			getsockopt(port->fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+			if (!port->errored) {
+				fprintf(stderr, "packet: %s: %s, retrying every %d ms\n", port->name, strerror(err),
+					SR_PACKET_ERR_RETRY_MS);
+				port->errored = 1;
+				io->numErrored++;
+			}
+			io->fds[i].fd = -1;
+		} else if (port->errored && io->fds[i].fd >= 0) {
+			/* Polled again without an error, report the next one */
+			port->errored = 0;
+			io->numErrored--;
+		}
+	}
+
+	if (ready == 0) {
+		for (i = 0; i < io->numPorts; i++) {
+			if (io->ports[i].errored) {
+				io->fds[i].fd = io->ports[i].fd;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Caller holds port->txLock */
+static void sr_packet_kick(struct sr_packet_port *port) {
+	if (port->txPending == 0) {
+		return;
+	}
+	__atomic_store_n(&(port->txPending), 0, __ATOMIC_RELAXED);
+	if (send(port->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+		perror("send(AF_PACKET)");
+	}
+}
+
+static int sr_packet_send(struct sr_instance *sr, uint8_t *buf, unsigned int len, struct sr_if *iface) {
+	struct sr_packet_io *io = sr->packet;
+	struct sr_packet_port *port = io->byIndex[iface->index];
+	int ret = 0;
+
+	if (port == NULL || len > SR_PACKET_FRAME_SIZE - SR_PACKET_HDR_LEN) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&(port->txLock));
+
+	struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)
+		(port->txRing + (size_t) port->txFrame * SR_PACKET_FRAME_SIZE);
+	if (__atomic_load_n(&(hdr->tp_status), __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+		/* Ring full, push out what is there and drop this one */
+		port->txDrops++;
+		sr_packet_kick(port);
+		ret = -1;
+	} else {
+		hdr->tp_next_offset = 0;
+		hdr->tp_len = len;
+		hdr->tp_snaplen = len;
+		memcpy((uint8_t *) hdr + SR_PACKET_HDR_LEN, buf, len);
+
+		/* Release publishes the frame before the kernel can see the status */
+		__atomic_store_n(&(hdr->tp_status), TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+		port->txFrame = (port->txFrame + 1) % SR_PACKET_TX_FRAMES;
+		__atomic_store_n(&(port->txPending), port->txPending + 1, __ATOMIC_RELAXED);
+
+		/* The reading thread and the workers send at the end of their batch,
+		   anyone else (the timer thread) right away */
+		if (port->txPending >= SR_PACKET_TX_BATCH ||
+			(!pthread_equal(io->owner, pthread_self()) && sr_worker_current(sr) < 0)) {
+			sr_packet_kick(port);
+		}
+	}
+
+	pthread_mutex_unlock(&(port->txLock));
+	return ret;
+}
+
+static int sr_packet_tx_batch(struct sr_instance *sr) {
+	struct sr_packet_io *io = sr->packet;
+	unsigned int i;
+
+	/* Only ports with frames waiting. Frames this thread queued are seen,
+	   another thread's are kicked at the end of its own batch */
+	for (i = 0; i < io->numPorts; i++) {
+		struct sr_packet_port *port = &(io->ports[i]);
+		if (__atomic_load_n(&(port->txPending), __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		pthread_mutex_lock(&(port->txLock));
+		sr_packet_kick(port);
+		pthread_mutex_unlock(&(port->txLock));
+	}
+	return 0;
+}
+
+static void sr_packet_close(struct sr_instance *sr) {
+	struct sr_packet_io *io = sr->packet;
+	unsigned int i;
+
+	if (io == NULL) {
+		return;
+	}
+
+	for (i = 0; i < io->numPorts; i++) {
+		struct sr_packet_port *port = &(io->ports[i]);
+		if (port->rxTruncated > 0) {
+			printf("packet: %s dropped %lu frames too big for a block, turn off GSO/TSO on the peer\n",
+				port->name, port->rxTruncated);
+		}
+		if (port->txDrops > 0) {
+			printf("packet: %s dropped %lu frames on a full transmit ring\n", port->name, port->txDrops);
+		}
+		if (port->map != NULL) {
+			munmap(port->map, port->mapLen);
+		}
+		if (port->fd >= 0) {
+			close(port->fd);
+		}
+		pthread_mutex_destroy(&(port->txLock));
+	}
+
+	free(io);
+	sr->packet = NULL;
+}
+
+#else /* _LINUX_ */
+
+static int sr_packet_open(struct sr_instance *sr, const char *arg) {
+	fprintf(stderr, "packet driver needs Linux\n");
+	return -1;
+}
+
+static int sr_packet_discover(struct sr_instance *sr) {
+	return -1;
+}
+
+static int sr_packet_rx_batch(struct sr_instance *sr) {
+	return -1;
+}
+
+static int sr_packet_send(struct sr_instance *sr, uint8_t *buf, unsigned int len, struct sr_if *iface) {
+	return -1;
+}
+
+static int sr_packet_tx_batch(struct sr_instance *sr) {
+	return 0;
+}
+
+static void sr_packet_close(struct sr_instance *sr) {
+}
+
+#endif /* _LINUX_ */
+
+struct sr_io_driver sr_packet_driver = {
+	"packet",
+	sr_packet_open,
+	sr_packet_discover,
+	sr_packet_rx_batch,
+	sr_packet_send,
+	sr_packet_tx_batch,
+	sr_packet_close
+};
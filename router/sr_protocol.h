@@ -221,5 +221,6 @@ struct sr_arp_hdr
 typedef struct sr_arp_hdr sr_arp_hdr_t;
 
 #define sr_IFACE_NAMELEN 32
+#define sr_IFACE_MAX 16       /* interfaces per router, see sr_instance->if_table */
 
 #endif /* -- SR_PROTOCOL_H -- */
@@ -0,0 +1,639 @@
+/**********************************************************************
+ * file: sr_replay.c
+ *
+ * Description:
+ *
+ * Packet I/O driver that replays a pcap through the router, for capacity
+ * planning. See sr_io.h. No server or socket is involved: every frame of
+ * the capture is handed to sr_io_deliver() (and so sr_handlepacket()) as
+ * fast as possible, and what the router sends goes to a pcap or nowhere.
+ * The time each frame spends in the router is measured and a report of
+ * packets/sec and latency percentiles is printed at the end.
+ *
+ *   -d replay:capture.pcap,conf=replay.conf[,out=out.pcap][,loops=N]
+ *
+ * The capture is read into memory before the replay starts. Each frame is
+ * copied to a scratch buffer before it is handed on, so captures can be
+ * replayed any number of times (loops=N) without the router's rewrites
+ * adding up. The config gives the router its interfaces and maps frames
+ * to them:
+ *
+ *   iface eth1 00:00:00:00:00:01 10.0.1.1     interface, MAC, address
+ *   ingress aa:bb:cc:dd:ee:ff eth1            frames from this MAC
+ *   default eth1                              frames matching nothing else
+ *   arp 10.0.1.100 aa:bb:cc:dd:ee:ff eth1     neighbour, see below
+ *
+ * A frame enters on the interface of an ingress line for its source MAC,
+ * or else the interface whose MAC it is addressed to, or else the default
+ * interface. Frames sent by one of the router's MACs are skipped, and so
+ * are frames the capture cut short of their length: a log written with -l
+ * keeps only PACKET_DUMP_SIZE bytes of each, so larger frames in it are
+ * not replayed. For each arp line the router is given an ARP reply before
+ * the replay starts and once a second after, so forwarding does not wait
+ * on neighbours that are not in the capture.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_io.h"
+#include "sr_protocol.h"
+#include "sr_dumper.h"
+#include "sr_worker.h"
+
+#define SR_REPLAY_BATCH 64
+#define SR_REPLAY_MAX_RULES 256
+#define SR_REPLAY_ARP_INTERVAL 1		/* seconds between ARP replies for arp lines */
+#define SR_REPLAY_NSEC_MAGIC 0xa1b23c4d
+
+/* Latency histogram: exact below 16ns, then 16 buckets per power of 2
+   (within 6.25%) */
+#define SR_REPLAY_SUB_BITS 4
+#define SR_REPLAY_SUB (1 << SR_REPLAY_SUB_BITS)
+#define SR_REPLAY_BUCKETS (SR_REPLAY_SUB + (64 - SR_REPLAY_SUB_BITS) * SR_REPLAY_SUB)
+
+struct sr_replay_frame {
+	uint32_t offset;			/* into data */
+	uint32_t len;
+	int ifindex;				/* ingress, -1 to skip */
+};
+
+struct sr_replay_iface {
+	char name[sr_IFACE_NAMELEN];
+	unsigned char addr[ETHER_ADDR_LEN];
+	uint32_t ip;
+};
+
+struct sr_replay_rule {
+	unsigned char addr[ETHER_ADDR_LEN];
+	uint32_t ip;				/* arp lines only */
+	char name[sr_IFACE_NAMELEN];
+};
+
+struct sr_replay {
+	/* Capture */
+	uint8_t *data;
+	struct sr_replay_frame *frames;
+	unsigned int numFrames;
+	unsigned int next;
+	unsigned int loops;
+	unsigned int loop;
+	uint8_t *scratch;
+	uint32_t maxLen;
+
+	/* Config */
+	struct sr_replay_iface ifaces[sr_IFACE_MAX];
+	unsigned int numIfaces;
+	struct sr_replay_rule ingress[SR_REPLAY_MAX_RULES];
+	unsigned int numIngress;
+	struct sr_replay_rule arp[SR_REPLAY_MAX_RULES];
+	unsigned int numArp;
+	char defaultIf[sr_IFACE_NAMELEN];
+	time_t lastArp;
+
+	/* Output, also written by the timer thread */
+	pthread_mutex_t lock;
+	FILE *out;
+	unsigned long sent;
+	unsigned long sentBytes;
+
+	/* Report */
+	unsigned long delivered;
+	unsigned long skipped;		/* sent by the router when recorded */
+	unsigned long unmapped;
+	unsigned long truncated;	/* captured shorter than on the wire */
+	int workers;				/* replayed through -w workers */
+	struct timespec start;
+	uint64_t busyNs;			/* inside sr_io_deliver() */
+	uint64_t wallNs;			/* from the first frame to the last */
+	uint64_t minNs;
+	uint64_t maxNs;
+	unsigned long hist[SR_REPLAY_BUCKETS];
+};
+
+static uint64_t sr_replay_ns(const struct timespec *from, const struct timespec *to) {
+	return (uint64_t) (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+static unsigned int sr_replay_bucket(uint64_t ns) {
+	int bits = 63 - __builtin_clzll(ns | 1);
+	if (bits < SR_REPLAY_SUB_BITS) {
+		return (unsigned int) ns;
+	}
+	return SR_REPLAY_SUB + (bits - SR_REPLAY_SUB_BITS) * SR_REPLAY_SUB +
+		(unsigned int) ((ns >> (bits - SR_REPLAY_SUB_BITS)) & (SR_REPLAY_SUB - 1));
+}
+
+/* Upper end of a bucket, so percentiles are never understated */
+static uint64_t sr_replay_bucket_top(unsigned int bucket) {
+	if (bucket < SR_REPLAY_SUB) {
+		return bucket;
+	}
+	unsigned int shift = (bucket - SR_REPLAY_SUB) / SR_REPLAY_SUB;
+	uint64_t base = (uint64_t) (SR_REPLAY_SUB + bucket % SR_REPLAY_SUB) << shift;
+	return base + ((uint64_t) 1 << shift) - 1;
+}
+
+static uint64_t sr_replay_percentile(struct sr_replay *replay, double pct) {
+	unsigned long rank = (unsigned long) (replay->delivered * pct / 100.0);
+	unsigned long seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < SR_REPLAY_BUCKETS; i++) {
+		seen += replay->hist[i];
+		if (seen > rank) {
+			uint64_t top = sr_replay_bucket_top(i);
+			return top > replay->maxNs ? replay->maxNs : top;
+		}
+	}
+	return replay->maxNs;
+}
+
+static int sr_replay_parse_mac(const char *str, unsigned char *mac) {
+	unsigned int b[ETHER_ADDR_LEN];
+	int i;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETHER_ADDR_LEN) {
+		return -1;
+	}
+	for (i = 0; i < ETHER_ADDR_LEN; i++) {
+		if (b[i] > 0xff) {
+			return -1;
+		}
+		mac[i] = (unsigned char) b[i];
+	}
+	return 0;
+}
+
+static int sr_replay_load_conf(struct sr_replay *replay, const char *fileName) {
+	char line[256], word[16], a[64], b[64], c[64];
+	int lineNum = 0, n;
+
+	FILE *fp = fopen(fileName, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "replay: can't open config %s\n", fileName);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineNum++;
+		n = sscanf(line, "%15s %63s %63s %63s", word, a, b, c);
+		if (n <= 0 || word[0] == '#') {
+			continue;
+		}
+
+		if (strcmp(word, "iface") == 0 && n == 4 && replay->numIfaces < sr_IFACE_MAX) {
+			struct sr_replay_iface *iface = &(replay->ifaces[replay->numIfaces]);
+			strncpy(iface->name, a, sr_IFACE_NAMELEN - 1);
+			if (sr_replay_parse_mac(b, iface->addr) == 0 && inet_pton(AF_INET, c, &(iface->ip)) == 1) {
+				replay->numIfaces++;
+				continue;
+			}
+		} else if (strcmp(word, "ingress") == 0 && n == 3 && replay->numIngress < SR_REPLAY_MAX_RULES) {
+			struct sr_replay_rule *rule = &(replay->ingress[replay->numIngress]);
+			strncpy(rule->name, b, sr_IFACE_NAMELEN - 1);
+			if (sr_replay_parse_mac(a, rule->addr) == 0) {
+				replay->numIngress++;
+				continue;
+			}
+		} else if (strcmp(word, "arp") == 0 && n == 4 && replay->numArp < SR_REPLAY_MAX_RULES) {
+			struct sr_replay_rule *rule = &(replay->arp[replay->numArp]);
+			strncpy(rule->name, c, sr_IFACE_NAMELEN - 1);
+			if (inet_pton(AF_INET, a, &(rule->ip)) == 1 && sr_replay_parse_mac(b, rule->addr) == 0) {
+				replay->numArp++;
+				continue;
+			}
+		} else if (strcmp(word, "default") == 0 && n == 2) {
+			strncpy(replay->defaultIf, a, sr_IFACE_NAMELEN - 1);
+			continue;
+		}
+
+		fprintf(stderr, "replay: %s:%d: can't use \"%s\"\n", fileName, lineNum, strtok(line, "\n"));
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	if (replay->numIfaces == 0) {
+		fprintf(stderr, "replay: no iface lines in %s\n", fileName);
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t sr_replay_swap32(uint32_t v) {
+	return ((v & 0xff) << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+/* Reads the whole capture and indexes its frames */
+static int sr_replay_load_pcap(struct sr_replay *replay, const char *fileName) {
+	struct pcap_file_header fileHdr;
+	struct pcap_sf_pkthdr pktHdr;
+	unsigned int capacity = 0;
+	long size;
+	int swapped;
+
+	FILE *fp = fopen(fileName, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "replay: can't open %s\n", fileName);
+		return -1;
+	}
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < (long) sizeof(fileHdr) ||
+		fseek(fp, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "replay: %s is not a pcap file\n", fileName);
+		fclose(fp);
+		return -1;
+	}
+
+	replay->data = (uint8_t *) malloc(size);
+	if (replay->data == NULL || fread(replay->data, size, 1, fp) != 1) {
+		fprintf(stderr, "replay: can't read %s\n", fileName);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	/* Written by sr_dumper.c in host order, but take either */
+	memcpy(&fileHdr, replay->data, sizeof(fileHdr));
+	swapped = (fileHdr.magic == sr_replay_swap32(TCPDUMP_MAGIC) ||
+		fileHdr.magic == sr_replay_swap32(SR_REPLAY_NSEC_MAGIC));
+	if (swapped) {
+		fileHdr.magic = sr_replay_swap32(fileHdr.magic);
+		fileHdr.linktype = sr_replay_swap32(fileHdr.linktype);
+	}
+	if ((fileHdr.magic != TCPDUMP_MAGIC && fileHdr.magic != SR_REPLAY_NSEC_MAGIC) ||
+		fileHdr.linktype != LINKTYPE_ETHERNET) {
+		fprintf(stderr, "replay: %s is not an Ethernet pcap file\n", fileName);
+		return -1;
+	}
+
+	long offset = sizeof(fileHdr);
+	while (offset + (long) sizeof(pktHdr) <= size) {
+		memcpy(&pktHdr, replay->data + offset, sizeof(pktHdr));
+		if (swapped) {
+			pktHdr.caplen = sr_replay_swap32(pktHdr.caplen);
+			pktHdr.len = sr_replay_swap32(pktHdr.len);
+		}
+		offset += sizeof(pktHdr);
+		if (pktHdr.caplen > size - offset) {
+			fprintf(stderr, "replay: %s is truncated\n", fileName);
+			break;
+		}
+		if (pktHdr.caplen < pktHdr.len) {
+			replay->truncated++;
+			offset += pktHdr.caplen;
+			continue;
+		}
+
+		if (replay->numFrames == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			struct sr_replay_frame *frames = (struct sr_replay_frame *)
+				realloc(replay->frames, capacity * sizeof(struct sr_replay_frame));
+			if (frames == NULL) {
+				return -1;
+			}
+			replay->frames = frames;
+		}
+		replay->frames[replay->numFrames].offset = (uint32_t) offset;
+		replay->frames[replay->numFrames].len = pktHdr.caplen;
+		replay->frames[replay->numFrames].ifindex = -1;
+		replay->numFrames++;
+
+		if (pktHdr.caplen > replay->maxLen) {
+			replay->maxLen = pktHdr.caplen;
+		}
+		offset += pktHdr.caplen;
+	}
+
+	if (replay->truncated > 0) {
+		printf("replay: skipping %lu frames captured short of their length\n", replay->truncated);
+	}
+	if (replay->numFrames == 0) {
+		fprintf(stderr, "replay: no frames in %s\n", fileName);
+		return -1;
+	}
+
+	replay->scratch = (uint8_t *) malloc(replay->maxLen);
+	return replay->scratch ? 0 : -1;
+}
+
+/* arg is capture.pcap,conf=file[,out=file][,loops=N] */
+static int sr_replay_open(struct sr_instance *sr, const char *arg) {
+	char list[512];
+	char *item, *save;
+	char *pcap = NULL, *conf = NULL, *out = NULL;
+
+	if (arg == NULL || strlen(arg) >= sizeof(list)) {
+		fprintf(stderr, "replay driver needs replay:capture.pcap,conf=file[,out=file][,loops=N]\n");
+		return -1;
+	}
+
+	struct sr_replay *replay = (struct sr_replay *) calloc(1, sizeof(struct sr_replay));
+	if (replay == NULL) {
+		return -1;
+	}
+	pthread_mutex_init(&(replay->lock), NULL);
+	replay->loops = 1;
+	replay->minNs = (uint64_t) -1;
+	sr->replay = replay;
+
+	strcpy(list, arg);
+	for (item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (strncmp(item, "conf=", 5) == 0) {
+			conf = item + 5;
+		} else if (strncmp(item, "out=", 4) == 0) {
+			out = item + 4;
+		} else if (strncmp(item, "loops=", 6) == 0) {
+			replay->loops = atoi(item + 6);
+		} else if (pcap == NULL) {
+			pcap = item;
+		} else {
+			fprintf(stderr, "replay: unknown option %s\n", item);
+			return -1;
+		}
+	}
+
+	if (pcap == NULL || conf == NULL || replay->loops == 0) {
+		fprintf(stderr, "replay driver needs replay:capture.pcap,conf=file[,out=file][,loops=N]\n");
+		return -1;
+	}
+
+	if (sr_replay_load_conf(replay, conf) != 0 || sr_replay_load_pcap(replay, pcap) != 0) {
+		return -1;
+	}
+
+	/* No out= is a null sink */
+	if (out != NULL && (replay->out = sr_dump_open(out, 0, PACKET_DUMP_SIZE)) == NULL) {
+		return -1;
+	}
+
+	printf("Replaying %u frames from %s %u times\n", replay->numFrames, pcap, replay->loops);
+	return 0;
+}
+
+static int sr_replay_ifindex(struct sr_instance *sr, const char *name) {
+	struct sr_if *iface = sr_get_interface(sr, name);
+	return iface ? (int) iface->index : -1;
+}
+
+static int sr_replay_discover(struct sr_instance *sr) {
+	struct sr_replay *replay = sr->replay;
+	unsigned int i, j;
+	int defaultIndex = -1;
+
+	for (i = 0; i < replay->numIfaces; i++) {
+		if (sr_add_interface(sr, replay->ifaces[i].name) != 0) {
+			return -1;
+		}
+		sr_set_ether_addr(sr, replay->ifaces[i].addr);
+		sr_set_ether_ip(sr, replay->ifaces[i].ip);
+	}
+
+	printf("Router interfaces:\n");
+	sr_print_if_list(sr);
+
+	if (sr_verify_routing_table(sr) != 0) {
+		fprintf(stderr, "Routing table not consistent with hardware\n");
+		return -1;
+	}
+
+	if (replay->defaultIf[0] != '\0' && (defaultIndex = sr_replay_ifindex(sr, replay->defaultIf)) < 0) {
+		fprintf(stderr, "replay: no interface %s\n", replay->defaultIf);
+		return -1;
+	}
+	for (i = 0; i < replay->numIngress; i++) {
+		if (sr_replay_ifindex(sr, replay->ingress[i].name) < 0) {
+			fprintf(stderr, "replay: no interface %s\n", replay->ingress[i].name);
+			return -1;
+		}
+	}
+	for (i = 0; i < replay->numArp; i++) {
+		if (sr_replay_ifindex(sr, replay->arp[i].name) < 0) {
+			fprintf(stderr, "replay: no interface %s\n", replay->arp[i].name);
+			return -1;
+		}
+	}
+
+	/* Map every frame to its ingress now, so the replay only delivers */
+	for (i = 0; i < replay->numFrames; i++) {
+		struct sr_replay_frame *frame = &(replay->frames[i]);
+		sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *) (replay->data + frame->offset);
+
+		if (frame->len < sizeof(sr_ethernet_hdr_t)) {
+			replay->unmapped++;
+			continue;
+		}
+
+		for (j = 0; j < sr->if_count; j++) {
+			if (memcmp(eth->ether_shost, sr->if_table[j]->addr, ETHER_ADDR_LEN) == 0) {
+				break;
+			}
+		}
+		if (j < sr->if_count) {
+			replay->skipped++;
+			continue;
+		}
+
+		for (j = 0; j < replay->numIngress; j++) {
+			if (memcmp(eth->ether_shost, replay->ingress[j].addr, ETHER_ADDR_LEN) == 0) {
+				frame->ifindex = sr_replay_ifindex(sr, replay->ingress[j].name);
+				break;
+			}
+		}
+		for (j = 0; frame->ifindex < 0 && j < sr->if_count; j++) {
+			if (memcmp(eth->ether_dhost, sr->if_table[j]->addr, ETHER_ADDR_LEN) == 0) {
+				frame->ifindex = j;
+			}
+		}
+		if (frame->ifindex < 0) {
+			frame->ifindex = defaultIndex;
+		}
+		if (frame->ifindex < 0) {
+			replay->unmapped++;
+		}
+	}
+
+	if (replay->skipped > 0 || replay->unmapped > 0) {
+		printf("replay: skipping %lu frames sent by the router and %lu with no ingress\n",
+			replay->skipped, replay->unmapped);
+	}
+	return 0;
+}
+
+/* An ARP reply from each arp line's neighbour, through the normal path */
+static void sr_replay_arp(struct sr_instance *sr, struct sr_replay *replay) {
+	uint8_t buf[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+	sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *) buf;
+	sr_arp_hdr_t *arp = (sr_arp_hdr_t *) (buf + sizeof(sr_ethernet_hdr_t));
+	unsigned int i;
+
+	for (i = 0; i < replay->numArp; i++) {
+		struct sr_if *iface = sr_get_interface(sr, replay->arp[i].name);
+
+		memcpy(eth->ether_dhost, iface->addr, ETHER_ADDR_LEN);
+		memcpy(eth->ether_shost, replay->arp[i].addr, ETHER_ADDR_LEN);
+		eth->ether_type = htons(ethertype_arp);
+		arp->ar_hrd = htons(arp_hrd_ethernet);
+		arp->ar_pro = htons(ethertype_ip);
+		arp->ar_hln = ETHER_ADDR_LEN;
+		arp->ar_pln = 4;
+		arp->ar_op = htons(arp_op_reply);
+		memcpy(arp->ar_sha, replay->arp[i].addr, ETHER_ADDR_LEN);
+		arp->ar_sip = replay->arp[i].ip;
+		memcpy(arp->ar_tha, iface->addr, ETHER_ADDR_LEN);
+		arp->ar_tip = iface->ip;
+
+		sr_io_deliver(sr, buf, sizeof(buf), iface);
+	}
+	replay->lastArp = time(NULL);
+}
+
+static int sr_replay_rx_batch(struct sr_instance *sr) {
+	struct sr_replay *replay = sr->replay;
+	struct timespec before, after;
+	unsigned int i;
+
+	if (replay->next == replay->numFrames) {
+		if (++replay->loop == replay->loops) {
+			/* With workers the replay is done once they are */
+			if (sr->workers != NULL) {
+				sr_worker_drain(sr);
+				clock_gettime(CLOCK_MONOTONIC, &after);
+				replay->wallNs = sr_replay_ns(&(replay->start), &after);
+			}
+			return 0;
+		}
+		replay->next = 0;
+	}
+
+	if (replay->delivered == 0 && replay->next == 0 && replay->loop == 0) {
+		/* Neighbours are known before the first frame, on every worker */
+		sr_replay_arp(sr, replay);
+		sr_worker_drain(sr);
+		replay->workers = (sr->workers != NULL);
+		clock_gettime(CLOCK_MONOTONIC, &(replay->start));
+	} else if (replay->numArp > 0 && time(NULL) - replay->lastArp >= SR_REPLAY_ARP_INTERVAL) {
+		sr_replay_arp(sr, replay);
+	}
+
+	for (i = 0; i < SR_REPLAY_BATCH && replay->next < replay->numFrames; i++) {
+		struct sr_replay_frame *frame = &(replay->frames[replay->next++]);
+		if (frame->ifindex < 0) {
+			continue;
+		}
+
+		memcpy(replay->scratch, replay->data + frame->offset, frame->len);
+
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		sr_io_deliver(sr, replay->scratch, frame->len, sr->if_table[frame->ifindex]);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+
+		uint64_t ns = sr_replay_ns(&before, &after);
+		replay->hist[sr_replay_bucket(ns)]++;
+		replay->busyNs += ns;
+		if (ns < replay->minNs) {
+			replay->minNs = ns;
+		}
+		if (ns > replay->maxNs) {
+			replay->maxNs = ns;
+		}
+		replay->delivered++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	replay->wallNs = sr_replay_ns(&(replay->start), &after);
+	return 1;
+}
+
+static int sr_replay_send(struct sr_instance *sr, uint8_t *buf, unsigned int len, struct sr_if *iface) {
+	struct sr_replay *replay = sr->replay;
+	struct pcap_pkthdr hdr;
+
+	pthread_mutex_lock(&(replay->lock));
+	if (replay->out != NULL) {
+		gettimeofday(&(hdr.ts), NULL);
+		hdr.caplen = min(len, PACKET_DUMP_SIZE);
+		hdr.len = len;
+		sr_dump(replay->out, &hdr, buf);
+	}
+	replay->sent++;
+	replay->sentBytes += len;
+	pthread_mutex_unlock(&(replay->lock));
+	return 0;
+}
+
+static int sr_replay_tx_batch(struct sr_instance *sr) {
+	return 0;
+}
+
+static void sr_replay_report(struct sr_replay *replay) {
+	if (replay->delivered == 0) {
+		printf("replay: nothing delivered\n");
+		return;
+	}
+
+	/* With workers sr_io_deliver() only copies the frame into a ring, so
+	   the time spent in it says nothing about the router */
+	if (replay->workers) {
+		printf("replay: %lu packets in %.3f s, %.0f packets/sec\n",
+			replay->delivered, replay->wallNs / 1e9,
+			replay->wallNs ? replay->delivered * 1e9 / replay->wallNs : 0.0);
+		printf("replay: with -w the latency below is the hand-off to a worker, not the time in the router\n");
+	} else {
+		printf("replay: %lu packets in %.3f s, %.0f packets/sec (%.0f packets/sec inside the router)\n",
+			replay->delivered, replay->wallNs / 1e9,
+			replay->wallNs ? replay->delivered * 1e9 / replay->wallNs : 0.0,
+			replay->busyNs ? replay->delivered * 1e9 / replay->busyNs : 0.0);
+	}
+	printf("replay: latency ns min %llu mean %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+		(unsigned long long) replay->minNs,
+		(unsigned long long) (replay->busyNs / replay->delivered),
+		(unsigned long long) sr_replay_percentile(replay, 50),
+		(unsigned long long) sr_replay_percentile(replay, 90),
+		(unsigned long long) sr_replay_percentile(replay, 99),
+		(unsigned long long) sr_replay_percentile(replay, 99.9),
+		(unsigned long long) replay->maxNs);
+	printf("replay: router sent %lu packets (%lu bytes)\n", replay->sent, replay->sentBytes);
+}
+
+static void sr_replay_close(struct sr_instance *sr) {
+	struct sr_replay *replay = sr->replay;
+
+	if (replay == NULL) {
+		return;
+	}
+
+	/* Only once the replay has started */
+	if (replay->next > 0 || replay->loop > 0) {
+		sr_replay_report(replay);
+	}
+
+	/* The workers and the timer thread are stopped by now, nothing sends */
+	if (replay->out != NULL) {
+		sr_dump_close(replay->out);
+	}
+	pthread_mutex_destroy(&(replay->lock));
+
+	free(replay->data);
+	free(replay->frames);
+	free(replay->scratch);
+	free(replay);
+	sr->replay = NULL;
+}
+
+struct sr_io_driver sr_replay_driver = {
+	"replay",
+	sr_replay_open,
+	sr_replay_discover,
+	sr_replay_rx_batch,
+	sr_replay_send,
+	sr_replay_tx_batch,
+	sr_replay_close
+};
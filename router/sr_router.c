@@ -23,6 +23,9 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
+#include "sr_fib.h"
+#include "sr_flow.h"
+#include "sr_cksum.h"
 #include "icmp_handler.h"
 #include "arp_handler.h"
 
@@ -39,23 +42,29 @@ void sr_init(struct sr_instance* sr)
     /* REQUIRES */
     assert(sr);
 
-    /* Initialize cache and cache cleanup thread */
-    sr_arpcache_init(&(sr->cache));
+    /* Initialize cache and its timers */
+    if (sr_arpcache_init(&(sr->cache), sr->arpCacheSize) != 0) {
+        fprintf(stderr, "Error allocating ARP cache of %u entries\n",
+                sr->arpCacheSize);
+        exit(1);
+    }
+    sr_arpcache_start_timers(sr);
 
     pthread_attr_init(&(sr->attr));
     pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-    pthread_t thread;
-
-    pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
 
     /* Add initialization code here! */
+    if (sr_flow_init(sr) != 0) {
+        fprintf(stderr, "Could not allocate flow cache, forwarding without it\n");
+    }
+    printf("Checksums use the %s kernel\n", cksum_impl_name());
 
 } /* -- sr_init -- */
 
 /*---------------------------------------------------------------------
- * Method: sr_handlepacket(uint8_t* p,char* interface)
+ * Method: sr_handlepacket(uint8_t* p,struct sr_if* iface)
  * Scope:  Global
  *
  * This method is called each time the router receives a packet on the
@@ -63,8 +72,8 @@ void sr_init(struct sr_instance* sr)
  * interface are passed in as parameters. The packet is complete with
  * ethernet headers.
  *
- * Note: Both the packet buffer and the character's memory are handled
- * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
+ * Note: Both the packet buffer and the interface are owned by the I/O
+ * driver (sr_io.c) that means do NOT delete either.  Make a copy of the
  * packet instead if you intend to keep it around beyond the scope of
  * the method call.
  *
@@ -73,12 +82,12 @@ void sr_init(struct sr_instance* sr)
 void sr_handlepacket(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        struct sr_if* iface/* lent */)
 {
   /* REQUIRES */
   assert(sr);
   assert(packet);
-  assert(interface);
+  assert(iface);
 
   printf("*** -> Received packet of length %d \n",len);
 
@@ -86,7 +95,7 @@ void sr_handlepacket(struct sr_instance* sr,
 		struct sr_arp_hdr *arpHeader = (struct sr_arp_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 		if (is_broadcast_mac(packet) || we_are_dest(sr, arpHeader->ar_tip)) {
 			/* Process only broadcasted packets or packets meant for me */
-			processArp(sr, packet, len, interface);
+			processArp(sr, packet, len, iface);
 		}
 
 	} else if (ethertype(packet) == ethertype_ip) { 	/* IP packet */
@@ -97,9 +106,14 @@ void sr_handlepacket(struct sr_instance* sr,
 			return;
 		}
 
+		/* Packets of flows already seen are rewritten and sent from the flow cache */
+		if (sr_flow_forward(sr, packet, len, iface)) {
+			return;
+		}
+
 		/* If NAT is enabled, do an address translation */
 		if (sr->natEnable) {
-			int failed = sr_nat_translate_packet(sr, packet, len, interface);
+			int failed = sr_nat_translate_packet(sr, packet, len, iface);
 			if (failed) {
 				/* packet could not be translated. Drop it */
 				return;
@@ -108,15 +122,16 @@ void sr_handlepacket(struct sr_instance* sr,
 
 		if (we_are_dest(sr, ipHeader->ip_dst)) {
 			/* We are destination */
-			processIP(sr, packet, len, interface);
+			processIP(sr, packet, len, iface);
 		} else {
 			/* We are not destination. Forward it. */
-			processForward(sr, packet, len, interface);
+			processForward(sr, packet, len, iface);
 		}
+		sr_flow_done(sr);
 	}
 }
 
-void processArp(struct sr_instance *sr , uint8_t *packet, unsigned int len, char *interface) {
+void processArp(struct sr_instance *sr , uint8_t *packet, unsigned int len, struct sr_if *iface) {
 
 	struct sr_arp_hdr *arpHeader = (struct sr_arp_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 
@@ -126,10 +141,10 @@ void processArp(struct sr_instance *sr , uint8_t *packet, unsigned int len, char
 
 		/* Found requests in queue waiting for this reply. Send all waiting packets */ 
 		struct sr_packet *waiting = req->packets;
-		struct sr_rt *rt = findLongestMatchPrefix(sr->routing_table, htonl(req->ip));
+		struct sr_rt *rt = sr_fib_lookup(sr, htonl(req->ip));
 
 		while (waiting != NULL) {
-			send_packet_to_dest(sr, waiting->buf, waiting->len, rt->interface, arpHeader->ar_sha, arpHeader->ar_sip);
+			send_packet_to_dest(sr, waiting->buf, waiting->len, sr_rt_interface(sr, rt), arpHeader->ar_sha, arpHeader->ar_sip);
 			waiting = waiting->next;
 		}
 
@@ -139,7 +154,7 @@ void processArp(struct sr_instance *sr , uint8_t *packet, unsigned int len, char
 
 	if (ntohs(arpHeader->ar_op) == arp_op_request) {
 		/* Reply to sender with our information */
-		arp_send_reply(sr, packet, len, interface);
+		arp_send_reply(sr, packet, len, iface);
 	}
 
 }
@@ -147,7 +162,7 @@ void processArp(struct sr_instance *sr , uint8_t *packet, unsigned int len, char
 void processIP(struct sr_instance* sr,
         uint8_t * packet,
         unsigned int len,
-        char* interface) {
+        struct sr_if* iface) {
 
 	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 
@@ -164,13 +179,13 @@ void processIP(struct sr_instance* sr,
 		/* Process ICMP only if echo*/
 		struct sr_icmp_hdr *icmpHeader = (struct sr_icmp_hdr *)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 		if (icmpHeader->icmp_type == icmp_echo_req_type) {
-			icmp_send_echo_reply(sr, packet, len, interface);
+			icmp_send_echo_reply(sr, packet, len, iface);
 		}
 
 	} else if (ipHeader->ip_p == ip_protocol_tcp || ipHeader->ip_p == ip_protocol_udp) {
 
 		/* TCP or UDP Payload */
-		icmp_send_port_unreachable(sr, packet, len, interface);
+		icmp_send_port_unreachable(sr, packet, len, iface);
 
 	}
 
@@ -179,36 +194,60 @@ void processIP(struct sr_instance* sr,
 void processForward(struct sr_instance* sr,
         uint8_t * packet,
         unsigned int len,
-        char* interface) {
+        struct sr_if* iface) {
 
 	struct sr_ip_hdr *ipHeader = (struct sr_ip_hdr *) (packet + sizeof(struct sr_ethernet_hdr));
 
 	/* Reply with timeout if TTL exceeded */
+	uint16_t oldTtlWord = htons((ipHeader->ip_ttl << 8) | ipHeader->ip_p);
 	ipHeader->ip_ttl = ipHeader->ip_ttl - 1;
 	if (ipHeader->ip_ttl == 0) {
-		icmp_send_time_exceeded(sr, packet, len, interface);
+		icmp_send_time_exceeded(sr, packet, len, iface);
 		return;
 	}
 
+	/* TTL shares a checksum word with the protocol. Adjust instead of recomputing */
+	ipHeader->ip_sum = cksum_update16(ipHeader->ip_sum, oldTtlWord, htons((ipHeader->ip_ttl << 8) | ipHeader->ip_p));
+
 	/* At this point, all checks passed, check routing table */
-	struct sr_rt *closestMatch = findLongestMatchPrefix(sr->routing_table, ipHeader->ip_dst);
+	struct sr_rt *closestMatch = sr_fib_lookup(sr, ipHeader->ip_dst);
 
 	if (closestMatch == NULL) {
 		/* No match found. Send net unreachable */
-		icmp_send_net_unreachable(sr, packet, len, interface);
+		icmp_send_net_unreachable(sr, packet, len, iface);
 
 	} else {
-		/* Match found. Lookup MAC address in ARP cache */
-		struct sr_arpentry *arpEntry = sr_arpcache_lookup(&(sr->cache), ntohl(closestMatch->gw.s_addr));
+		struct sr_if *egressIf = sr_rt_interface(sr, closestMatch);
+		if (egressIf == NULL) {
+			/* Route through an interface we do not have */
+			icmp_send_net_unreachable(sr, packet, len, iface);
+			return;
+		}
 
-		if (arpEntry != NULL) {
-			/* Found MAC address. Send the packet */
-			struct sr_rt *arpClosestMatch = findLongestMatchPrefix(sr->routing_table, ntohl(arpEntry->ip));
-			send_packet_to_dest(sr, packet, len, arpClosestMatch->interface, arpEntry->mac, ntohl(arpEntry->ip));
+		/* Match found. The route's adjacency holds the Ethernet header for its next hop.
+		   Workers racing to set it get the same one from the cache, the CAS publishes it */
+		struct sr_adj *adj = __atomic_load_n(&(closestMatch->adj), __ATOMIC_ACQUIRE);
+		if (adj == NULL) {
+			struct sr_adj *unset = NULL;
+			adj = sr_arpcache_get_adj(&(sr->cache), ntohl(closestMatch->gw.s_addr), egressIf->index, egressIf->addr);
+			if (!__atomic_compare_exchange_n(&(closestMatch->adj), &unset, adj, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				adj = unset;
+			}
+		}
+
+		if (sr_arpcache_read_adj(&(sr->cache), adj, packet)) {
+			/* Next hop resolved, header already written. Send the packet,
+			   addressed to the next hop as send_packet_to_dest does */
+			if (ipHeader->ip_dst != closestMatch->gw.s_addr) {
+				ipHeader->ip_sum = cksum_update32(ipHeader->ip_sum, ipHeader->ip_dst, closestMatch->gw.s_addr);
+				ipHeader->ip_dst = closestMatch->gw.s_addr;
+			}
+			sr_send_packet(sr, packet, len, egressIf);
+			sr_flow_learn(sr, packet, adj, egressIf);
 
 		} else {
 			/* Could not find MAC address. Queue request for ARP  */
-			sr_arpcache_queuereq(&(sr->cache), ntohl(closestMatch->gw.s_addr), packet, len, interface);
+			arp_queue_packet(sr, ntohl(closestMatch->gw.s_addr), packet, len, iface);
 		}
 	}
 }
@@ -33,6 +33,16 @@
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+struct sr_flow_cache;
+struct sr_rx_ring;
+struct sr_tx_queue;
+struct sr_shm;
+struct sr_io_driver;
+struct sr_packet_io;
+struct sr_replay;
+struct sr_workers;
+struct sr_timers;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -43,40 +53,62 @@ struct sr_rt;
 
 struct sr_instance
 {
+    struct sr_io_driver* io; /* packet I/O driver, see sr_io.h */
     int  sockfd;   /* socket to server */
+    struct sr_rx_ring* rx; /* receive buffers, see sr_vns_comm.c */
+    struct sr_tx_queue* tx; /* transmit queue, see sr_tx_init() */
+    struct sr_shm* shm; /* shared memory transport, see sr_shm.h */
+    int shmEnable; /* accept the server's shared memory offer */
+    struct sr_packet_io* packet; /* AF_PACKET rings, see sr_packet.c */
+    struct sr_replay* replay; /* pcap replay, see sr_replay.c */
     char user[32]; /* user name */
     char host[32]; /* host name */ 
     char template[30]; /* template name if any */
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
+    struct sr_if* if_table[sr_IFACE_MAX]; /* interfaces by sr_if->index */
+    unsigned int if_count;
     struct sr_rt* routing_table; /* routing table */
+    struct sr_fib* fib; /* compiled forwarding table */
+    int fibMode; /* sr_fib_mode used to compile fib */
+    unsigned int arpCacheSize; /* ARP cache entries, 0 for the default */
     struct sr_arpcache cache;   /* ARP cache */
+    struct sr_flow_cache* flows; /* forwarding fast path, see sr_flow.h */
+    unsigned int flowGen; /* bumped to invalidate flows */
+    unsigned int numWorkers; /* data plane threads (-w), 0 for this one */
+    struct sr_workers* workers; /* see sr_worker.h, set while they run */
+    struct sr_timers* timers; /* ARP and NAT timeouts, see sr_timer.h */
     pthread_attr_t attr;
     FILE* logfile;
 
-	struct sr_nat *nat; /* NAT structure */
+	struct sr_nat *nat; /* NAT structure, one shard per worker */
+	unsigned int natShards;
 	int natEnable;
 };
 
 /* -- sr_main.c -- */
 int sr_verify_routing_table(struct sr_instance* sr);
 
+/* -- sr_io.c -- */
+int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , struct sr_if*);
+
 /* -- sr_vns_comm.c -- */
-int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_tx_init(struct sr_instance* , unsigned int );
+void sr_tx_destroy(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
-void processIP(struct sr_instance* , uint8_t * , unsigned int , char* );
-void processForward(struct sr_instance* , uint8_t * , unsigned int , char* );
-void processArp(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , struct sr_if* );
+void processIP(struct sr_instance* , uint8_t * , unsigned int , struct sr_if* );
+void processForward(struct sr_instance* , uint8_t * , unsigned int , struct sr_if* );
+void processArp(struct sr_instance* , uint8_t * , unsigned int , struct sr_if* );
 int we_are_dest(struct sr_instance *, uint32_t );
 
 /* -- sr_if.c -- */
-void sr_add_interface(struct sr_instance* , const char* );
+int sr_add_interface(struct sr_instance* , const char* );
 void sr_set_ether_ip(struct sr_instance* , uint32_t );
 void sr_set_ether_addr(struct sr_instance* , const unsigned char* );
 void sr_print_if_list(struct sr_instance* );
@@ -21,6 +21,7 @@
 
 #include "sr_rt.h"
 #include "sr_router.h"
+#include "sr_fib.h"
 
 /*---------------------------------------------------------------------
  * Method:
@@ -82,9 +83,26 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
         sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
     } /* -- while -- */
 
+    /* -- compile the table for fast longest prefix match -- */
+    sr_fib_build(sr);
+
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_rt_ifindex
+ *
+ * Index of the named interface, or -1 if it has not been added yet. In
+ * that case sr_add_interface fills it in later.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_ifindex(struct sr_instance* sr, const char* if_name)
+{
+    struct sr_if* iface = sr_get_interface(sr, if_name);
+    return iface ? (int)iface->index : -1;
+} /* -- sr_rt_ifindex -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -109,6 +127,8 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        sr->routing_table->ifindex = sr_rt_ifindex(sr,if_name);
+        sr->routing_table->adj = 0;
 
         return;
     }
@@ -128,9 +148,27 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker->ifindex = sr_rt_ifindex(sr,if_name);
+    rt_walker->adj = 0;
 
 } /* -- sr_add_entry -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_rt_interface
+ *
+ * Returns the interface a route goes out of without comparing names,
+ * or 0 if the interface does not exist.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_rt_interface(struct sr_instance* sr, struct sr_rt* entry)
+{
+    if(entry->ifindex < 0)
+    { return 0; }
+
+    return sr_get_interface_by_index(sr, entry->ifindex);
+} /* -- sr_rt_interface -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
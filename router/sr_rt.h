@@ -20,6 +20,8 @@
 
 #include "sr_if.h"
 
+struct sr_adj;
+
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
@@ -33,6 +35,8 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    int    ifindex;     /* sr_if->index of interface, -1 if it does not exist (yet) */
+    struct sr_adj* adj; /* next hop adjacency, set on first use with a CAS */
     struct sr_rt* next;
 };
 
@@ -42,6 +46,7 @@ void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
+struct sr_if* sr_rt_interface(struct sr_instance* sr, struct sr_rt* entry);
 
 
 #endif  /* --  sr_RT_H -- */
@@ -0,0 +1,265 @@
+/**********************************************************************
+ * file: sr_shm.c
+ *
+ * Description:
+ *
+ * This file contains the shared memory packet transport, see sr_shm.h.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "sr_shm.h"
+
+#ifdef _LINUX_
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+static int sr_shm_send_fds(int sockFd, struct sr_shm_attach *attach, int *fds, int numFds) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = attach;
+	iov.iov_len = sizeof(struct sr_shm_attach);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+
+	return sendmsg(sockFd, &msg, 0) == sizeof(struct sr_shm_attach) ? 0 : -1;
+}
+
+struct sr_shm *sr_shm_attach(const char *path, uint32_t cookie) {
+	struct sockaddr_un addr;
+	struct sr_shm_attach attach;
+	int fds[3];
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Shared memory socket path too long\n");
+		return NULL;
+	}
+
+	struct sr_shm *shm = (struct sr_shm *) calloc(1, sizeof(struct sr_shm));
+	if (shm == NULL) {
+		return NULL;
+	}
+	shm->memFd = shm->rxEventFd = shm->txEventFd = shm->sockFd = -1;
+
+	/* Rings */
+	shm->memFd = memfd_create("sr_shm", MFD_CLOEXEC);
+	if (shm->memFd < 0 || ftruncate(shm->memFd, sizeof(struct sr_shm_region)) != 0) {
+		perror("memfd");
+		sr_shm_detach(shm);
+		return NULL;
+	}
+	shm->region = (struct sr_shm_region *) mmap(NULL, sizeof(struct sr_shm_region),
+		PROT_READ | PROT_WRITE, MAP_SHARED, shm->memFd, 0);
+	if (shm->region == MAP_FAILED) {
+		perror("mmap");
+		shm->region = NULL;
+		sr_shm_detach(shm);
+		return NULL;
+	}
+	shm->region->magic = SR_SHM_MAGIC;
+	shm->region->version = SR_SHM_VERSION;
+	shm->region->slots = SR_SHM_SLOTS;
+	shm->region->slotSize = SR_SHM_SLOT_SIZE;
+
+	/* Wakeups */
+	shm->rxEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	shm->txEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shm->rxEventFd < 0 || shm->txEventFd < 0) {
+		perror("eventfd");
+		sr_shm_detach(shm);
+		return NULL;
+	}
+
+	/* Hand everything to the server */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	shm->sockFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (shm->sockFd < 0 || connect(shm->sockFd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Could not connect to %s, staying on TCP\n", path);
+		sr_shm_detach(shm);
+		return NULL;
+	}
+
+	attach.magic = htonl(SR_SHM_MAGIC);
+	attach.cookie = htonl(cookie);
+	attach.size = htonl(sizeof(struct sr_shm_region));
+	fds[0] = shm->memFd;
+	fds[1] = shm->rxEventFd;
+	fds[2] = shm->txEventFd;
+	if (sr_shm_send_fds(shm->sockFd, &attach, fds, 3) != 0) {
+		perror("sendmsg");
+		sr_shm_detach(shm);
+		return NULL;
+	}
+
+	return shm;
+}
+
+void sr_shm_detach(struct sr_shm *shm) {
+	if (shm == NULL) {
+		return;
+	}
+	if (shm->region != NULL) {
+		munmap(shm->region, sizeof(struct sr_shm_region));
+	}
+	if (shm->memFd >= 0) {
+		close(shm->memFd);
+	}
+	if (shm->rxEventFd >= 0) {
+		close(shm->rxEventFd);
+	}
+	if (shm->txEventFd >= 0) {
+		close(shm->txEventFd);
+	}
+	if (shm->sockFd >= 0) {
+		close(shm->sockFd);
+	}
+	if (shm->drops > 0) {
+		printf("Shared memory: %lu packets dropped on a full ring\n", shm->drops);
+	}
+	free(shm);
+}
+
+int sr_shm_next(struct sr_shm *shm, uint8_t **frame, unsigned int *len, char **iface) {
+	struct sr_shm_ring *ring = &(shm->region->toRouter);
+	uint32_t tail = ring->tail;
+
+	/* Acquire pairs with the server's head update, the slot is complete */
+	if (__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) == tail) {
+		return 0;
+	}
+
+	struct sr_shm_slot *slot = &(ring->slots[tail & (SR_SHM_SLOTS - 1)]);
+	*frame = slot->frame;
+	*len = slot->len > SR_SHM_FRAME_MAX ? SR_SHM_FRAME_MAX : slot->len;
+	*iface = slot->iface;
+	slot->iface[sizeof(slot->iface) - 1] = '\0';
+	return 1;
+}
+
+void sr_shm_release(struct sr_shm *shm) {
+	struct sr_shm_ring *ring = &(shm->region->toRouter);
+	__atomic_store_n(&(ring->tail), ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+int sr_shm_send(struct sr_shm *shm, uint8_t *frame, unsigned int len, const char *iface) {
+	struct sr_shm_ring *ring = &(shm->region->fromRouter);
+	uint32_t head = ring->head;
+
+	if (len > SR_SHM_FRAME_MAX) {
+		return -1;
+	}
+	if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) == SR_SHM_SLOTS) {
+		shm->drops++;
+		sr_shm_kick(shm);
+		return -1;
+	}
+
+	struct sr_shm_slot *slot = &(ring->slots[head & (SR_SHM_SLOTS - 1)]);
+	slot->len = len;
+	strncpy(slot->iface, iface, sizeof(slot->iface));
+	memcpy(slot->frame, frame, len);
+
+	/* Release publishes the slot before the server can see the new head */
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+	shm->kick = 1;
+	return 0;
+}
+
+void sr_shm_kick(struct sr_shm *shm) {
+	uint64_t one = 1;
+	if (!shm->kick) {
+		return;
+	}
+	shm->kick = 0;
+	if (write(shm->txEventFd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+		perror("eventfd write");
+	}
+}
+
+int sr_shm_wait(struct sr_shm *shm, int fd) {
+	struct pollfd fds[3];
+	uint64_t count;
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = shm->rxEventFd;
+	fds[1].events = POLLIN;
+	fds[2].fd = shm->sockFd;
+	fds[2].events = POLLIN;
+
+	/* The server writes the eventfd after every batch it adds, so anything
+	   added after the last sr_shm_next() leaves it readable */
+	if (poll(fds, 3, -1) < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (fds[1].revents & POLLIN) {
+		if (read(shm->rxEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+			return -1;
+		}
+	}
+
+	if (fds[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+		/* Nothing is ever sent on the Unix socket, so this is the server leaving */
+		fprintf(stderr, "Shared memory transport closed by server, back to TCP\n");
+		shm->ready = 0;
+		shm->lost = 1;
+	}
+
+	return (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0;
+}
+
+#else /* _LINUX_ */
+
+struct sr_shm *sr_shm_attach(const char *path, uint32_t cookie) {
+	fprintf(stderr, "Shared memory transport needs Linux, staying on TCP\n");
+	return NULL;
+}
+
+void sr_shm_detach(struct sr_shm *shm) {
+	free(shm);
+}
+
+int sr_shm_next(struct sr_shm *shm, uint8_t **frame, unsigned int *len, char **iface) {
+	return 0;
+}
+
+void sr_shm_release(struct sr_shm *shm) {
+}
+
+int sr_shm_send(struct sr_shm *shm, uint8_t *frame, unsigned int len, const char *iface) {
+	return -1;
+}
+
+void sr_shm_kick(struct sr_shm *shm) {
+}
+
+int sr_shm_wait(struct sr_shm *shm, int fd) {
+	return 1;
+}
+
+#endif /* _LINUX_ */
@@ -0,0 +1,98 @@
+/**********************************************************************
+ * file: sr_shm.h
+ *
+ * Description:
+ *
+ * Shared memory packet transport for a router running on the same host
+ * as POX. The TCP connection to the server still carries everything but
+ * packets. When the server sends VNS_SHM_OFFER, the router creates a
+ * memfd holding two single-producer/single-consumer rings and two
+ * eventfds, and passes them to the server over the Unix socket named in
+ * the offer. Once the server answers VNS_SHM_READY, packets in both
+ * directions go through the rings. Each side writes the other side's
+ * eventfd after adding packets to a ring.
+ *
+ * The layout below is shared with pox_module/cs144/VNSShm.py.
+ *
+ **********************************************************************/
+
+#ifndef SR_SHM_H
+#define SR_SHM_H
+
+#include <inttypes.h>
+
+#include "sr_router.h"
+
+#define SR_SHM_MAGIC 0x53525348		/* "SRSH" */
+#define SR_SHM_VERSION 1
+#define SR_SHM_SLOTS 1024			/* per ring, power of 2 */
+#define SR_SHM_SLOT_SIZE 2048
+#define SR_SHM_FRAME_MAX (SR_SHM_SLOT_SIZE - 20)
+#define SR_SHM_CACHELINE 64
+
+struct sr_shm_slot {
+	uint32_t len;				/* frame length */
+	char iface[16];
+	uint8_t frame[SR_SHM_FRAME_MAX];
+} __attribute__ ((__packed__));
+
+struct sr_shm_ring {
+	uint32_t head;				/* next slot to fill, written by the producer */
+	uint8_t pad1[SR_SHM_CACHELINE - 4];
+	uint32_t tail;				/* next slot to read, written by the consumer */
+	uint8_t pad2[SR_SHM_CACHELINE - 4];
+	struct sr_shm_slot slots[SR_SHM_SLOTS];
+} __attribute__ ((__packed__));
+
+struct sr_shm_region {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slotSize;
+	uint8_t pad[SR_SHM_CACHELINE - 16];
+	struct sr_shm_ring toRouter;
+	struct sr_shm_ring fromRouter;
+} __attribute__ ((__packed__));
+
+/* Sent with the file descriptors (memfd, toRouter eventfd, fromRouter
+   eventfd) over the Unix socket */
+struct sr_shm_attach {
+	uint32_t magic;
+	uint32_t cookie;			/* from VNS_SHM_OFFER */
+	uint32_t size;				/* of the memfd */
+} __attribute__ ((__packed__));
+
+struct sr_shm {
+	struct sr_shm_region *region;
+	int memFd;
+	int rxEventFd;				/* written by the server when toRouter has packets */
+	int txEventFd;				/* written by us when fromRouter has packets */
+	int sockFd;				/* Unix socket, closed by the server on detach */
+	int ready;				/* server mapped the rings, packets go out through them */
+	int kick;				/* packets added since txEventFd was last written */
+	int lost;				/* server closed the Unix socket, detach */
+	unsigned long drops;			/* fromRouter was full */
+};
+
+/* Creates the rings and hands them to the server listening at path.
+   Returns NULL if anything fails; the caller stays on TCP */
+struct sr_shm *sr_shm_attach(const char *path, uint32_t cookie);
+
+void sr_shm_detach(struct sr_shm *shm);
+
+/* Next packet from the server, or 0 if toRouter is empty. The packet stays
+   valid until sr_shm_release() */
+int sr_shm_next(struct sr_shm *shm, uint8_t **frame, unsigned int *len, char **iface);
+void sr_shm_release(struct sr_shm *shm);
+
+/* Adds a packet to fromRouter. Returns -1 if it is full. The server is not
+   woken until sr_shm_kick() */
+int sr_shm_send(struct sr_shm *shm, uint8_t *frame, unsigned int len, const char *iface);
+void sr_shm_kick(struct sr_shm *shm);
+
+/* Blocks until the server wakes us or fd is readable. Returns 1 if fd is
+   readable, 0 if only the rings need attention, -1 on error. Sets lost if
+   the server went away */
+int sr_shm_wait(struct sr_shm *shm, int fd);
+
+#endif
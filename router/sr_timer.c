@@ -0,0 +1,321 @@
+/**********************************************************************
+ * file: sr_timer.c
+ *
+ * Description:
+ *
+ * This file contains the timing wheels behind the ARP cache and NAT
+ * timeouts and the thread that drives them. See sr_timer.h.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "sr_timer.h"
+#include "sr_router.h"
+
+#define SR_TIMER_MASK (SR_TIMER_SLOTS - 1)
+#define SR_TIMER_SPAN ((uint64_t) 1 << (SR_TIMER_LEVEL_BITS * SR_TIMER_LEVELS))
+
+uint64_t sr_timer_ticks(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / SR_TIMER_TICK_MS;
+}
+
+/* Files an unarmed timer in the slot for its expiry. The level is picked
+   by how far off it is, so it is at most a full turn of that level away.
+   Timers beyond the top level are pulled in, their callback finds them early */
+static void sr_timer_link(struct sr_timer_wheel *wheel, struct sr_timer *timer) {
+	uint64_t delta;
+	unsigned int level = 0;
+
+	if (timer->expires - wheel->now >= SR_TIMER_SPAN) {
+		timer->expires = wheel->now + SR_TIMER_SPAN - 1;
+	}
+	delta = timer->expires - wheel->now;
+	while (level < SR_TIMER_LEVELS - 1 && delta >> (SR_TIMER_LEVEL_BITS * (level + 1)) != 0) {
+		level++;
+	}
+
+	timer->level = level;
+	timer->slot = (timer->expires >> (SR_TIMER_LEVEL_BITS * level)) & SR_TIMER_MASK;
+
+	struct sr_timer **head = &(wheel->slots[level][timer->slot]);
+	timer->next = *head;
+	if (*head != NULL) {
+		(*head)->pprev = &(timer->next);
+	}
+	*head = timer;
+	timer->pprev = head;
+
+	wheel->occupied[level] |= (uint64_t) 1 << timer->slot;
+	wheel->pending++;
+}
+
+static void sr_timer_unlink(struct sr_timer_wheel *wheel, struct sr_timer *timer) {
+	*(timer->pprev) = timer->next;
+	if (timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->pprev = NULL;
+	timer->next = NULL;
+
+	if (wheel->slots[timer->level][timer->slot] == NULL) {
+		wheel->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+	}
+	wheel->pending--;
+}
+
+/* First tick at which the wheel has anything to do: a level 0 slot to run
+   or an upper slot to move down. 0 if it is empty */
+static uint64_t sr_timer_next(struct sr_timer_wheel *wheel) {
+	uint64_t next = 0;
+	unsigned int level;
+
+	for (level = 0; level < SR_TIMER_LEVELS; level++) {
+		uint64_t bits = wheel->occupied[level];
+		if (bits == 0) {
+			continue;
+		}
+
+		/* Slots after the current one first, the current one last: it can
+		   only hold timers a full turn away */
+		unsigned int shift = SR_TIMER_LEVEL_BITS * level;
+		uint64_t current = wheel->now >> shift;
+		unsigned int start = (current + 1) & SR_TIMER_MASK;
+		if (start != 0) {
+			bits = (bits >> start) | (bits << (SR_TIMER_SLOTS - start));
+		}
+
+		uint64_t tick = (current + 1 + __builtin_ctzll(bits)) << shift;
+		if (next == 0 || tick < next) {
+			next = tick;
+		}
+	}
+	return next;
+}
+
+/* Refiles every timer in an upper slot whose span has come up */
+static void sr_timer_cascade(struct sr_timer_wheel *wheel, unsigned int level, unsigned int slot) {
+	struct sr_timer *timer = wheel->slots[level][slot];
+
+	wheel->slots[level][slot] = NULL;
+	wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+
+	while (timer != NULL) {
+		struct sr_timer *next = timer->next;
+		wheel->pending--;
+		sr_timer_link(wheel, timer);
+		timer = next;
+	}
+}
+
+/* Runs every timer due up to tick. Only the ticks with work are visited */
+static void sr_timer_advance(struct sr_timer_wheel *wheel, uint64_t tick) {
+	while (wheel->now < tick) {
+		uint64_t next = sr_timer_next(wheel);
+		unsigned int level;
+
+		if (next == 0 || next > tick) {
+			wheel->now = tick;
+			return;
+		}
+		wheel->now = next;
+
+		for (level = 1; level < SR_TIMER_LEVELS; level++) {
+			unsigned int shift = SR_TIMER_LEVEL_BITS * level;
+			if ((next & (((uint64_t) 1 << shift) - 1)) != 0) {
+				break;
+			}
+			sr_timer_cascade(wheel, level, (next >> shift) & SR_TIMER_MASK);
+		}
+
+		/* A callback may cancel or arm others, so always take the head */
+		struct sr_timer **head = &(wheel->slots[0][next & SR_TIMER_MASK]);
+		while (*head != NULL) {
+			struct sr_timer *timer = *head;
+			sr_timer_unlink(wheel, timer);
+			timer->fn(wheel->ctx, timer->arg);
+		}
+	}
+}
+
+/* Makes the timerfd fire by tick, unless it already will */
+static void sr_timer_arm(struct sr_timers *timers, uint64_t tick) {
+	uint64_t armed = __atomic_load_n(&(timers->armed), __ATOMIC_ACQUIRE);
+	if (tick == 0 || (armed != 0 && armed <= tick)) {
+		return;
+	}
+
+	pthread_mutex_lock(&(timers->lock));
+	if (timers->armed == 0 || tick < timers->armed) {
+		struct itimerspec its;
+		uint64_t ms = tick * SR_TIMER_TICK_MS;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+		timerfd_settime(timers->fd, TFD_TIMER_ABSTIME, &its, NULL);
+		__atomic_store_n(&(timers->armed), tick, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&(timers->lock));
+}
+
+static void *sr_timer_run(void *arg) {
+	struct sr_timers *timers = (struct sr_timers *) arg;
+
+	while (1) {
+		uint64_t expirations;
+		if (read(timers->fd, &expirations, sizeof(expirations)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read(timerfd)");
+			break;
+		}
+
+		/* Disarmed from here on, so a timer armed while the wheels are
+		   walked re-arms the timerfd itself */
+		pthread_mutex_lock(&(timers->lock));
+		if (timers->stopping) {
+			pthread_mutex_unlock(&(timers->lock));
+			break;
+		}
+		__atomic_store_n(&(timers->armed), 0, __ATOMIC_RELEASE);
+		struct sr_timer_wheel *wheel = timers->wheels;
+		pthread_mutex_unlock(&(timers->lock));
+
+		/* Wheels are only ever added at the head, this walk is safe */
+		uint64_t now = sr_timer_ticks();
+		uint64_t earliest = 0;
+		for (; wheel != NULL; wheel = wheel->next) {
+			pthread_mutex_lock(wheel->lock);
+			sr_timer_advance(wheel, now);
+			uint64_t next = sr_timer_next(wheel);
+			pthread_mutex_unlock(wheel->lock);
+
+			if (next != 0 && (earliest == 0 || next < earliest)) {
+				earliest = next;
+			}
+		}
+		sr_timer_arm(timers, earliest);
+	}
+
+	return NULL;
+}
+
+int sr_timer_start(struct sr_instance *sr) {
+	struct sr_timers *timers = (struct sr_timers *) calloc(1, sizeof(struct sr_timers));
+	if (timers == NULL) {
+		return -1;
+	}
+
+	timers->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timers->fd < 0) {
+		perror("timerfd_create");
+		free(timers);
+		return -1;
+	}
+	pthread_mutex_init(&(timers->lock), NULL);
+
+	if (pthread_create(&(timers->thread), NULL, sr_timer_run, timers) != 0) {
+		fprintf(stderr, "Could not start the timer thread\n");
+		pthread_mutex_destroy(&(timers->lock));
+		close(timers->fd);
+		free(timers);
+		return -1;
+	}
+
+	sr->timers = timers;
+	return 0;
+}
+
+void sr_timer_stop(struct sr_instance *sr) {
+	struct sr_timers *timers = sr->timers;
+	struct itimerspec its;
+
+	if (timers == NULL) {
+		return;
+	}
+
+	/* Fire straight away so the thread sees stopping */
+	pthread_mutex_lock(&(timers->lock));
+	timers->stopping = 1;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = 1;
+	timerfd_settime(timers->fd, 0, &its, NULL);
+	pthread_mutex_unlock(&(timers->lock));
+
+	pthread_join(timers->thread, NULL);
+	pthread_mutex_destroy(&(timers->lock));
+	close(timers->fd);
+	free(timers);
+	sr->timers = NULL;
+}
+
+void sr_timer_wheel_init(struct sr_timer_wheel *wheel, pthread_mutex_t *lock, void *ctx) {
+	memset(wheel, 0, sizeof(struct sr_timer_wheel));
+	wheel->lock = lock;
+	wheel->ctx = ctx;
+	wheel->now = sr_timer_ticks();
+}
+
+void sr_timer_add_wheel(struct sr_instance *sr, struct sr_timer_wheel *wheel) {
+	struct sr_timers *timers = sr->timers;
+
+	pthread_mutex_lock(wheel->lock);
+	pthread_mutex_lock(&(timers->lock));
+	wheel->service = timers;
+	wheel->next = timers->wheels;
+	timers->wheels = wheel;
+	pthread_mutex_unlock(&(timers->lock));
+
+	sr_timer_arm(timers, sr_timer_next(wheel));
+	pthread_mutex_unlock(wheel->lock);
+}
+
+void sr_timer_init(struct sr_timer *timer, sr_timer_fn fn, void *arg) {
+	memset(timer, 0, sizeof(struct sr_timer));
+	timer->fn = fn;
+	timer->arg = arg;
+}
+
+void sr_timer_set(struct sr_timer_wheel *wheel, struct sr_timer *timer, uint64_t ms) {
+	uint64_t now = sr_timer_ticks();
+
+	if (timer->pprev != NULL) {
+		sr_timer_unlink(wheel, timer);
+	}
+
+	/* Nothing is due on an empty wheel, skip the ticks it has been idle */
+	if (wheel->pending == 0 && now > wheel->now) {
+		wheel->now = now;
+	}
+
+	timer->expires = now + (ms + SR_TIMER_TICK_MS - 1) / SR_TIMER_TICK_MS;
+	if (timer->expires <= wheel->now) {
+		timer->expires = wheel->now + 1;
+	}
+	sr_timer_link(wheel, timer);
+
+	if (wheel->service != NULL) {
+		sr_timer_arm(wheel->service, timer->expires);
+	}
+}
+
+void sr_timer_set_earlier(struct sr_timer_wheel *wheel, struct sr_timer *timer, uint64_t ms) {
+	if (timer->pprev != NULL && timer->expires <= sr_timer_ticks() + (ms + SR_TIMER_TICK_MS - 1) / SR_TIMER_TICK_MS) {
+		return;
+	}
+	sr_timer_set(wheel, timer, ms);
+}
+
+void sr_timer_cancel(struct sr_timer_wheel *wheel, struct sr_timer *timer) {
+	if (timer->pprev != NULL) {
+		sr_timer_unlink(wheel, timer);
+	}
+}
@@ -0,0 +1,97 @@
+/**********************************************************************
+ * file: sr_timer.h
+ *
+ * Description:
+ *
+ * Timers for the ARP cache and the NAT. Each owner (the ARP cache, each
+ * NAT shard) keeps a hierarchical timing wheel of SR_TIMER_LEVELS levels of
+ * SR_TIMER_SLOTS slots, ticking every SR_TIMER_TICK_MS. A timer is filed
+ * in the slot its expiry falls in, so arming and cancelling are O(1) and a
+ * tick only touches the timers that are due. Timers further out sit in the
+ * upper levels and are moved down as their slot comes up.
+ *
+ * A wheel is protected by its owner's lock: the owner holds it to arm or
+ * cancel timers, and callbacks run with it held. One thread drives every
+ * wheel from a timerfd, armed for the next slot holding a timer, so
+ * nothing wakes up while there is nothing to expire.
+ *
+ **********************************************************************/
+
+#ifndef SR_TIMER_H
+#define SR_TIMER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#define SR_TIMER_TICK_MS 10
+#define SR_TIMER_LEVEL_BITS 6
+#define SR_TIMER_SLOTS (1 << SR_TIMER_LEVEL_BITS)	/* per level, at most 64 for the occupied bitmap */
+#define SR_TIMER_LEVELS 4							/* reaches 2^24 ticks, about 46 hours */
+
+struct sr_instance;
+
+/* Called with the owner's lock held. ctx is the wheel's, arg the timer's */
+typedef void (*sr_timer_fn)(void *ctx, void *arg);
+
+struct sr_timer {
+	uint64_t expires;			/* tick it is due on */
+	sr_timer_fn fn;
+	void *arg;
+	unsigned int level;			/* slot it is filed in */
+	unsigned int slot;
+	struct sr_timer *next;		/* slot list */
+	struct sr_timer **pprev;	/* NULL while not armed */
+};
+
+struct sr_timer_wheel {
+	pthread_mutex_t *lock;		/* owner's lock */
+	void *ctx;
+	uint64_t now;				/* every timer due up to this tick has run */
+	unsigned int pending;
+	uint64_t occupied[SR_TIMER_LEVELS];	/* non-empty slots */
+	struct sr_timer *slots[SR_TIMER_LEVELS][SR_TIMER_SLOTS];
+	struct sr_timers *service;	/* set by sr_timer_add_wheel */
+	struct sr_timer_wheel *next;
+};
+
+struct sr_timers {
+	int fd;						/* timerfd on CLOCK_MONOTONIC */
+	uint64_t armed;				/* tick the timerfd is set for, 0 if none */
+	int stopping;
+	pthread_t thread;
+	pthread_mutex_t lock;		/* wheels, armed and the timerfd setting */
+	struct sr_timer_wheel *wheels;
+};
+
+/* Current tick on the monotonic clock */
+uint64_t sr_timer_ticks(void);
+
+/* Starts the timer thread and sets sr->timers. Returns 0 on success */
+int sr_timer_start(struct sr_instance *sr);
+
+/* Stops the timer thread. Wheels are left to their owners */
+void sr_timer_stop(struct sr_instance *sr);
+
+/* Sets up an empty wheel whose callbacks get ctx and run under lock */
+void sr_timer_wheel_init(struct sr_timer_wheel *wheel, pthread_mutex_t *lock, void *ctx);
+
+/* Has the timer thread drive wheel. Timers already armed on it are kept */
+void sr_timer_add_wheel(struct sr_instance *sr, struct sr_timer_wheel *wheel);
+
+/* Sets the callback for a timer, which starts out not armed */
+void sr_timer_init(struct sr_timer *timer, sr_timer_fn fn, void *arg);
+
+/* The rest are called with the wheel's lock held */
+
+/* Arms the timer to run ms from now, re-arming it if it already was */
+void sr_timer_set(struct sr_timer_wheel *wheel, struct sr_timer *timer, uint64_t ms);
+
+/* Like sr_timer_set, but leaves an armed timer alone unless it is now due
+   sooner. For timeouts refreshed on every packet, whose callback checks
+   the real deadline and re-arms */
+void sr_timer_set_earlier(struct sr_timer_wheel *wheel, struct sr_timer *timer, uint64_t ms);
+
+/* Disarms the timer if it is armed */
+void sr_timer_cancel(struct sr_timer_wheel *wheel, struct sr_timer *timer);
+
+#endif
@@ -4,6 +4,7 @@
 #include "sr_protocol.h"
 #include "sr_utils.h"
 #include "sr_rt.h"
+#include "sr_cksum.h"
 
 
 uint16_t tcp_cksum(uint8_t *packet, int len) {
@@ -85,6 +86,7 @@ int is_sane_icmp_packet(uint8_t *packet, unsigned int len) {
 	uint16_t actual = icmpHeader->icmp_sum;
 	icmpHeader->icmp_sum = 0;
 	uint16_t expected = cksum(icmpHeader, len - sizeof(struct sr_ip_hdr) - sizeof(struct sr_ethernet_hdr));	
+	icmpHeader->icmp_sum = actual;
 
 	if (expected != actual) {
 		printf("ICMP Expected checksum(%d) does not match given checksum(%d) \n", expected, actual);
@@ -113,6 +115,7 @@ int is_sane_ip_packet(uint8_t *packet, unsigned int len) {
 	uint16_t actual = ipHeader->ip_sum;
 	ipHeader->ip_sum = 0;
 	uint16_t expected = cksum(ipHeader, sizeof(struct sr_ip_hdr));
+	ipHeader->ip_sum = actual;
 
 	if (expected != actual) {
 		printf("IP Expected checksum(%d) does not match given checksum(%d) \n", expected, actual);
@@ -124,19 +127,60 @@ int is_sane_ip_packet(uint8_t *packet, unsigned int len) {
 }
 
 uint16_t cksum (const void *_data, int len) {
-  const uint8_t *data = _data;
-  uint32_t sum;
-
-  for (sum = 0;len >= 2; data += 2, len -= 2)
-    sum += data[0] << 8 | data[1];
-  if (len > 0)
-    sum += data[0] << 8;
-  while (sum > 0xffff)
-    sum = (sum >> 16) + (sum & 0xffff);
-  sum = htons (~sum);
+  /* Summed by the fastest kernel for this CPU, see sr_cksum.c */
+  uint16_t sum = htons ((uint16_t) ~cksum_sum(_data, len));
   return sum ? sum : 0xffff;
 }
 
+/*
+ * Incremental checksum update (RFC 1624, eqn. 3) for a 16-bit field
+ * changing from oldVal to newVal. sum, oldVal and newVal are taken as they
+ * appear in the packet, so no byte order conversion is needed.
+ */
+uint16_t cksum_update16(uint16_t sum, uint16_t oldVal, uint16_t newVal) {
+	uint32_t acc = (uint16_t) ~sum + (uint16_t) ~oldVal + newVal;
+	acc = (acc >> 16) + (acc & 0xffff);
+	acc = (acc >> 16) + (acc & 0xffff);
+
+	/* Same as cksum(), never return 0 */
+	sum = ~acc;
+	return sum ? sum : 0xffff;
+}
+
+/*
+ * Incremental checksum update for a 32-bit field such as an IP address
+ */
+uint16_t cksum_update32(uint16_t sum, uint32_t oldVal, uint32_t newVal) {
+	sum = cksum_update16(sum, oldVal >> 16, newVal >> 16);
+	return cksum_update16(sum, oldVal & 0xffff, newVal & 0xffff);
+}
+
+/*
+ * One's complement difference between an old and a new 16-bit field. Deltas
+ * for several fields can be added up and applied at once with cksum_adjust()
+ */
+uint32_t cksum_delta16(uint16_t oldVal, uint16_t newVal) {
+	return (uint16_t) ~oldVal + (uint32_t) newVal;
+}
+
+uint32_t cksum_delta32(uint32_t oldVal, uint32_t newVal) {
+	return cksum_delta16(oldVal >> 16, newVal >> 16) + cksum_delta16(oldVal & 0xffff, newVal & 0xffff);
+}
+
+/*
+ * Applies a sum of cksum_delta16/32() results to a checksum. Deltas for up
+ * to a few hundred fields can be combined before folding
+ */
+uint16_t cksum_adjust(uint16_t sum, uint32_t delta) {
+	uint32_t acc = (uint16_t) ~sum + delta;
+	acc = (acc >> 16) + (acc & 0xffff);
+	acc = (acc >> 16) + (acc & 0xffff);
+
+	/* Same as cksum(), never return 0 */
+	sum = ~acc;
+	return sum ? sum : 0xffff;
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
@@ -35,6 +35,11 @@ int is_sane_icmp_packet(uint8_t * packet, unsigned int len);
 
 uint16_t cksum(const void *_data, int len);
 uint16_t tcp_cksum(uint8_t * packet, int len);
+uint16_t cksum_update16(uint16_t sum, uint16_t oldVal, uint16_t newVal);
+uint16_t cksum_update32(uint16_t sum, uint32_t oldVal, uint32_t newVal);
+uint32_t cksum_delta16(uint16_t oldVal, uint16_t newVal);
+uint32_t cksum_delta32(uint32_t oldVal, uint32_t newVal);
+uint16_t cksum_adjust(uint16_t sum, uint32_t delta);
 
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
@@ -35,20 +35,57 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_shm.h"
+#include "sr_io.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
-static void sr_log_packet(struct sr_instance* , uint8_t* , int );
-static int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                                  uint8_t * packet /* lent */,
-                                  unsigned int len,
-                                  char* interface  /* lent */);
+/* -- receive ring, see sr_rx_frame(..) -- */
+#define SR_RX_BUF_SIZE  (64 * 1024)
+#define SR_RX_RING_BUFS 4
+#define SR_RX_MSG_MAX   32768 /* largest message accepted from the server */
+
+struct sr_rx_ring
+{
+    uint8_t bufs[SR_RX_RING_BUFS][SR_RX_BUF_SIZE];
+    unsigned int cur;   /* buffer being parsed */
+    unsigned int start; /* first unparsed byte in bufs[cur] */
+    unsigned int end;   /* end of received data in bufs[cur] */
+};
+
+/* -- transmit queue, see sr_tx_init(..) -- */
+#define SR_TX_BATCH_MAX 64
+#define SR_TX_COPY_SIZE (SR_TX_BATCH_MAX * 1514)
+
+struct sr_tx_queue
+{
+    pthread_mutex_t lock;  /* serializes writes to sr->sockfd */
+    pthread_t owner;       /* only this thread queues, others write directly */
+    int peer_batch;        /* server sent VNS_BATCH_HELLO */
+    unsigned int batch;    /* flush once this many frames are queued */
+    unsigned int count;    /* frames queued */
+    unsigned int bytes;    /* bytes queued, headers included */
+    c_packet_batch batch_hdr;
+    c_packet_header hdrs[SR_TX_BATCH_MAX];
+    struct iovec iov[2 * SR_TX_BATCH_MAX + 1]; /* iov[0] is batch_hdr */
+    uint8_t copy[SR_TX_COPY_SIZE]; /* frames that do not live in the rx ring */
+    unsigned int copy_used;
+    unsigned long frames;  /* frames sent through the queue */
+    unsigned long writes;  /* writev calls used for them */
+};
+
+static int  sr_tx_flush(struct sr_instance* sr);
+static int  sr_tx_accept_batch(struct sr_instance* sr);
+static int  sr_write_iov(struct sr_instance* sr, struct iovec* iov, int cnt,
+                         unsigned int total_len);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
 
 /*-----------------------------------------------------------------------------
@@ -170,6 +207,7 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
  *
  *
  * Read, from the server, the hardware information for the reserved host.
+ * Returns -1 if the router can't take all of its interfaces.
  *
  *---------------------------------------------------------------------------*/
 
@@ -196,7 +234,8 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
                 break;
             case HWINTERFACE:
                 /*Debug("INTERFACE: %s\n",hwinfo->mHWInfo[i].value);*/
-                sr_add_interface(sr,hwinfo->mHWInfo[i].value);
+                if(sr_add_interface(sr,hwinfo->mHWInfo[i].value) != 0)
+                { return -1; }
                 break;
             case HWSPEED:
                 /* Debug("Speed: %d\n",
@@ -322,7 +361,7 @@ int sr_handle_auth_status(struct sr_instance* sr, c_auth_status* status) {
  * Method: sr_read_from_server(..)
  * Scope: global
  *
- * Houses main while loop for communicating with the virtual router server.
+ * Read and handle one message from the virtual router server.
  *
  *---------------------------------------------------------------------------*/
 
@@ -331,80 +370,281 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
     return sr_read_from_server_expect(sr, 0);
 }
 
-int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_frame(..)
+ * Scope: local
+ *
+ * Pass one received Ethernet frame to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_handle_frame(struct sr_instance* sr, char* name,
+                            uint8_t* frame, unsigned int frame_len)
 {
-    int command, len;
-    unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
-    int ret = 0, bytes_read = 0;
+    struct sr_if* iface = 0;
 
-    /* REQUIRES */
-    assert(sr);
+    /* -- resolve the name VNS gave once, the router is handed
+          the interface itself -- */
+    iface = sr_get_interface(sr, name);
+    if ( iface == 0 )
+    {
+        fprintf(stderr, "** Error, packet on unknown interface %.16s\n", name);
+        return;
+    }
 
-    /*---------------------------------------------------------------------------
-      Read a command from the server
-      -------------------------------------------------------------------------*/
+    sr_io_deliver(sr, frame, frame_len, iface);
+} /* -- sr_handle_frame -- */
 
-    bytes_read = 0;
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_ready(..)
+ * Scope: local
+ *
+ * The server has mapped the rings, send packets through them from now on.
+ *
+ *---------------------------------------------------------------------------*/
 
-    /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
-    {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
+static int sr_shm_ready(struct sr_instance* sr)
+{
+    if ( sr->shm == 0 || sr->shm->ready )
+    { return 0; }
 
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
+    /* -- anything queued for TCP goes first -- */
+    if ( sr_tx_flush(sr) != 0 )
+    { return -1; }
 
-    }
+    if ( sr->tx != 0 )
+    { pthread_mutex_lock(&(sr->tx->lock)); }
+    sr->shm->ready = 1;
+    if ( sr->tx != 0 )
+    { pthread_mutex_unlock(&(sr->tx->lock)); }
 
-    len = ntohl(len);
+    printf("Using shared memory transport\n");
+    return 0;
+} /* -- sr_shm_ready -- */
 
-    if ( len > 10000 || len < 0 )
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_deliver(..)
+ * Scope: local
+ *
+ * Pass the packets waiting in the shared memory ring to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_shm_deliver(struct sr_instance* sr)
+{
+    uint8_t* frame = 0;
+    unsigned int len = 0;
+    char* name = 0;
+    int i = 0;
+
+    /* -- the server only fills the ring once it has mapped it, so this
+          is as good as VNS_SHM_READY (which may still be in the socket) -- */
+    if ( sr_shm_ready(sr) != 0 )
+    { return; }
+
+    /* -- bounded so the socket is looked at now and then -- */
+    for ( i = 0; i < SR_SHM_SLOTS && sr_shm_next(sr->shm, &frame, &len, &name); i++ )
     {
-        fprintf(stderr,"Error: command length to large %d\n",len);
-        close(sr->sockfd);
-        return -1;
+        if ( len >= sizeof(struct sr_ethernet_hdr) )
+        { sr_handle_frame(sr, name, frame, len); }
+        sr_shm_release(sr->shm);
     }
+} /* -- sr_shm_deliver -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_drop(..)
+ * Scope: local
+ *
+ * The server went away from the shared memory transport, back to TCP.
+ *
+ *---------------------------------------------------------------------------*/
 
-    if((buf = malloc(len)) == 0)
+static void sr_shm_drop(struct sr_instance* sr)
+{
+    struct sr_shm* shm = sr->shm;
+
+    if ( sr->tx != 0 )
+    { pthread_mutex_lock(&(sr->tx->lock)); }
+    sr->shm = 0;
+    if ( sr->tx != 0 )
+    { pthread_mutex_unlock(&(sr->tx->lock)); }
+
+    sr_shm_detach(shm);
+} /* -- sr_shm_drop -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_vns_packet(..)
+ * Scope: local
+ *
+ * Pass one VNSPACKET message (on its own or from a batch) to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_handle_vns_packet(struct sr_instance* sr, uint8_t* buf,
+                                 unsigned int len)
+{
+    if ( len < sizeof(c_packet_ethernet_header) )
     {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
-        return -1;
+        fprintf(stderr, "** Error, packet is too short\n");
+        return;
     }
 
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
+    sr_handle_frame(sr, (char*)(buf + sizeof(c_base)),
+            buf + sizeof(c_packet_header), len - sizeof(c_packet_header));
+} /* -- sr_handle_vns_packet -- */
 
-    bytes_read = 0;
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_frame(..)
+ * Scope: local
+ *
+ * Return the next complete VNS message from the receive ring, reading from
+ * the server only when the ring holds no complete message.  Each recv asks
+ * for as much as fits in the current buffer, so one read usually yields
+ * several messages.
+ *
+ * The ring is a few fixed-size buffers filled front to back.  When less
+ * than one maximum size message fits in the current buffer, the partial
+ * message at its end is moved to the start of the next buffer.  Messages
+ * are never moved once returned, and stay valid until the ring wraps.
+ *
+ * RETURN VALUES:
+ *
+ *  1 with *frame and *len set on success
+ *  0 if packets are waiting in the shared memory ring instead
+ *  -1 on error (socket closed on a bad length or a closed connection)
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_rx_frame(struct sr_instance* sr, uint8_t** frame, int* len)
+{
+    struct sr_rx_ring* rx = sr->rx;
+    unsigned int avail = 0;
+    unsigned int next = 0;
+    uint32_t msg_len = 0;
+    uint8_t* shm_frame = 0;
+    unsigned int shm_len = 0;
+    char* shm_name = 0;
+    int ret = 0;
+
+    if ( rx == 0 )
+    {
+        if ( (rx = (struct sr_rx_ring*)malloc(sizeof(struct sr_rx_ring))) == 0 )
+        {
+            fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
+            return -1;
+        }
+        rx->cur = rx->start = rx->end = 0;
+        sr->rx = rx;
+    }
 
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
+    while ( 1 )
     {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
+        avail = rx->end - rx->start;
+
+        /* -- complete message already buffered ? -- */
+        if ( avail >= 4 )
+        {
+            memcpy(&msg_len, rx->bufs[rx->cur] + rx->start, 4);
+            msg_len = ntohl(msg_len);
+
+            if ( msg_len > SR_RX_MSG_MAX || msg_len < sizeof(c_base) )
             {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
+                fprintf(stderr,"Error: command length to large %u\n",msg_len);
                 close(sr->sockfd);
+                sr->sockfd = -1;
                 return -1;
             }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
+
+            if ( avail >= msg_len )
+            {
+                *frame = rx->bufs[rx->cur] + rx->start;
+                *len = msg_len;
+                rx->start += msg_len;
+                return 1;
+            }
+        }
+
+        /* -- packets from the shared memory ring are handled first -- */
+        if ( sr->shm != 0 && sr_shm_next(sr->shm, &shm_frame, &shm_len, &shm_name) )
+        { return 0; }
+
+        /* -- end of the batch, send what it produced before the ring
+              is touched or we block -- */
+        if ( sr_tx_flush(sr) != 0 )
+        { return -1; }
+
+        /* -- no room left for a whole message, move on to the next buffer -- */
+        if ( SR_RX_BUF_SIZE - rx->end < SR_RX_MSG_MAX )
+        {
+            next = (rx->cur + 1) % SR_RX_RING_BUFS;
+            memcpy(rx->bufs[next], rx->bufs[rx->cur] + rx->start, avail);
+            rx->cur = next;
+            rx->start = 0;
+            rx->end = avail;
+        }
+
+        /* -- with shared memory, sleep until either side has something -- */
+        if ( sr->shm != 0 )
+        {
+            ret = sr_shm_wait(sr->shm, sr->sockfd);
+            if ( sr->shm->lost )
+            { sr_shm_drop(sr); }
+            if ( ret < 0 )
+            {
+                perror("poll(..):sr_client.c::sr_read_from_server");
+                return -1;
+            }
+            if ( ret == 0 )
+            { continue; }
+        }
+
+        /* -- just in case SIGALRM breaks recv -- */
+        if ( (ret = recv(sr->sockfd, rx->bufs[rx->cur] + rx->end,
+                        SR_RX_BUF_SIZE - rx->end, 0)) == -1 )
+        {
+            if ( errno == EINTR )
+            { continue; }
+
+            perror("recv(..):sr_client.c::sr_read_from_server");
+            return -1;
+        }
+
+        if ( ret == 0 )
+        {
+            fprintf(stderr,"Error: server closed the connection\n");
+            close(sr->sockfd);
+            sr->sockfd = -1;
+            return -1;
+        }
+
+        rx->end += ret;
     }
+} /* -- sr_rx_frame -- */
+
+int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
+{
+    int command, len;
+    unsigned char *buf = 0;
+    unsigned int offset = 0;
+    uint32_t pkt_len = 0;
+    uint32_t pkt_type = 0;
+    int ret = 0;
+
+    /* REQUIRES */
+    assert(sr);
+
+    /*---------------------------------------------------------------------------
+      Read a command from the server
+      -------------------------------------------------------------------------*/
+
+    ret = sr_rx_frame(sr, &buf, &len);
+    if ( ret == 0 )
+    {
+        sr_shm_deliver(sr);
+        return 1;
+    }
+    if ( ret != 1 )
+    { return -1; }
 
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
@@ -424,27 +664,55 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         /* -------------        VNSPACKET     -------------------- */
 
         case VNSPACKET:
-            sr_pkt = (c_packet_ethernet_header *)buf;
-
-            /* -- check if it is an ARP to another router if so drop   -- */
-            if ( sr_arp_req_not_for_us(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
-
-            /* -- log packet -- */
-            sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
-
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+            sr_handle_vns_packet(sr, buf, len);
+            break;
+
+            /* -------------     VNS_PACKET_BATCH  -------------------- */
+
+        case VNS_PACKET_BATCH:
+            offset = sizeof(c_packet_batch);
+            while ( offset + sizeof(c_base) <= (unsigned int)len )
+            {
+                memcpy(&pkt_len, buf + offset, 4);
+                pkt_len = ntohl(pkt_len);
+                memcpy(&pkt_type, buf + offset + 4, 4);
+                pkt_type = ntohl(pkt_type);
+                if ( pkt_len < sizeof(c_base) || pkt_len > len - offset )
+                {
+                    fprintf(stderr, "** Error, malformed packet batch\n");
+                    break;
+                }
+                /* entries other than VNSPACKET are skipped, as the server does */
+                if ( pkt_type == VNSPACKET )
+                { sr_handle_vns_packet(sr, buf + offset, pkt_len); }
+                offset += pkt_len;
+            }
+            break;
+
+            /* -------------      VNS_SHM_OFFER    -------------------- */
+
+        case VNS_SHM_OFFER:
+            if ( sr->shmEnable && sr->shm == 0 &&
+                 len >= (int)sizeof(c_shm_offer) )
+            {
+                ((c_shm_offer*)buf)->path[sizeof(((c_shm_offer*)buf)->path) - 1] = 0;
+                sr->shm = sr_shm_attach(((c_shm_offer*)buf)->path,
+                        ntohl(((c_shm_offer*)buf)->cookie));
+            }
+            break;
 
+            /* -------------      VNS_SHM_READY    -------------------- */
+
+        case VNS_SHM_READY:
+            if ( sr_shm_ready(sr) != 0 )
+            { ret = -1; }
+            break;
+
+            /* -------------     VNS_BATCH_HELLO   -------------------- */
+
+        case VNS_BATCH_HELLO:
+            if ( sr_tx_accept_batch(sr) != 0 )
+            { ret = -1; }
             break;
 
             /* -------------        VNSCLOSE      -------------------- */
@@ -453,9 +721,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"VNS server closed session.\n");
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
-
-            if(buf)
-            { free(buf); }
             return 0;
             break;
 
@@ -468,7 +733,8 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             /* -------------     VNSHWINFO     -------------------- */
 
         case VNSHWINFO:
-            sr_handle_hwinfo(sr,(c_hwinfo*)buf);
+            if(sr_handle_hwinfo(sr,(c_hwinfo*)buf) < 0)
+            { return -1; }
             if(sr_verify_routing_table(sr) != 0)
             {
                 fprintf(stderr,"Routing table not consistent with hardware\n");
@@ -501,167 +767,410 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
     return ret;
 }/* -- sr_read_from_server -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_ether_addrs_match_interface(..)
- * Scope: Local
+ * Method: sr_write_iov(..)
+ * Scope: local
  *
- * Make sure ethernet addresses are sane so we don't muck uo the system.
+ * Write all of iov to the server.  A short write would break message
+ * framing, so it is finished rather than reported.  iov is modified.
  *
- *----------------------------------------------------------------------------*/
+ *---------------------------------------------------------------------------*/
 
-static int
-sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
-                                uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+static int sr_write_iov(struct sr_instance* sr, struct iovec* iov, int cnt,
+                        unsigned int total_len)
 {
-    struct sr_ethernet_hdr* ether_hdr = 0;
-    struct sr_if* iface = 0;
+    ssize_t ret = 0;
+
+    while ( total_len > 0 )
+    {
+        if ( (ret = writev(sr->sockfd, iov, cnt)) == -1 )
+        {
+            if ( errno == EINTR )
+            { continue; }
+            return -1;
+        }
+        total_len -= ret;
+
+        /* -- skip what was written -- */
+        while ( cnt > 0 && (size_t)ret >= iov->iov_len )
+        {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if ( cnt > 0 )
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
 
-    /* -- REQUIRES -- */
+    return 0;
+} /* -- sr_write_iov -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tx_init(..)
+ * Scope: global
+ *
+ * Set up the transmit queue.  Packets sent by the calling thread (the one
+ * that reads from the server) while it works through a receive batch are
+ * queued and written together with one writev when the batch is done, or
+ * earlier once batch frames are queued.  A batch of 1 sends every packet
+ * right away.  Packets sent from other threads are always written right
+ * away.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_tx_init(struct sr_instance* sr, unsigned int batch)
+{
+    struct sr_tx_queue* tx = 0;
+
+    /* REQUIRES */
     assert(sr);
-    assert(buf);
-    assert(name);
 
-    ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
+    if ( (tx = (struct sr_tx_queue*)malloc(sizeof(struct sr_tx_queue))) == 0 )
+    { return -1; }
 
-    if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
-        return 0;
-    }
+    pthread_mutex_init(&(tx->lock), 0);
+    tx->owner = pthread_self();
+    tx->batch = (batch > SR_TX_BATCH_MAX) ? SR_TX_BATCH_MAX : batch;
+    tx->count = 0;
+    tx->bytes = 0;
+    tx->copy_used = 0;
+    tx->frames = 0;
+    tx->writes = 0;
+    tx->peer_batch = 0;
 
-    if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
-        fprintf( stderr, "** Error, source address does not match interface\n");
-        return 0;
-    }
+    sr->tx = tx;
+    return 0;
+} /* -- sr_tx_init -- */
 
-    /* TODO */
-    /* Check destination, hardware address.  If it is private (i.e. destined
-     * to a virtual interface) ensure it is going to the correct topology
-     * Note: This check should really be done server side ...
-     */
+void sr_tx_destroy(struct sr_instance* sr)
+{
+    if ( sr->tx == 0 )
+    { return; }
 
-    return 1;
+    if ( sr->tx->writes > 0 )
+    {
+        printf("Sent %lu batched packets in %lu writes\n",
+                sr->tx->frames, sr->tx->writes);
+    }
 
-} /* -- sr_ether_addrs_match_interface -- */
+    pthread_mutex_destroy(&(sr->tx->lock));
+    free(sr->tx);
+    sr->tx = 0;
+} /* -- sr_tx_destroy -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_send_packet(..)
- * Scope: Global
+ * Method: sr_tx_accept_batch(..)
+ * Scope: local
  *
- * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * The server offered VNS_PACKET_BATCH.  Accept by sending VNS_BATCH_HELLO
+ * back, then use it for every flush of more than one packet.  Without a
+ * transmit queue nothing is batched, so the offer is left unanswered and
+ * the server keeps sending single packets.
  *
  *---------------------------------------------------------------------------*/
 
-int sr_send_packet(struct sr_instance* sr /* borrowed */,
-                         uint8_t* buf /* borrowed */ ,
-                         unsigned int len,
-                         const char* iface /* borrowed */)
+static int sr_tx_accept_batch(struct sr_instance* sr)
 {
-    c_packet_header *sr_pkt;
-    unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct sr_tx_queue* tx = sr->tx;
+    c_base hello;
+    struct iovec iov;
+    int ret = 0;
 
-    /* REQUIRES */
-    assert(sr);
-    assert(buf);
-    assert(iface);
+    if ( tx == 0 || tx->peer_batch )
+    { return 0; }
+
+    hello.mLen  = htonl(sizeof(c_base));
+    hello.mType = htonl(VNS_BATCH_HELLO);
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(c_base);
+
+    if ( sr_tx_flush(sr) != 0 )
+    { return -1; }
+
+    pthread_mutex_lock(&(tx->lock));
+    ret = sr_write_iov(sr, &iov, 1, sizeof(c_base));
+    pthread_mutex_unlock(&(tx->lock));
 
-    /* don't waste my time ... */
-    if ( len < sizeof(struct sr_ethernet_hdr) ){
-        fprintf(stderr , "** Error: packet is wayy to short \n");
+    if ( ret != 0 )
+    {
+        fprintf(stderr, "Error accepting packet batches\n");
         return -1;
     }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
-
-    /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
-
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
-        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
-        return -1;
+    tx->peer_batch = 1;
+    printf("Server supports packet batches, using them\n");
+    return 0;
+} /* -- sr_tx_accept_batch -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tx_flush(..)
+ * Scope: local
+ *
+ * Write every queued packet with one writev.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_tx_flush(struct sr_instance* sr)
+{
+    struct sr_tx_queue* tx = sr->tx;
+    int ret = 0;
+
+    /* -- other threads (workers) wrote theirs already -- */
+    if ( tx == 0 || !pthread_equal(tx->owner, pthread_self()) )
+    { return 0; }
+
+    if ( sr->shm != 0 )
+    {
+        pthread_mutex_lock(&(tx->lock));
+        sr_shm_kick(sr->shm);
+        pthread_mutex_unlock(&(tx->lock));
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
-        return -1;
+    if ( tx->count == 0 )
+    { return 0; }
+
+    pthread_mutex_lock(&(tx->lock));
+    if ( tx->peer_batch && tx->count > 1 )
+    {
+        /* -- one VNS_PACKET_BATCH around all of them -- */
+        tx->batch_hdr.mLen  = htonl(sizeof(c_packet_batch) + tx->bytes);
+        tx->batch_hdr.mType = htonl(VNS_PACKET_BATCH);
+        tx->iov[0].iov_base = &(tx->batch_hdr);
+        tx->iov[0].iov_len  = sizeof(c_packet_batch);
+        ret = sr_write_iov(sr, tx->iov, 2 * tx->count + 1,
+                sizeof(c_packet_batch) + tx->bytes);
+    }
+    else
+    {
+        ret = sr_write_iov(sr, tx->iov + 1, 2 * tx->count, tx->bytes);
     }
+    pthread_mutex_unlock(&(tx->lock));
 
-    free(sr_pkt);
+    tx->frames += tx->count;
+    tx->writes++;
+    tx->count = 0;
+    tx->bytes = 0;
+    tx->copy_used = 0;
 
+    if ( ret != 0 )
+    {
+        fprintf(stderr, "Error writing packet\n");
+        return -1;
+    }
     return 0;
-} /* -- sr_send_packet -- */
+} /* -- sr_tx_flush -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_log_packet()
- * Scope: Local
+ * Method: sr_vns_send(..)
+ * Scope: local
+ *
+ * Send a packet (ethernet header included!) of length 'len' to the server
+ * to be injected onto the wire.  sr_send_packet(..) has checked it.
  *
  *---------------------------------------------------------------------------*/
 
-void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
+static int sr_vns_send(struct sr_instance* sr /* borrowed */,
+                       uint8_t* buf /* borrowed */ ,
+                       unsigned int len,
+                       struct sr_if* if_out /* borrowed */)
 {
-    struct pcap_pkthdr h;
-    int size;
+    const char* iface = if_out->name;
+    struct sr_tx_queue* tx = sr->tx;
+    c_packet_header sr_pkt;
+    struct iovec iov[2];
+    unsigned int total_len =  len + (sizeof(c_packet_header));
+    uint8_t* rx_bufs = 0;
+    int shm_used = 0;
+    int ret = 0;
 
-    /* REQUIRES */
-    assert(sr);
+    /* -- shared memory: copy into the ring, the server is woken at the
+          end of the batch (or now, from other threads) -- */
+    if ( sr->shm != 0 )
+    {
+        if ( tx != 0 )
+        { pthread_mutex_lock(&(tx->lock)); }
+        shm_used = (sr->shm != 0 && sr->shm->ready);
+        if ( shm_used )
+        {
+            ret = sr_shm_send(sr->shm, buf, len, iface);
+            if ( tx == 0 || tx->batch <= 1 ||
+                 !pthread_equal(tx->owner, pthread_self()) )
+            { sr_shm_kick(sr->shm); }
+        }
+        if ( tx != 0 )
+        { pthread_mutex_unlock(&(tx->lock)); }
 
-    if(!sr->logfile)
-    {return; }
+        if ( shm_used )
+        { return ret; }
+    }
 
-    size = min(PACKET_DUMP_SIZE, len);
+    /* -- queue it if we are the reading thread, it goes out with the
+          rest of this receive batch -- */
+    if ( tx != 0 && tx->batch > 1 && pthread_equal(tx->owner, pthread_self())
+            && len <= SR_TX_COPY_SIZE )
+    {
+        if ( tx->count == tx->batch || len > SR_TX_COPY_SIZE - tx->copy_used )
+        {
+            if ( sr_tx_flush(sr) != 0 )
+            { return -1; }
+        }
+
+        tx->hdrs[tx->count].mLen  = htonl(total_len);
+        tx->hdrs[tx->count].mType = htonl(VNSPACKET);
+        strncpy(tx->hdrs[tx->count].mInterfaceName,iface,16);
+        tx->iov[2 * tx->count + 1].iov_base = &(tx->hdrs[tx->count]);
+        tx->iov[2 * tx->count + 1].iov_len  = sizeof(c_packet_header);
+
+        /* -- frames in the rx ring stay put until the flush (nothing
+              changes a packet after sending it), anything else may be
+              freed by the caller once we return -- */
+        if ( sr->rx != 0 )
+        { rx_bufs = (uint8_t*)sr->rx->bufs; }
+        if ( rx_bufs != 0 && buf >= rx_bufs &&
+             buf + len <= rx_bufs + sizeof(sr->rx->bufs) )
+        {
+            tx->iov[2 * tx->count + 2].iov_base = buf;
+        }
+        else
+        {
+            memcpy(tx->copy + tx->copy_used, buf, len);
+            tx->iov[2 * tx->count + 2].iov_base = tx->copy + tx->copy_used;
+            tx->copy_used += len;
+        }
+        tx->iov[2 * tx->count + 2].iov_len = len;
+
+        tx->count++;
+        tx->bytes += total_len;
+        return 0;
+    }
+
+    /* Create header, the frame is sent from the caller's buffer */
+    sr_pkt.mLen  = htonl(total_len);
+    sr_pkt.mType = htonl(VNSPACKET);
+    strncpy(sr_pkt.mInterfaceName,iface,16);
+
+    iov[0].iov_base = &sr_pkt;
+    iov[0].iov_len  = sizeof(c_packet_header);
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = len;
 
-    gettimeofday(&h.ts, 0);
-    h.caplen = size;
-    h.len = (size < PACKET_DUMP_SIZE) ? size : PACKET_DUMP_SIZE;
+    if ( tx != 0 )
+    { pthread_mutex_lock(&(tx->lock)); }
+    ret = sr_write_iov(sr, iov, 2, total_len);
+    if ( tx != 0 )
+    { pthread_mutex_unlock(&(tx->lock)); }
+
+    if ( ret != 0 )
+    {
+        fprintf(stderr, "Error writing packet\n");
+        return -1;
+    }
 
-    sr_dump(sr->logfile, &h, buf);
-    fflush(sr->logfile);
-} /* -- sr_log_packet -- */
+    return 0;
+} /* -- sr_vns_send -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_arp_req_not_for_us()
- * Scope: Local
+ * Method: sr_rx_pending(..)
+ * Scope: local
+ *
+ * Is there a complete message in the receive ring, or a packet in the
+ * shared memory ring, i.e. can the next read be done without waiting ?
  *
  *---------------------------------------------------------------------------*/
 
-int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                           uint8_t * packet /* lent */,
-                           unsigned int len,
-                           char* interface  /* lent */)
+static int sr_rx_pending(struct sr_instance* sr)
 {
-    struct sr_if* iface = sr_get_interface(sr, interface);
-    struct sr_ethernet_hdr* e_hdr = 0;
-    struct sr_arp_hdr*       a_hdr = 0;
+    struct sr_rx_ring* rx = sr->rx;
+    uint32_t msg_len = 0;
+    uint8_t* shm_frame = 0;
+    unsigned int shm_len = 0;
+    char* shm_name = 0;
+
+    if ( sr->shm != 0 && sr_shm_next(sr->shm, &shm_frame, &shm_len, &shm_name) )
+    { return 1; }
 
-    if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr) )
+    if ( rx == 0 || rx->end - rx->start < 4 )
     { return 0; }
 
-    assert(iface);
+    memcpy(&msg_len, rx->bufs[rx->cur] + rx->start, 4);
+    return rx->end - rx->start >= ntohl(msg_len);
+} /* -- sr_rx_pending -- */
 
-    e_hdr = (struct sr_ethernet_hdr*)packet;
-    a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
+/*-----------------------------------------------------------------------------
+ * vns packet I/O driver, see sr_io.h
+ *---------------------------------------------------------------------------*/
 
-    if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
-            (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
-    { return 1; }
+/* -- arg is server:port -- */
+static int sr_vns_open(struct sr_instance* sr, const char* arg)
+{
+    char server[256];
+    const char* port = 0;
+
+    if ( arg == 0 || (port = strrchr(arg, ':')) == 0 ||
+         (size_t)(port - arg) >= sizeof(server) )
+    {
+        fprintf(stderr, "vns driver needs server:port\n");
+        return -1;
+    }
+
+    memcpy(server, arg, port - arg);
+    server[port - arg] = 0;
+
+    return sr_connect_to_server(sr, (unsigned short)atoi(port + 1), server);
+} /* -- sr_vns_open -- */
+
+/* -- the server sends VNSHWINFO right after the open -- */
+static int sr_vns_discover(struct sr_instance* sr)
+{
+    while ( sr->if_count == 0 )
+    {
+        if ( sr_read_from_server(sr) != 1 )
+        { return -1; }
+    }
 
     return 0;
-} /* -- sr_arp_req_not_for_us -- */
+} /* -- sr_vns_discover -- */
+
+/* -- everything one recv() returned -- */
+static int sr_vns_rx_batch(struct sr_instance* sr)
+{
+    int ret = 0;
+
+    do
+    { ret = sr_read_from_server(sr); }
+    while ( ret == 1 && sr_rx_pending(sr) );
+
+    return ret;
+} /* -- sr_vns_rx_batch -- */
+
+static void sr_vns_close(struct sr_instance* sr)
+{
+    if ( sr->shm != 0 )
+    { sr_shm_drop(sr); }
+
+    free(sr->rx);
+    sr->rx = 0;
+
+    if ( sr->sockfd >= 0 )
+    {
+        close(sr->sockfd);
+        sr->sockfd = -1;
+    }
+} /* -- sr_vns_close -- */
+
+struct sr_io_driver sr_vns_driver =
+{
+    "vns",
+    sr_vns_open,
+    sr_vns_discover,
+    sr_vns_rx_batch,
+    sr_vns_send,
+    sr_tx_flush,
+    sr_vns_close
+};
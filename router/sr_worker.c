@@ -0,0 +1,289 @@
+/**********************************************************************
+ * file: sr_worker.c
+ *
+ * Description:
+ *
+ * This file contains the worker threads that run sr_handlepacket() off
+ * the receiving thread, and the steering that picks a worker per flow.
+ * See sr_worker.h.
+ *
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <netinet/in.h>
+
+#include "sr_worker.h"
+#include "sr_if.h"
+#include "sr_io.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+static unsigned int sr_worker_hash(uint32_t ipSrc, uint32_t ipDst, uint16_t portSrc, uint16_t portDst, uint8_t ipP) {
+	uint32_t h = ipSrc * 2654435761u;
+	h ^= ipDst * 2246822519u;
+	h ^= ((uint32_t) portSrc << 16 | portDst) * 3266489917u;
+	h ^= ipP * 668265263u;
+
+	/* Mix the high bits down, the worker is taken mod the count */
+	h ^= h >> 16;
+	h *= 0x45d9f3bu;
+	return h ^ (h >> 16);
+}
+
+/* Worker for a frame. Only needs to be the same for every packet of a flow
+   (and, with NAT, for both directions of a mapping); anything it can't
+   parse goes to worker 0 */
+static unsigned int sr_worker_steer(struct sr_instance *sr, uint8_t *frame, unsigned int len, struct sr_if *iface) {
+	unsigned int count = sr->workers->count;
+	uint16_t type = ethertype(frame);
+
+	/* ARP by sender, so a neighbour's replies are handled in order */
+	if (type == ethertype_arp) {
+		if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+			return 0;
+		}
+		sr_arp_hdr_t *arpHeader = (sr_arp_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+		return sr_worker_hash(arpHeader->ar_sip, 0, 0, 0, 0) % count;
+	}
+
+	if (type != ethertype_ip || len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+		return 0;
+	}
+
+	sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+	unsigned int hdrLen = ipHeader->ip_hl * 4;
+	uint8_t *l4 = (uint8_t *) ipHeader + hdrLen;
+	uint16_t portSrc = 0, portDst = 0;
+
+	/* Fragments carry no ports, keep them together on the addresses */
+	if (!(ipHeader->ip_off & htons(IP_MF | IP_OFFMASK))) {
+		if ((ipHeader->ip_p == ip_protocol_tcp || ipHeader->ip_p == ip_protocol_udp)
+			&& len >= sizeof(sr_ethernet_hdr_t) + hdrLen + 4) {
+			portSrc = ((uint16_t *) l4)[0];
+			portDst = ((uint16_t *) l4)[1];
+
+		} else if (ipHeader->ip_p == ip_protocol_icmp && len >= sizeof(sr_ethernet_hdr_t) + hdrLen + sizeof(sr_icmp_hdr_t)) {
+			portSrc = portDst = ((sr_icmp_hdr_t *) l4)->icmp_identifier;
+		}
+	}
+
+	/* The NAT shard owning the mapping: by external port coming in, by
+	   internal address and port otherwise */
+	if (sr->natEnable) {
+		struct sr_if *externalIf = sr_get_interface_by_index(sr, sr->nat->extIfindex);
+		if (iface->index == sr->nat->extIfindex && ipHeader->ip_dst == externalIf->ip) {
+			return sr_nat_shard_ext(sr, portDst);
+		}
+		return sr_nat_shard_int(sr, ipHeader->ip_src, portSrc);
+	}
+
+	return sr_worker_hash(ipHeader->ip_src, ipHeader->ip_dst, portSrc, portDst, ipHeader->ip_p) % count;
+}
+
+static int sr_worker_ring_empty(struct sr_worker *worker) {
+	return __atomic_load_n(&(worker->head), __ATOMIC_SEQ_CST) == worker->tail;
+}
+
+/* Blocks until the receiving thread queues a frame or the workers stop */
+static void sr_worker_sleep(struct sr_worker *worker) {
+	struct sr_workers *workers = worker->sr->workers;
+	int spins;
+
+	/* Frames usually come in bursts, look again before paying for a wakeup */
+	for (spins = 0; spins < 64; spins++) {
+		if (!sr_worker_ring_empty(worker) || __atomic_load_n(&(workers->stopping), __ATOMIC_ACQUIRE)) {
+			return;
+		}
+		sched_yield();
+	}
+
+	pthread_mutex_lock(&(worker->lock));
+	__atomic_store_n(&(worker->sleeping), 1, __ATOMIC_SEQ_CST);
+	while (sr_worker_ring_empty(worker) && !__atomic_load_n(&(workers->stopping), __ATOMIC_ACQUIRE)) {
+		pthread_cond_wait(&(worker->wake), &(worker->lock));
+	}
+	__atomic_store_n(&(worker->sleeping), 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(worker->lock));
+}
+
+static void sr_worker_wake(struct sr_worker *worker) {
+	pthread_mutex_lock(&(worker->lock));
+	pthread_cond_signal(&(worker->wake));
+	pthread_mutex_unlock(&(worker->lock));
+}
+
+static void *sr_worker_run(void *arg) {
+	struct sr_worker *worker = (struct sr_worker *) arg;
+	struct sr_instance *sr = worker->sr;
+	struct sr_workers *workers = sr->workers;
+
+	pthread_setspecific(workers->self, worker);
+
+	while (1) {
+		/* Stopping is read first, so every frame queued before it is seen */
+		int stopping = __atomic_load_n(&(workers->stopping), __ATOMIC_ACQUIRE);
+		unsigned int head = __atomic_load_n(&(worker->head), __ATOMIC_ACQUIRE);
+		unsigned int tail = worker->tail;
+		unsigned int handled = 0;
+
+		if (head == tail) {
+			if (stopping) {
+				break;
+			}
+			sr_worker_sleep(worker);
+			continue;
+		}
+
+		/* Slots are released after the burst, the frames are used in place */
+		while (tail != head && handled < SR_WORKER_BURST) {
+			struct sr_worker_slot *slot = &(worker->slots[tail & (SR_WORKER_SLOTS - 1)]);
+			sr_handlepacket(sr, slot->data, slot->len, sr->if_table[slot->ifindex]);
+			if (slot->data != slot->frame) {
+				free(slot->data);
+			}
+			tail++;
+			handled++;
+		}
+
+		worker->packets += handled;
+		__atomic_store_n(&(worker->tail), tail, __ATOMIC_RELEASE);
+
+		/* What this burst sent goes out together */
+		sr->io->tx_batch(sr);
+	}
+
+	return NULL;
+}
+
+int sr_worker_start(struct sr_instance *sr) {
+	unsigned int i;
+
+	if (sr->numWorkers == 0) {
+		return 0;
+	}
+
+	struct sr_workers *workers = (struct sr_workers *) calloc(1, sizeof(struct sr_workers));
+	if (workers == NULL || pthread_key_create(&(workers->self), NULL) != 0) {
+		free(workers);
+		return -1;
+	}
+	workers->count = sr->numWorkers;
+	sr->workers = workers;
+
+	for (i = 0; i < workers->count; i++) {
+		struct sr_worker *worker;
+		if (posix_memalign((void **) &worker, SR_WORKER_CACHELINE, sizeof(struct sr_worker)) != 0) {
+			break;
+		}
+		memset(worker, 0, sizeof(struct sr_worker));
+		worker->sr = sr;
+		worker->index = i;
+		pthread_mutex_init(&(worker->lock), NULL);
+		pthread_cond_init(&(worker->wake), NULL);
+
+		if (pthread_create(&(worker->thread), NULL, sr_worker_run, worker) != 0) {
+			free(worker);
+			break;
+		}
+		workers->workers[i] = worker;
+	}
+
+	if (i < workers->count) {
+		fprintf(stderr, "Could not start worker %u\n", i);
+		workers->count = i;
+		sr_worker_stop(sr);
+		return -1;
+	}
+
+	printf("Data plane on %u worker threads\n", workers->count);
+	return 0;
+}
+
+void sr_worker_drain(struct sr_instance *sr) {
+	unsigned int i;
+
+	if (sr->workers == NULL) {
+		return;
+	}
+
+	for (i = 0; i < sr->workers->count; i++) {
+		struct sr_worker *worker = sr->workers->workers[i];
+		while (__atomic_load_n(&(worker->tail), __ATOMIC_ACQUIRE) != worker->head) {
+			sched_yield();
+		}
+	}
+}
+
+void sr_worker_stop(struct sr_instance *sr) {
+	struct sr_workers *workers = sr->workers;
+	unsigned int i;
+
+	if (workers == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&(workers->stopping), 1, __ATOMIC_RELEASE);
+	for (i = 0; i < workers->count; i++) {
+		sr_worker_wake(workers->workers[i]);
+	}
+
+	for (i = 0; i < workers->count; i++) {
+		struct sr_worker *worker = workers->workers[i];
+		pthread_join(worker->thread, NULL);
+		printf("Worker %u: %lu packets, %lu waited for a full ring\n", i, worker->packets, worker->waits);
+		pthread_cond_destroy(&(worker->wake));
+		pthread_mutex_destroy(&(worker->lock));
+		free(worker);
+	}
+
+	/* Frames are handled on this thread again. The timer thread, the only
+	   other caller of sr_worker_current(), is stopped before this */
+	sr->workers = NULL;
+	pthread_key_delete(workers->self);
+	free(workers);
+}
+
+void sr_worker_deliver(struct sr_instance *sr, uint8_t *frame, unsigned int len, struct sr_if *iface) {
+	struct sr_worker *worker = sr->workers->workers[sr_worker_steer(sr, frame, len, iface)];
+	unsigned int head = worker->head;
+
+	/* A full ring holds up the receiving thread rather than drop: the
+	   driver's own queues drop when it falls behind */
+	if (head - __atomic_load_n(&(worker->tail), __ATOMIC_ACQUIRE) == SR_WORKER_SLOTS) {
+		worker->waits++;
+		do {
+			sched_yield();
+		} while (head - __atomic_load_n(&(worker->tail), __ATOMIC_ACQUIRE) == SR_WORKER_SLOTS);
+	}
+
+	struct sr_worker_slot *slot = &(worker->slots[head & (SR_WORKER_SLOTS - 1)]);
+	if (len <= SR_WORKER_FRAME_MAX) {
+		slot->data = slot->frame;
+	} else if ((slot->data = (uint8_t *) malloc(len)) == NULL) {
+		return;
+	}
+	memcpy(slot->data, frame, len);
+	slot->len = len;
+	slot->ifindex = iface->index;
+
+	__atomic_store_n(&(worker->head), head + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the store to sleeping before the worker looks at head */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(worker->sleeping), __ATOMIC_RELAXED)) {
+		sr_worker_wake(worker);
+	}
+}
+
+int sr_worker_current(struct sr_instance *sr) {
+	struct sr_worker *worker;
+
+	if (sr->workers == NULL) {
+		return -1;
+	}
+	worker = (struct sr_worker *) pthread_getspecific(sr->workers->self);
+	return worker ? (int) worker->index : -1;
+}
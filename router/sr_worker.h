@@ -0,0 +1,83 @@
+/**********************************************************************
+ * file: sr_worker.h
+ *
+ * Description:
+ *
+ * Worker threads for the data plane (-w N). The thread running the I/O
+ * driver hands each received frame to a worker chosen by its flow, through
+ * one single-producer/single-consumer ring per worker, and the workers run
+ * sr_handlepacket(). Every packet of a flow goes to the same worker, so
+ * each flow stays in order.
+ *
+ * Each worker has its own flow cache (sr->flows[index]) and, with NAT, its
+ * own NAT shard (sr->nat[index]), which only hands out external ports
+ * equal to its index mod N. Packets to the NAT's external address are
+ * steered by that port and all others by source address and port, so
+ * both directions of a mapping land on the worker that owns it.
+ *
+ **********************************************************************/
+
+#ifndef SR_WORKER_H
+#define SR_WORKER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "sr_router.h"
+
+#define SR_WORKER_MAX 16
+#define SR_WORKER_SLOTS 1024			/* per ring, power of 2 */
+#define SR_WORKER_FRAME_MAX 1536		/* bigger frames are copied to the heap */
+#define SR_WORKER_BURST 64				/* frames handled between transmit flushes */
+#define SR_WORKER_CACHELINE 64
+
+struct sr_worker_slot {
+	uint8_t *data;				/* frame, or a malloc'd copy if it is too big */
+	unsigned int len;
+	unsigned int ifindex;		/* interface it arrived on */
+	uint8_t frame[SR_WORKER_FRAME_MAX];
+};
+
+struct sr_worker {
+	unsigned int head;			/* next slot to fill, written by the receiving thread */
+	unsigned long waits;		/* frames that found the ring full */
+	uint8_t pad1[SR_WORKER_CACHELINE - sizeof(unsigned int) - sizeof(unsigned long)];
+	unsigned int tail;			/* next slot to read, written by the worker */
+	int sleeping;				/* ring was empty, waiting on wake */
+	unsigned long packets;
+	uint8_t pad2[SR_WORKER_CACHELINE - 2 * sizeof(unsigned int) - sizeof(unsigned long)];
+	struct sr_worker_slot slots[SR_WORKER_SLOTS];
+
+	struct sr_instance *sr;
+	unsigned int index;
+	pthread_t thread;
+	pthread_mutex_t lock;		/* sleeping and wake */
+	pthread_cond_t wake;
+};
+
+struct sr_workers {
+	unsigned int count;
+	int stopping;				/* no more frames, exit once the rings are empty */
+	pthread_key_t self;			/* struct sr_worker of the calling thread */
+	struct sr_worker *workers[SR_WORKER_MAX];
+};
+
+/* Starts sr->numWorkers workers and sets sr->workers, after which
+   sr_io_deliver() hands frames to them. Returns 0 on success */
+int sr_worker_start(struct sr_instance *sr);
+
+/* Waits for the workers to handle every queued frame, then joins and frees
+   them. Stop the timer thread first, it may still call sr_worker_current() */
+void sr_worker_stop(struct sr_instance *sr);
+
+/* Waits until every frame handed to the workers has been handled */
+void sr_worker_drain(struct sr_instance *sr);
+
+/* Queues a frame for the worker owning its flow. Only the thread running
+   the I/O driver may call this */
+void sr_worker_deliver(struct sr_instance *sr, uint8_t *frame, unsigned int len, struct sr_if *iface);
+
+/* Index of the calling worker, or -1 if it is not one */
+int sr_worker_current(struct sr_instance *sr);
+
+#endif
@@ -143,6 +143,20 @@ typedef struct
 #define VNS_AUTH_REPLY   256
 #define VNS_AUTH_STATUS  512
 
+/* ******* Packet batching ******** */
+/* The server offers batching by sending VNS_BATCH_HELLO, the client
+   accepts by sending one back. Each side sends VNS_PACKET_BATCH only once
+   it has received the other's hello, so older peers only ever see
+   VNSPACKET */
+#define VNS_BATCH_HELLO  1024
+#define VNS_PACKET_BATCH 2048
+
+/* ******* Shared memory transport ******** */
+/* Offered by a server on the same host, see sr_shm.h. The server answers
+   VNS_SHM_READY once it has mapped the rings the client passed it */
+#define VNS_SHM_OFFER    4096
+#define VNS_SHM_READY    8192
+
 /* rtable */
 typedef struct
 {
@@ -196,5 +210,23 @@ typedef struct
 
 }__attribute__ ((__packed__)) c_auth_status;
 
+/* packet batch: the body is a sequence of complete VNSPACKET messages
+   (c_packet_header followed by the frame) */
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;
+    uint8_t  packets[0];
+}__attribute__ ((__packed__)) c_packet_batch;
+
+/* shared memory offer: where to send the rings */
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;
+    uint32_t cookie;       /* echoed with the rings to identify this session */
+    char     path[108];    /* Unix socket path */
+}__attribute__ ((__packed__)) c_shm_offer;
+
 
 #endif  /* __VNSCOMMAND_H */